@@ -18,15 +18,59 @@
  *     exec strat <stratum> <local-path> $@
  *
  * as it can pass its own argv[0] where as a hashbang loses this information.
+ *
+ * If the calling process is already in the target stratum and strat would not
+ * restrict the command, strat would just execute the target executable.  In
+ * this case bouncer does so itself, saving an execve() and dynamic loader run.
  */
 
 #include <errno.h>
 #include <limits.h>
 #include <linux/limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
+#define RESTRICTED_CMD_DIR "/bedrock/run/restricted_cmds/"
+#define RESTRICTED_CMD_DIR_LEN strlen(RESTRICTED_CMD_DIR)
+
+/*
+ * Returns non-zero if the current process is in the given stratum.
+ */
+int in_stratum(const char *const stratum)
+{
+	char current_stratum[PATH_MAX];
+	ssize_t len = getxattr("/", "user.bedrock.stratum", current_stratum, sizeof(current_stratum) - 1);
+	if (len < 0) {
+		return 0;
+	}
+	current_stratum[len] = '\0';
+
+	return strcmp(current_stratum, stratum) == 0;
+}
+
+/*
+ * Returns non-zero if strat may restrict the given command.  strat also
+ * checks the file's ownership and permissions; err on the side of deferring
+ * to strat if the file exists at all.
+ */
+int may_restrict_cmd(const char *const file)
+{
+	const char *cmd = strrchr(file, '/');
+	if (cmd != NULL) {
+		cmd++;
+	} else {
+		cmd = file;
+	}
+
+	char path[RESTRICTED_CMD_DIR_LEN + strlen(cmd) + 1];
+	strcpy(path, RESTRICTED_CMD_DIR);
+	strcat(path, cmd);
+
+	return access(path, F_OK) >= 0 || errno != ENOENT;
+}
+
 int main(int argc, char *argv[])
 {
 	/*
@@ -62,6 +106,14 @@ int main(int argc, char *argv[])
 		restrict_flag = 1;
 	}
 
+	/*
+	 * Skip strat if it would not do anything but execute the target.  If
+	 * this fails, fall back to strat which will report the error.
+	 */
+	if (!restrict_flag && in_stratum(target_stratum) && !may_restrict_cmd(target_path)) {
+		execv(target_path, argv);
+	}
+
 	char *strat = "/bedrock/bin/strat";
 	/*
 	 * Example:
@@ -0,0 +1,236 @@
+/*
+ * common.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * See common.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_IN_ROOT 0x10
+#endif
+
+struct open_how_compat {
+	uint64_t flags;
+	uint64_t mode;
+	uint64_t resolve;
+};
+
+static int have_openat2 = 1;
+
+static size_t next_index = 0;
+static size_t index_cnt = 0;
+static void (*index_fn)(size_t i) = NULL;
+
+void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+	if (p == NULL) {
+		fprintf(stderr, "%s: out of memory\n", program_invocation_short_name);
+		exit(1);
+	}
+	return p;
+}
+
+void *xrealloc(void *p, size_t n)
+{
+	p = realloc(p, n);
+	if (p == NULL) {
+		fprintf(stderr, "%s: out of memory\n", program_invocation_short_name);
+		exit(1);
+	}
+	return p;
+}
+
+char *xstrdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	return memcpy(xmalloc(len), s, len);
+}
+
+char *read_file(int fd, size_t *len_out)
+{
+	size_t alloc = 4096;
+	size_t len = 0;
+	char *buf = xmalloc(alloc);
+	for (;;) {
+		if (len + 1 >= alloc) {
+			alloc *= 2;
+			buf = xrealloc(buf, alloc);
+		}
+		ssize_t r = read(fd, buf + len, alloc - len - 1);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			free(buf);
+			return NULL;
+		} else if (r == 0) {
+			break;
+		}
+		len += r;
+	}
+	buf[len] = '\0';
+	if (len_out != NULL) {
+		*len_out = len;
+	}
+	return buf;
+}
+
+char *trim(char *s)
+{
+	while (*s == ' ' || *s == '\t' || *s == '\r') {
+		s++;
+	}
+	char *end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+		end--;
+	}
+	*end = '\0';
+	return s;
+}
+
+int cfg_load(void (*fn)(const char *section, const char *key, char *value))
+{
+	int fd = open(CONFIG_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: unable to open \"%s\": %s\n", program_invocation_short_name, CONFIG_PATH,
+			strerror(errno));
+		return -1;
+	}
+	char *buf = read_file(fd, NULL);
+	int err = errno;
+	close(fd);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: unable to read \"%s\": %s\n", program_invocation_short_name, CONFIG_PATH,
+			strerror(err));
+		return -1;
+	}
+
+	/*
+	 * Join continued lines.
+	 */
+	char *w = buf;
+	for (char *r = buf; *r != '\0'; r++) {
+		if (r[0] == '\\' && r[1] == '\n') {
+			r++;
+		} else {
+			*w++ = *r;
+		}
+	}
+	*w = '\0';
+
+	const char *section = "";
+	char *save = NULL;
+	for (char *line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		line[strcspn(line, "#;")] = '\0';
+		line = trim(line);
+		size_t len = strlen(line);
+		if (len == 0) {
+			continue;
+		}
+		if (line[0] == '[' && line[len - 1] == ']') {
+			line[len - 1] = '\0';
+			section = trim(line + 1);
+			continue;
+		}
+		char *eq = strchr(line, '=');
+		if (eq == NULL) {
+			continue;
+		}
+		*eq = '\0';
+		char *k = line;
+		for (char *c = line; *c != '\0'; c++) {
+			if (*c != ' ' && *c != '\t' && *c != '\r') {
+				*k++ = *c;
+			}
+		}
+		*k = '\0';
+		fn(section, line, trim(eq + 1));
+	}
+
+	free(buf);
+	return 0;
+}
+
+int open_in_root(int root_fd, const char *path, int flags)
+{
+	while (*path == '/') {
+		path++;
+	}
+	if (*path == '\0') {
+		path = ".";
+	}
+
+	if (__atomic_load_n(&have_openat2, __ATOMIC_RELAXED)) {
+		struct open_how_compat how = {
+			.flags = flags | O_CLOEXEC,
+			.mode = 0,
+			.resolve = RESOLVE_IN_ROOT,
+		};
+		int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS) {
+			return fd;
+		}
+		__atomic_store_n(&have_openat2, 0, __ATOMIC_RELAXED);
+	}
+	return openat(root_fd, path, flags | O_CLOEXEC);
+}
+
+static void *index_worker(void *arg)
+{
+	(void)arg;
+	size_t i;
+	while ((i = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED)) < index_cnt) {
+		index_fn(i);
+	}
+	return NULL;
+}
+
+void for_each_index(size_t cnt, void (*fn)(size_t i))
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > MAX_WORKERS) {
+		threads = MAX_WORKERS;
+	}
+	if ((size_t)threads > cnt) {
+		threads = cnt;
+	}
+
+	next_index = 0;
+	index_cnt = cnt;
+	index_fn = fn;
+	pthread_t tids[MAX_WORKERS];
+	long started = 0;
+	for (long i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL, index_worker, NULL) == 0) {
+			started++;
+		}
+	}
+	index_worker(NULL);
+	for (long i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
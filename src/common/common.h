@@ -0,0 +1,66 @@
+/*
+ * common.h
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Helpers shared by the native tools which stand in for common-code
+ * functions, such as enforce and strata-status.  Programs build common.c
+ * alongside their own source.
+ */
+
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stddef.h>
+
+#define CONFIG_PATH "/bedrock/etc/bedrock.conf"
+#define STRATA_PATH "/bedrock/strata/"
+#define INIT_ROOT "/proc/1/root"
+
+/*
+ * Upper bound on worker threads.
+ */
+#define MAX_WORKERS 64
+
+/*
+ * Allocation which exits upon failure.
+ */
+void *xmalloc(size_t n);
+void *xrealloc(void *p, size_t n);
+char *xstrdup(const char *s);
+
+/*
+ * Read a whole file into a NUL-terminated buffer.  Returns NULL on failure.
+ */
+char *read_file(int fd, size_t *len_out);
+
+/*
+ * Remove leading and trailing spaces, tabs, and carriage returns in place.
+ */
+char *trim(char *s);
+
+/*
+ * Parse bedrock.conf following the same rules as common-code's cfg_preparse,
+ * cfg_keys, and cfg_values: backslash-newline joins lines, `#` and `;` start
+ * comments, and whitespace is removed from keys.  fn is called with every
+ * key-value pair in order, with the value trimmed but otherwise unsplit.  fn
+ * may modify the value.
+ */
+int cfg_load(void (*fn)(const char *section, const char *key, char *value));
+
+/*
+ * Open a path within a root, resolving symlinks as though the root were the
+ * filesystem root.
+ */
+int open_in_root(int root_fd, const char *path, int flags);
+
+/*
+ * Call fn with every index below cnt, spread across up to one thread per CPU.
+ */
+void for_each_index(size_t cnt, void (*fn)(size_t i));
+
+#endif
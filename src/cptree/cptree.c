@@ -0,0 +1,897 @@
+/*
+ * cptree.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program copies a directory tree, such as a stratum, preserving
+ * everything `cp -a` would and then some:
+ *
+ * - file types, including devices, fifos, sockets, and symlinks
+ * - hard links within the tree
+ * - ownership, permissions, and access/modification times
+ * - all extended attributes, which includes user.bedrock.* attributes, POSIX
+ *   ACLs, and file capabilities
+ * - sparse files
+ *
+ * Regular file contents are reflinked with FICLONE where the filesystem
+ * supports it, such that copying a stratum on a copy-on-write filesystem such
+ * as btrfs or XFS is nearly instant and uses no additional space.  Otherwise
+ * copy_file_range() is used, which lets the kernel copy without bouncing data
+ * through userspace, falling back to read()/write() where needed.
+ *
+ * Directories are copied in parallel.  Each worker thread has a deque of
+ * directories to copy.  A worker pushes subdirectories it finds onto its own
+ * deque and pops from the same end, such that it works depth-first and keeps
+ * few directories open.  Idle workers steal from the other end of other
+ * workers' deques, which tends to hold the largest remaining subtrees.
+ *
+ * A directory's metadata is applied once it and all of its subdirectories
+ * have been copied, as creating entries in it would otherwise change its
+ * modification time and a restrictive mode could prevent populating it.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+/*
+ * Upper bound on worker threads.
+ */
+#define MAX_WORKERS 64
+
+/*
+ * Stop reporting individual errors after this many.
+ */
+#define MAX_REPORTED_ERRORS 16
+
+/*
+ * When reporting progress, emit this many lines in total.  Pipe into
+ * `progress_bar PROGRESS_LINES`.
+ */
+#define PROGRESS_LINES 1000
+
+/*
+ * Buffer size for read()/write() fallback.
+ */
+#define COPY_BUF_SIZE (128 * 1024)
+
+struct dir_task {
+	/*
+	 * Directory containing this one, or NULL for the top directory.
+	 */
+	struct dir_task *parent;
+	int src_fd;
+	int dst_fd;
+	/*
+	 * Source directory's metadata, applied to the destination directory
+	 * once it is fully populated.
+	 */
+	struct stat stbuf;
+	/*
+	 * Number of outstanding pieces of work which must complete before
+	 * this directory's metadata may be applied: one for its own scan plus
+	 * one per subdirectory.
+	 */
+	unsigned long pending;
+	/*
+	 * Path relative to the top directory, used to hard link to files
+	 * found elsewhere in the tree.  Empty for the top directory.
+	 */
+	char *rel;
+	/*
+	 * Name relative to parent.
+	 */
+	char name[];
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct dir_task **tasks;
+	size_t head;
+	size_t tail;
+	size_t alloc;
+};
+
+/*
+ * Files with multiple hard links, keyed by source device and inode, mapped to
+ * the path of the first copy relative to the destination top directory.
+ */
+struct link_entry {
+	dev_t dev;
+	ino_t ino;
+	char *rel;
+};
+
+static struct deque deques[MAX_WORKERS];
+static int worker_cnt;
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long queued = 0;
+static int done = 0;
+
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct link_entry *links = NULL;
+static size_t link_cnt = 0;
+static size_t link_alloc = 0;
+
+static int dst_top_fd;
+static struct stat dst_top_stat;
+static const char *exclude = NULL;
+
+static unsigned long error_cnt = 0;
+
+static int progress = 0;
+static unsigned long progress_total = 0;
+static unsigned long progress_cnt = 0;
+static unsigned long progress_printed = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report(const char *path, const char *name, const char *msg, int err)
+{
+	unsigned long cnt = __atomic_fetch_add(&error_cnt, 1, __ATOMIC_RELAXED);
+	if (cnt < MAX_REPORTED_ERRORS) {
+		fprintf(stderr, "cptree: %s \"%s%s%s\": %s\n", msg, path, path[0] ? "/" : "", name, strerror(err));
+	} else if (cnt == MAX_REPORTED_ERRORS) {
+		fprintf(stderr, "cptree: further errors suppressed\n");
+	}
+}
+
+/*
+ * Emit progress lines proportional to the number of entries copied so far.
+ */
+static void progress_update(unsigned long n)
+{
+	if (!progress) {
+		return;
+	}
+	unsigned long cnt = __atomic_add_fetch(&progress_cnt, n, __ATOMIC_RELAXED);
+	unsigned long target = progress_total ? cnt * PROGRESS_LINES / progress_total : 0;
+	if (target > PROGRESS_LINES - 1) {
+		target = PROGRESS_LINES - 1;
+	}
+	if (target <= __atomic_load_n(&progress_printed, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	pthread_mutex_lock(&progress_lock);
+	for (; progress_printed < target; progress_printed++) {
+		fputs("x\n", stdout);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&progress_lock);
+}
+
+static void progress_finish(void)
+{
+	if (!progress) {
+		return;
+	}
+	for (; progress_printed < PROGRESS_LINES; progress_printed++) {
+		fputs("x\n", stdout);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Count entries for progress reporting.  This only reads directories, which
+ * is cheap relative to copying.
+ */
+static unsigned long count_entries(int fd, int top)
+{
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	unsigned long cnt = 0;
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (dir->d_name[0] == '.' && (dir->d_name[1] == '\0'
+				|| (dir->d_name[1] == '.' && dir->d_name[2] == '\0'))) {
+			continue;
+		}
+		if (top && exclude != NULL && strcmp(dir->d_name, exclude) == 0) {
+			continue;
+		}
+		cnt++;
+		if (dir->d_type == DT_DIR || dir->d_type == DT_UNKNOWN) {
+			int sub_fd = openat(dirfd(d), dir->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub_fd >= 0) {
+				cnt += count_entries(sub_fd, 0);
+			}
+		}
+	}
+	closedir(d);
+	return cnt;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "cptree: unable to allocate memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static char *join(const char *rel, const char *name)
+{
+	size_t rel_len = strlen(rel);
+	size_t name_len = strlen(name);
+	char *path = xmalloc(rel_len + name_len + 2);
+	memcpy(path, rel, rel_len);
+	if (rel_len > 0) {
+		path[rel_len++] = '/';
+	}
+	memcpy(path + rel_len, name, name_len + 1);
+	return path;
+}
+
+static void push(int worker, struct dir_task *task)
+{
+	struct deque *d = &deques[worker];
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == d->alloc) {
+		size_t new_alloc = d->alloc ? d->alloc * 2 : 64;
+		struct dir_task **new_tasks = xmalloc(new_alloc * sizeof(struct dir_task *));
+		for (size_t i = d->head; i < d->tail; i++) {
+			new_tasks[i - d->head] = d->tasks[i % d->alloc];
+		}
+		free(d->tasks);
+		d->tasks = new_tasks;
+		d->tail -= d->head;
+		d->head = 0;
+		d->alloc = new_alloc;
+	}
+	d->tasks[d->tail % d->alloc] = task;
+	d->tail++;
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_mutex_lock(&idle_lock);
+	queued++;
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Take a task from a deque.  The owner takes the most recently pushed task;
+ * thieves take the oldest.
+ */
+static struct dir_task *take(int worker, int steal)
+{
+	struct deque *d = &deques[worker];
+	struct dir_task *task = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head) {
+		if (steal) {
+			task = d->tasks[d->head % d->alloc];
+			d->head++;
+		} else {
+			d->tail--;
+			task = d->tasks[d->tail % d->alloc];
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (task != NULL) {
+		pthread_mutex_lock(&idle_lock);
+		queued--;
+		pthread_mutex_unlock(&idle_lock);
+	}
+	return task;
+}
+
+/*
+ * Copy extended attributes.  If follow is set, paths are dereferenced, which
+ * is used with /proc/self/fd/<fd> paths.  Otherwise they are not, which is
+ * used for symlinks and other files which cannot be opened.
+ */
+static void copy_xattrs(const char *src, const char *dst, int follow, const char *rel, const char *name)
+{
+	ssize_t (*list)(const char *, char *, size_t) = follow ? listxattr : llistxattr;
+	ssize_t (*get)(const char *, const char *, void *, size_t) = follow ? getxattr : lgetxattr;
+	int (*set)(const char *, const char *, const void *, size_t, int) = follow ? setxattr : lsetxattr;
+
+	char names_buf[4096];
+	char *names = names_buf;
+	ssize_t names_len = list(src, names, sizeof(names_buf));
+	if (names_len < 0 && errno == ERANGE) {
+		names_len = list(src, NULL, 0);
+		if (names_len > 0) {
+			names = xmalloc(names_len);
+			names_len = list(src, names, names_len);
+		}
+	}
+	if (names_len < 0) {
+		if (errno != ENOTSUP && errno != EOPNOTSUPP) {
+			report(rel, name, "unable to list xattrs of", errno);
+		}
+		goto free_names;
+	}
+
+	char value_buf[4096];
+	for (char *key = names; key < names + names_len; key += strlen(key) + 1) {
+		char *value = value_buf;
+		ssize_t value_len = get(src, key, value, sizeof(value_buf));
+		if (value_len < 0 && errno == ERANGE) {
+			value_len = get(src, key, NULL, 0);
+			if (value_len > 0) {
+				value = xmalloc(value_len);
+				value_len = get(src, key, value, value_len);
+			}
+		}
+		if (value_len < 0) {
+			report(rel, name, "unable to read xattr of", errno);
+		} else if (set(dst, key, value, value_len, 0) < 0 && errno != ENOTSUP && errno != EOPNOTSUPP) {
+			report(rel, name, "unable to set xattr on", errno);
+		}
+		if (value != value_buf) {
+			free(value);
+		}
+	}
+
+free_names:
+	if (names != names_buf) {
+		free(names);
+	}
+}
+
+/*
+ * Apply ownership, permissions, xattrs, and timestamps to a file we have open.
+ *
+ * Ownership must be set before permissions and xattrs, as chown() clears
+ * setuid/setgid bits and file capabilities.
+ */
+static void apply_meta_fd(int src_fd, int dst_fd, const struct stat *stbuf, const char *rel, const char *name)
+{
+	if (fchown(dst_fd, stbuf->st_uid, stbuf->st_gid) < 0) {
+		report(rel, name, "unable to set ownership of", errno);
+	}
+	if (fchmod(dst_fd, stbuf->st_mode & 07777) < 0) {
+		report(rel, name, "unable to set permissions of", errno);
+	}
+
+	char src[64];
+	char dst[64];
+	snprintf(src, sizeof(src), "/proc/self/fd/%d", src_fd);
+	snprintf(dst, sizeof(dst), "/proc/self/fd/%d", dst_fd);
+	copy_xattrs(src, dst, 1, rel, name);
+
+	struct timespec times[2] = { stbuf->st_atim, stbuf->st_mtim };
+	if (futimens(dst_fd, times) < 0) {
+		report(rel, name, "unable to set timestamps of", errno);
+	}
+}
+
+/*
+ * Apply metadata to a file which we cannot open, such as a symlink or device.
+ */
+static void apply_meta_at(struct dir_task *task, const char *name, const struct stat *stbuf)
+{
+	if (fchownat(task->dst_fd, name, stbuf->st_uid, stbuf->st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		report(task->rel, name, "unable to set ownership of", errno);
+	}
+	if (!S_ISLNK(stbuf->st_mode) && fchmodat(task->dst_fd, name, stbuf->st_mode & 07777, 0) < 0) {
+		report(task->rel, name, "unable to set permissions of", errno);
+	}
+
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	int s = snprintf(src, sizeof(src), "/proc/self/fd/%d/%s", task->src_fd, name);
+	int d = snprintf(dst, sizeof(dst), "/proc/self/fd/%d/%s", task->dst_fd, name);
+	if (s > 0 && s < (int)sizeof(src) && d > 0 && d < (int)sizeof(dst)) {
+		copy_xattrs(src, dst, 0, task->rel, name);
+	}
+
+	struct timespec times[2] = { stbuf->st_atim, stbuf->st_mtim };
+	if (utimensat(task->dst_fd, name, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		report(task->rel, name, "unable to set timestamps of", errno);
+	}
+}
+
+/*
+ * Copy a range of a file, preferring copy_file_range().
+ */
+static int copy_range(int in, int out, off_t off, off_t len, int *use_cfr)
+{
+	while (len > 0 && *use_cfr) {
+		loff_t in_off = off;
+		loff_t out_off = off;
+		ssize_t n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+		if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+			*use_cfr = 0;
+			break;
+		} else if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			return 0;
+		}
+		off += n;
+		len -= n;
+	}
+
+	static __thread char buf[COPY_BUF_SIZE];
+	while (len > 0) {
+		ssize_t n = pread(in, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, off);
+		if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			return 0;
+		}
+		for (ssize_t w = 0; w < n;) {
+			ssize_t m = pwrite(out, buf + w, n - w, off + w);
+			if (m < 0) {
+				return -1;
+			}
+			w += m;
+		}
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Copy file contents.  Reflink if possible; otherwise copy only the data
+ * regions such that holes in sparse files are preserved.
+ */
+static int copy_data(int in, int out, off_t size)
+{
+	if (ioctl(out, FICLONE, in) == 0) {
+		return 0;
+	}
+
+	int use_cfr = 1;
+	off_t off = 0;
+	while (off < size) {
+		off_t data = lseek(in, off, SEEK_DATA);
+		off_t hole;
+		if (data < 0 && errno == ENXIO) {
+			/*
+			 * Remainder of file is a hole.
+			 */
+			break;
+		} else if (data < 0) {
+			/*
+			 * Filesystem does not support SEEK_DATA.  Treat the
+			 * entire file as data.
+			 */
+			data = off;
+			hole = size;
+		} else if ((hole = lseek(in, data, SEEK_HOLE)) < 0) {
+			hole = size;
+		}
+		if (copy_range(in, out, data, hole - data, &use_cfr) < 0) {
+			return -1;
+		}
+		off = hole;
+	}
+
+	return ftruncate(out, size);
+}
+
+static size_t link_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+/*
+ * Find the slot for a given device/inode pair in the open-addressed link
+ * table.  The slot is either the matching entry or an empty one.
+ */
+static struct link_entry *link_slot(struct link_entry *table, size_t alloc, dev_t dev, ino_t ino)
+{
+	for (size_t i = link_hash(dev, ino) & (alloc - 1);; i = (i + 1) & (alloc - 1)) {
+		if (table[i].rel == NULL || (table[i].dev == dev && table[i].ino == ino)) {
+			return &table[i];
+		}
+	}
+}
+
+static char *link_find(const struct stat *stbuf)
+{
+	if (link_alloc == 0) {
+		return NULL;
+	}
+	return link_slot(links, link_alloc, stbuf->st_dev, stbuf->st_ino)->rel;
+}
+
+static void link_insert(const struct stat *stbuf, char *rel)
+{
+	if ((link_cnt + 1) * 2 > link_alloc) {
+		size_t new_alloc = link_alloc ? link_alloc * 2 : 64;
+		struct link_entry *new_links = calloc(new_alloc, sizeof(struct link_entry));
+		if (new_links == NULL) {
+			fprintf(stderr, "cptree: unable to allocate memory\n");
+			exit(1);
+		}
+		for (size_t i = 0; i < link_alloc; i++) {
+			if (links[i].rel != NULL) {
+				*link_slot(new_links, new_alloc, links[i].dev, links[i].ino) = links[i];
+			}
+		}
+		free(links);
+		links = new_links;
+		link_alloc = new_alloc;
+	}
+	struct link_entry *slot = link_slot(links, link_alloc, stbuf->st_dev, stbuf->st_ino);
+	slot->dev = stbuf->st_dev;
+	slot->ino = stbuf->st_ino;
+	slot->rel = rel;
+	link_cnt++;
+}
+
+static void copy_file(struct dir_task *task, const char *name, const struct stat *stbuf)
+{
+	int in = openat(task->src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (in < 0) {
+		report(task->rel, name, "unable to open", errno);
+		return;
+	}
+
+	int out;
+	if (stbuf->st_nlink > 1) {
+		/*
+		 * Create the first copy while holding the lock such that any
+		 * other link to it found concurrently has something to link
+		 * to.  The link will share the contents once they are
+		 * written.
+		 */
+		pthread_mutex_lock(&link_lock);
+		char *existing = link_find(stbuf);
+		if (existing != NULL) {
+			if (linkat(dst_top_fd, existing, task->dst_fd, name, 0) < 0) {
+				report(task->rel, name, "unable to hard link", errno);
+			}
+			pthread_mutex_unlock(&link_lock);
+			close(in);
+			return;
+		}
+		out = openat(task->dst_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (out >= 0) {
+			link_insert(stbuf, join(task->rel, name));
+		}
+		pthread_mutex_unlock(&link_lock);
+	} else {
+		out = openat(task->dst_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	}
+	if (out < 0) {
+		report(task->rel, name, "unable to create", errno);
+		close(in);
+		return;
+	}
+
+	if (copy_data(in, out, stbuf->st_size) < 0) {
+		report(task->rel, name, "unable to copy", errno);
+	}
+	apply_meta_fd(in, out, stbuf, task->rel, name);
+
+	close(out);
+	close(in);
+}
+
+static void copy_special(struct dir_task *task, const char *name, const struct stat *stbuf)
+{
+	if (S_ISLNK(stbuf->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlinkat(task->src_fd, name, target, sizeof(target) - 1);
+		if (len < 0) {
+			report(task->rel, name, "unable to read symlink", errno);
+			return;
+		}
+		target[len] = '\0';
+		if (symlinkat(target, task->dst_fd, name) < 0) {
+			report(task->rel, name, "unable to create symlink", errno);
+			return;
+		}
+	} else if (mknodat(task->dst_fd, name, stbuf->st_mode & S_IFMT, stbuf->st_rdev) < 0) {
+		report(task->rel, name, "unable to create", errno);
+		return;
+	}
+
+	apply_meta_at(task, name, stbuf);
+}
+
+static struct dir_task *new_task(struct dir_task *parent, const char *name, const struct stat *stbuf)
+{
+	size_t len = strlen(name);
+	struct dir_task *task = xmalloc(sizeof(struct dir_task) + len + 1);
+	task->parent = parent;
+	task->src_fd = -1;
+	task->dst_fd = -1;
+	task->stbuf = *stbuf;
+	task->pending = 1;
+	task->rel = parent ? join(parent->rel, name) : join("", "");
+	memcpy(task->name, name, len + 1);
+	return task;
+}
+
+/*
+ * Mark one piece of work for the given directory complete.  If it was the
+ * last, apply its metadata and propagate to its parent.
+ */
+static void finish(struct dir_task *task)
+{
+	while (task != NULL && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct dir_task *parent = task->parent;
+		if (task->src_fd >= 0 && task->dst_fd >= 0) {
+			apply_meta_fd(task->src_fd, task->dst_fd, &task->stbuf, task->rel, "");
+		}
+		if (task->src_fd >= 0) {
+			close(task->src_fd);
+		}
+		if (task->dst_fd >= 0) {
+			close(task->dst_fd);
+		}
+		if (parent == NULL) {
+			pthread_mutex_lock(&idle_lock);
+			done = 1;
+			pthread_cond_broadcast(&idle_cond);
+			pthread_mutex_unlock(&idle_lock);
+		} else {
+			free(task->rel);
+			free(task);
+		}
+		task = parent;
+	}
+}
+
+/*
+ * Copy a directory's non-directory contents and queue its subdirectories.
+ */
+static void scan(int worker, struct dir_task *task)
+{
+	if (task->parent != NULL) {
+		task->src_fd = openat(task->parent->src_fd, task->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (task->src_fd < 0) {
+			report(task->parent->rel, task->name, "unable to open directory", errno);
+			finish(task);
+			return;
+		}
+		task->dst_fd = openat(task->parent->dst_fd, task->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (task->dst_fd < 0) {
+			report(task->parent->rel, task->name, "unable to open directory", errno);
+			finish(task);
+			return;
+		}
+	}
+
+	/*
+	 * fdopendir() takes ownership of its file descriptor.  Give it a
+	 * duplicate such that task->src_fd remains usable.
+	 */
+	int dup_fd = dup(task->src_fd);
+	DIR *d;
+	if (dup_fd < 0 || (d = fdopendir(dup_fd)) == NULL) {
+		report(task->rel, "", "unable to read directory", errno);
+		if (dup_fd >= 0) {
+			close(dup_fd);
+		}
+		finish(task);
+		return;
+	}
+
+	unsigned long cnt = 0;
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (dir->d_name[0] == '.' && (dir->d_name[1] == '\0'
+				|| (dir->d_name[1] == '.' && dir->d_name[2] == '\0'))) {
+			continue;
+		}
+		if (task->parent == NULL && exclude != NULL && strcmp(dir->d_name, exclude) == 0) {
+			continue;
+		}
+		cnt++;
+
+		struct stat stbuf;
+		if (fstatat(task->src_fd, dir->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			report(task->rel, dir->d_name, "unable to stat", errno);
+			continue;
+		}
+
+		if (S_ISDIR(stbuf.st_mode)) {
+			/*
+			 * Do not recurse into our own output.
+			 */
+			if (stbuf.st_dev == dst_top_stat.st_dev && stbuf.st_ino == dst_top_stat.st_ino) {
+				continue;
+			}
+			if (mkdirat(task->dst_fd, dir->d_name, 0700) < 0) {
+				report(task->rel, dir->d_name, "unable to create directory", errno);
+				continue;
+			}
+			__atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+			push(worker, new_task(task, dir->d_name, &stbuf));
+		} else if (S_ISREG(stbuf.st_mode)) {
+			copy_file(task, dir->d_name, &stbuf);
+		} else {
+			copy_special(task, dir->d_name, &stbuf);
+		}
+
+		if (cnt % 64 == 0) {
+			progress_update(64);
+		}
+	}
+	closedir(d);
+	progress_update(cnt % 64);
+
+	finish(task);
+}
+
+static void *worker_loop(void *arg)
+{
+	int worker = (int)(intptr_t)arg;
+
+	for (;;) {
+		struct dir_task *task = take(worker, 0);
+		for (int i = 1; task == NULL && i < worker_cnt; i++) {
+			task = take((worker + i) % worker_cnt, 1);
+		}
+		if (task != NULL) {
+			scan(worker, task);
+			continue;
+		}
+
+		pthread_mutex_lock(&idle_lock);
+		while (!done && queued == 0) {
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		}
+		int finished = done;
+		pthread_mutex_unlock(&idle_lock);
+		if (finished) {
+			return NULL;
+		}
+	}
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: cptree [options] <source> <destination>\n"
+		"\n"
+		"Copy the contents of <source> into <destination>, preserving file types, hard\n"
+		"links, ownership, permissions, timestamps, and extended attributes.\n"
+		"<destination> is created if it does not exist and is given <source>'s metadata.\n"
+		"\n"
+		"Options:\n"
+		"  -j <N>     use N threads (default: one per CPU)\n"
+		"  -x <NAME>  do not copy <source>/<NAME>\n"
+		"  -p         print 1000 lines to stdout proportional to progress, for use\n"
+		"             with progress_bar\n"
+		"  -h         print this message\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int c;
+	while ((c = getopt(argc, argv, "j:x:ph")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atol(optarg);
+			break;
+		case 'x':
+			exclude = optarg;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		print_help();
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > MAX_WORKERS) {
+		threads = MAX_WORKERS;
+	}
+	worker_cnt = threads;
+	const char *src = argv[optind];
+	const char *dst = argv[optind + 1];
+
+	/*
+	 * Each directory being worked on holds two file descriptors open.
+	 * Deep trees across many threads may exceed the default soft limit.
+	 */
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	/*
+	 * Permissions are set explicitly; do not let the umask interfere.
+	 */
+	umask(0);
+
+	struct stat src_stat;
+	int src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (src_fd < 0 || fstat(src_fd, &src_stat) < 0) {
+		fprintf(stderr, "cptree: unable to open \"%s\": %s\n", src, strerror(errno));
+		return 1;
+	}
+	if (mkdir(dst, 0700) < 0 && errno != EEXIST) {
+		fprintf(stderr, "cptree: unable to create \"%s\": %s\n", dst, strerror(errno));
+		return 1;
+	}
+	if ((dst_top_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstat(dst_top_fd, &dst_top_stat) < 0) {
+		fprintf(stderr, "cptree: unable to open \"%s\": %s\n", dst, strerror(errno));
+		return 1;
+	}
+
+	if (progress) {
+		/*
+		 * A dup()'d file descriptor would share the directory offset
+		 * with src_fd.  Open a separate one.
+		 */
+		int count_fd = openat(src_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (count_fd >= 0) {
+			progress_total = count_entries(count_fd, 1);
+		}
+	}
+
+	struct dir_task *top = new_task(NULL, "", &src_stat);
+	top->src_fd = src_fd;
+	top->dst_fd = dup(dst_top_fd);
+	if (top->dst_fd < 0) {
+		fprintf(stderr, "cptree: unable to duplicate file descriptor\n");
+		return 1;
+	}
+
+	for (int i = 0; i < worker_cnt; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+	}
+	push(0, top);
+
+	pthread_t workers[MAX_WORKERS];
+	for (int i = 1; i < worker_cnt; i++) {
+		if (pthread_create(&workers[i], NULL, worker_loop, (void *)(intptr_t)i) != 0) {
+			fprintf(stderr, "cptree: unable to create thread\n");
+			return 1;
+		}
+	}
+	worker_loop((void *)(intptr_t)0);
+	for (int i = 1; i < worker_cnt; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	progress_finish();
+
+	return error_cnt > 0 ? 1 : 0;
+}
@@ -0,0 +1,625 @@
+/*
+ * bench.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program measures crossfs request latency while crossfs is being
+ * reconfigured.
+ *
+ * Reader threads continuously make the kinds of requests crossfs typically
+ * sees:
+ *
+ * - getattr: stat() a file, as a shell does when searching $PATH.
+ * - readdir: list a directory, as shell completion or a desktop menu does.
+ * - xattr: read the xattrs bouncer reads when it is executed.
+ *
+ * Meanwhile, a writer thread repeatedly replays a configuration script into
+ * the mount point's configuration file, as `brl apply` does.  The script
+ * should contain lines as written by cfg_crossfs(): a "clear" line followed by
+ * many "add" lines.
+ *
+ * Latencies and errors are tracked separately for requests issued while a
+ * reload is in progress and those issued while it is not.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CFG_NAME ".bedrock-config-filesystem"
+
+#define STRATUM_XATTR "user.bedrock.stratum"
+#define LPATH_XATTR "user.bedrock.localpath"
+#define RESTRICT_XATTR "user.bedrock.restrict"
+
+/*
+ * Upper bound on the number of files to probe.
+ */
+#define MAX_FILES 65536
+
+/*
+ * Latencies are recorded in a log-linear histogram: every power of two
+ * nanoseconds is split into HIST_SUB buckets.  This bounds the error on
+ * reported percentiles to about 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LEN (64 * HIST_SUB)
+
+enum op {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_XATTR,
+	OP_CNT,
+};
+
+const char *const op_str[] = {
+	"getattr",
+	"readdir",
+	"xattr",
+};
+
+/*
+ * Whether a request was issued while the configuration was being reloaded.
+ */
+enum phase {
+	PHASE_STEADY,
+	PHASE_RELOAD,
+	PHASE_CNT,
+};
+
+const char *const phase_str[] = {
+	"steady",
+	"reload",
+};
+
+struct hist {
+	uint64_t buckets[HIST_LEN];
+	uint64_t cnt;
+	uint64_t errors;
+	uint64_t max;
+};
+
+/*
+ * Per-reader thread state.  Each thread has its own histograms so that
+ * recording a sample does not require synchronization.
+ */
+struct reader {
+	pthread_t thread;
+	enum op op;
+	uint64_t rand;
+	struct hist hists[PHASE_CNT];
+};
+
+/*
+ * Files and directories to probe, relative to the mount point.
+ */
+static char **files = NULL;
+static size_t file_cnt = 0;
+static char **bins = NULL;
+static size_t bin_cnt = 0;
+static char **dirs = NULL;
+static size_t dir_cnt = 0;
+
+/*
+ * The configuration script to replay.
+ */
+static char **script = NULL;
+static size_t script_cnt = 0;
+
+static int mnt_fd = -1;
+static char *cfg_path = NULL;
+static long reload_interval_ms = 1000;
+
+static volatile int running = 1;
+static volatile int reloading = 0;
+
+static uint64_t reload_cnt = 0;
+static uint64_t reload_errors = 0;
+static uint64_t reload_ns_total = 0;
+static uint64_t reload_ns_max = 0;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * xorshift64.  Good enough to spread requests across paths.
+ */
+static inline uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static inline size_t hist_index(uint64_t ns)
+{
+	if (ns < HIST_SUB) {
+		return ns;
+	}
+	int exp = 63 - __builtin_clzll(ns);
+	size_t sub = (ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/*
+ * Largest value which maps to the given bucket.
+ */
+static inline uint64_t hist_value(size_t index)
+{
+	if (index < HIST_SUB) {
+		return index;
+	}
+	int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t sub = index % HIST_SUB;
+	return ((HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+static inline void hist_record(struct hist *hist, uint64_t ns, int error)
+{
+	hist->buckets[hist_index(ns)]++;
+	hist->cnt++;
+	if (error) {
+		hist->errors++;
+	}
+	if (ns > hist->max) {
+		hist->max = ns;
+	}
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	for (size_t i = 0; i < HIST_LEN; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->cnt += src->cnt;
+	dst->errors += src->errors;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+static uint64_t hist_percentile(const struct hist *hist, double percentile)
+{
+	if (hist->cnt == 0) {
+		return 0;
+	}
+	uint64_t target = (uint64_t)(hist->cnt * percentile / 100.0);
+	if (target >= hist->cnt) {
+		target = hist->cnt - 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_LEN; i++) {
+		seen += hist->buckets[i];
+		if (seen > target) {
+			uint64_t value = hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+static int append(char ***list, size_t *cnt, const char *str)
+{
+	char **new_list = realloc(*list, (*cnt + 1) * sizeof(char *));
+	if (new_list == NULL) {
+		return -1;
+	}
+	*list = new_list;
+	if (((*list)[*cnt] = strdup(str)) == NULL) {
+		return -1;
+	}
+	(*cnt)++;
+	return 0;
+}
+
+static int contains(char **list, size_t cnt, const char *str)
+{
+	for (size_t i = 0; i < cnt; i++) {
+		if (strcmp(list[i], str) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the configuration script.  Every configured path is a directory (or
+ * file) to probe.
+ */
+static int load_script(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "crossfs-bench: unable to open \"%s\"\n", path);
+		return -1;
+	}
+
+	char line[PIPE_BUF];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strchr(line, '\n') == NULL) {
+			fprintf(stderr, "crossfs-bench: overly long line in \"%s\"\n", path);
+			fclose(fp);
+			return -1;
+		}
+		if (append(&script, &script_cnt, line) < 0) {
+			fclose(fp);
+			return -1;
+		}
+
+		char filter[PIPE_BUF];
+		char cpath[PIPE_BUF];
+		if (sscanf(line, "add %s %s ", filter, cpath) != 2 || cpath[0] != '/') {
+			continue;
+		}
+		if (!contains(dirs, dir_cnt, cpath + 1) && append(&dirs, &dir_cnt, cpath + 1) < 0) {
+			fclose(fp);
+			return -1;
+		}
+		if (strncmp(filter, "bin", 3) == 0 && !contains(bins, bin_cnt, cpath + 1)
+			&& append(&bins, &bin_cnt, cpath + 1) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	if (script_cnt == 0) {
+		fprintf(stderr, "crossfs-bench: empty script \"%s\"\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Populate files with the contents of the configured bin directories.  These
+ * are what a shell would search in $PATH and what bouncer would be run as.
+ */
+static int load_files(void)
+{
+	size_t bin_dir_cnt = bin_cnt;
+	for (size_t i = 0; i < bin_dir_cnt && file_cnt < MAX_FILES; i++) {
+		int fd = openat(mnt_fd, bins[i], O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			continue;
+		}
+		DIR *d = fdopendir(fd);
+		if (d == NULL) {
+			close(fd);
+			continue;
+		}
+		struct dirent *dir;
+		while ((dir = readdir(d)) != NULL && file_cnt < MAX_FILES) {
+			if (dir->d_name[0] == '.') {
+				continue;
+			}
+			char path[PATH_MAX];
+			int s = snprintf(path, sizeof(path), "%s/%s", bins[i], dir->d_name);
+			if (s < 0 || s >= (int)sizeof(path)) {
+				continue;
+			}
+			if (append(&files, &file_cnt, path) < 0) {
+				closedir(d);
+				return -1;
+			}
+		}
+		closedir(d);
+	}
+
+	if (file_cnt == 0) {
+		fprintf(stderr, "crossfs-bench: no files found in configured bin directories\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int do_getattr(struct reader *r)
+{
+	struct stat stbuf;
+	const char *path = files[next_rand(&r->rand) % file_cnt];
+	return fstatat(mnt_fd, path, &stbuf, 0);
+}
+
+static int do_readdir(struct reader *r)
+{
+	const char *path = dirs[next_rand(&r->rand) % dir_cnt];
+	int fd = openat(mnt_fd, path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return -1;
+	}
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return -1;
+	}
+	errno = 0;
+	while (readdir(d) != NULL) {
+	}
+	int rv = errno == 0 ? 0 : -1;
+	closedir(d);
+	return rv;
+}
+
+/*
+ * Emulate what an execution of a crossfs bin file does: the kernel opens the
+ * file, then bouncer reads its xattrs.
+ */
+static int do_xattr(struct reader *r)
+{
+	const char *path = files[next_rand(&r->rand) % file_cnt];
+	int fd = openat(mnt_fd, path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	char value[PATH_MAX];
+	int rv = 0;
+	if (fgetxattr(fd, STRATUM_XATTR, value, sizeof(value)) < 0) {
+		rv = -1;
+	} else if (fgetxattr(fd, LPATH_XATTR, value, sizeof(value)) < 0) {
+		rv = -1;
+	} else if (fgetxattr(fd, RESTRICT_XATTR, value, sizeof(value)) < 0 && errno != ENOTSUP && errno != ENODATA) {
+		rv = -1;
+	}
+	close(fd);
+	return rv;
+}
+
+static void *reader_loop(void *arg)
+{
+	struct reader *r = arg;
+
+	while (running) {
+		enum phase phase = reloading ? PHASE_RELOAD : PHASE_STEADY;
+		uint64_t start = now_ns();
+		int rv;
+		switch (r->op) {
+		case OP_GETATTR:
+			rv = do_getattr(r);
+			break;
+		case OP_READDIR:
+			rv = do_readdir(r);
+			break;
+		case OP_XATTR:
+		default:
+			rv = do_xattr(r);
+			break;
+		}
+		uint64_t end = now_ns();
+		/*
+		 * Attribute the request to a reload if one was in progress
+		 * at any point while it was outstanding.
+		 */
+		if (reloading) {
+			phase = PHASE_RELOAD;
+		}
+		hist_record(&r->hists[phase], end - start, rv < 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * Replay the script once, one write() per line as cfg_crossfs() does.
+ */
+static int reload(void)
+{
+	int fd = open(cfg_path, O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		return -1;
+	}
+	int rv = 0;
+	for (size_t i = 0; i < script_cnt; i++) {
+		size_t len = strlen(script[i]);
+		if (write(fd, script[i], len) != (ssize_t)len) {
+			rv = -1;
+		}
+	}
+	close(fd);
+	return rv;
+}
+
+static void *writer_loop(void *arg)
+{
+	(void)arg;
+
+	while (running) {
+		struct timespec ts = {
+			reload_interval_ms / 1000,
+			(reload_interval_ms % 1000) * 1000000,
+		};
+		nanosleep(&ts, NULL);
+		if (!running) {
+			break;
+		}
+
+		reloading = 1;
+		uint64_t start = now_ns();
+		if (reload() < 0) {
+			reload_errors++;
+		}
+		uint64_t elapsed = now_ns() - start;
+		reloading = 0;
+
+		reload_cnt++;
+		reload_ns_total += elapsed;
+		if (elapsed > reload_ns_max) {
+			reload_ns_max = elapsed;
+		}
+	}
+
+	return NULL;
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: crossfs-bench [options] <mount> <script>\n"
+		"\n"
+		"Measure crossfs latency while <script> is repeatedly written to\n"
+		"<mount>/" CFG_NAME ".\n"
+		"\n"
+		"Options:\n"
+		"  -t <SECONDS>  duration of the benchmark (default 30)\n"
+		"  -i <MS>       delay between reloads (default 1000)\n"
+		"  -g <N>        getattr threads (default 4)\n"
+		"  -r <N>        readdir threads (default 1)\n"
+		"  -x <N>        xattr threads (default 2)\n"
+		"  -h            print this message\n"
+		"\n"
+		"Example script generation:\n"
+		"  $ (echo clear; sed 's/^/add /' /bedrock/cross/" CFG_NAME ") > script\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long duration = 30;
+	int thread_cnts[OP_CNT] = { 4, 1, 2 };
+
+	int c;
+	while ((c = getopt(argc, argv, "t:i:g:r:x:h")) != -1) {
+		switch (c) {
+		case 't':
+			duration = atol(optarg);
+			break;
+		case 'i':
+			reload_interval_ms = atol(optarg);
+			break;
+		case 'g':
+			thread_cnts[OP_GETATTR] = atoi(optarg);
+			break;
+		case 'r':
+			thread_cnts[OP_READDIR] = atoi(optarg);
+			break;
+		case 'x':
+			thread_cnts[OP_XATTR] = atoi(optarg);
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+	if (argc - optind != 2 || duration <= 0 || reload_interval_ms < 0) {
+		print_help();
+		return 1;
+	}
+	const char *mnt = argv[optind];
+
+	if (getuid() != 0) {
+		fprintf(stderr, "crossfs-bench: error not running as root.\n");
+		return 1;
+	}
+
+	if ((mnt_fd = open(mnt, O_RDONLY | O_DIRECTORY)) < 0) {
+		fprintf(stderr, "crossfs-bench: unable to open \"%s\"\n", mnt);
+		return 1;
+	}
+	if (asprintf(&cfg_path, "%s/%s", mnt, CFG_NAME) < 0) {
+		return 1;
+	}
+	if (load_script(argv[optind + 1]) < 0) {
+		return 1;
+	}
+	/*
+	 * Ensure the mount point reflects the script before collecting paths
+	 * to probe.
+	 */
+	if (reload() < 0) {
+		fprintf(stderr, "crossfs-bench: unable to write \"%s\"\n", cfg_path);
+		return 1;
+	}
+	if (load_files() < 0) {
+		return 1;
+	}
+
+	size_t reader_cnt = 0;
+	for (int i = 0; i < OP_CNT; i++) {
+		reader_cnt += thread_cnts[i] > 0 ? thread_cnts[i] : 0;
+	}
+	struct reader *readers = calloc(reader_cnt, sizeof(struct reader));
+	if (readers == NULL) {
+		return 1;
+	}
+
+	size_t n = 0;
+	for (int i = 0; i < OP_CNT; i++) {
+		for (int j = 0; j < thread_cnts[i]; j++) {
+			readers[n].op = i;
+			readers[n].rand = 0x9E3779B97F4A7C15ull * (n + 1);
+			if (pthread_create(&readers[n].thread, NULL, reader_loop, &readers[n]) != 0) {
+				fprintf(stderr, "crossfs-bench: unable to create thread\n");
+				return 1;
+			}
+			n++;
+		}
+	}
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, writer_loop, NULL) != 0) {
+		fprintf(stderr, "crossfs-bench: unable to create thread\n");
+		return 1;
+	}
+
+	sleep(duration);
+	running = 0;
+
+	pthread_join(writer, NULL);
+	for (size_t i = 0; i < reader_cnt; i++) {
+		pthread_join(readers[i].thread, NULL);
+	}
+
+	/*
+	 * Report
+	 */
+	printf("reloads: %llu, errors: %llu, mean: %.3fms, max: %.3fms, lines: %zu\n",
+		(unsigned long long)reload_cnt, (unsigned long long)reload_errors,
+		reload_cnt ? reload_ns_total / (double)reload_cnt / 1e6 : 0.0, reload_ns_max / 1e6, script_cnt);
+	printf("%-8s %-7s %10s %8s %10s %10s %10s %10s\n", "op", "phase", "requests", "errors", "p50(us)",
+		"p99(us)", "p999(us)", "max(us)");
+	for (int op = 0; op < OP_CNT; op++) {
+		for (int phase = 0; phase < PHASE_CNT; phase++) {
+			struct hist *hist = calloc(1, sizeof(struct hist));
+			if (hist == NULL) {
+				return 1;
+			}
+			for (size_t i = 0; i < reader_cnt; i++) {
+				if (readers[i].op == (enum op)op) {
+					hist_merge(hist, &readers[i].hists[phase]);
+				}
+			}
+			printf("%-8s %-7s %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+				op_str[op], phase_str[phase],
+				(unsigned long long)hist->cnt, (unsigned long long)hist->errors,
+				hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 99) / 1e3,
+				hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+			free(hist);
+		}
+	}
+
+	return 0;
+}
@@ -75,20 +75,51 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse3/fuse.h>
 #include <linux/limits.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <sys/fsuid.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/openat2.h>
 #include <asm-generic/unistd.h>	/* __NR_openat2 */
 
-#include <uthash.h>
-
 #define ARRAY_LEN(x) (sizeof(x) / sizeof(x[0]))
 #define MIN(x, y) (x < y ? x : y)
 
+/*
+ * Static tracepoints for use with tools such as bpftrace, e.g.:
+ *
+ *     bpftrace -e 'usdt:/bedrock/libexec/crossfs:crossfs:stat__bpath { ... }'
+ *
+ * These are only compiled in if CROSSFS_SDT is defined (`make SDT=1`).
+ * Otherwise TRACE() expands to nothing and its arguments are not evaluated.
+ *
+ * Probe names and arguments:
+ *
+ * - op__entry(op, ipath)
+ * - op__return(op, ipath, class, rv)
+ * - local__stratum(stratum, rv)
+ * - stat__bpath(stratum, bpath, rv), open__bpath(...), loc__bpath(...)
+ * - cfg__lock(lock_type), cfg__locked(lock_type), cfg__unlock()
+ * - root__lock(), root__locked(), root__unlock()
+ * - filter__start(ipath, filter), filter__done(ipath, filter, rv)
+ * - filter__size__start(ipath, filter), filter__size__done(ipath, filter, rv)
+ * - stratum__skip(stratum), stratum__timeout(stratum, deadline_ms)
+ *
+ * where op is the m_*() function name, class is an enum ipath_class, filter
+ * is an enum filter, and rv is a return value (negative errno on failure).
+ */
+#ifdef CROSSFS_SDT
+#include <sys/sdt.h>
+#define TRACE(...) STAP_PROBEV(crossfs, __VA_ARGS__)
+#else
+#define TRACE(...)
+#endif
+
 /*
  * The directory containing the roots of the various strata.  References to a
  * specific stratum's instance of a file go through this directory.
@@ -116,6 +147,12 @@
 #define BOUNCER_PATH "/bedrock/libexec/bouncer"
 #define BOUNCER_PATH_LEN strlen(BOUNCER_PATH)
 
+/*
+ * Summary of strata state published by brl.  See src/strat/strat.c for the
+ * format.
+ */
+#define REGISTRY_PATH "/bedrock/run/registry"
+
 /*
  * The root of the procfs filesystem
  */
@@ -172,6 +209,109 @@
 #define CFG_PATH "/.bedrock-config-filesystem"
 #define CFG_PATH_LEN strlen(CFG_PATH)
 
+/*
+ * Directory of read-only virtual files which may be used to query the
+ * configuration without parsing a full dump of it:
+ *
+ * - generation: the current configuration generation.  This increases every
+ *   time the configuration changes.
+ * - stratum/<stratum>: the configuration lines which reference <stratum>, in
+ *   the same format as CFG_NAME.
+ * - since/<generation>: the changes made after <generation>, one per line,
+ *   each prefixed by the generation it produced.  These lines are in the
+ *   format written to CFG_NAME.  If the changes are no longer tracked, this
+ *   returns a "clear" followed by an "add" for every configuration line.
+ * - health: one line per stratum which has been probed for backing files
+ *   while a deadline was configured:
+ *
+ *       <stratum> <state> <deadline-ms> <avg-us> <max-us> <probes> <timeouts> <skips>
+ *
+ *   where state is "ok", "open" if the stratum is being skipped after
+ *   repeatedly missing its deadline, or "stalled" if a probe which missed its
+ *   deadline has yet to return.
+ * - hot: the most frequent recent requests and callers, one per line, most
+ *   frequent first:
+ *
+ *       path <count> <op> <ipath>
+ *       caller <count> <pid> <comm> <stratum>
+ *
+ *   Counts are estimates which are halved every HOT_DECAY_MS.
+ */
+#define CFG_QUERY_NAME ".bedrock-config-query"
+#define CFG_QUERY_NAME_LEN strlen(CFG_QUERY_NAME)
+
+#define CFG_QUERY_PATH "/.bedrock-config-query"
+#define CFG_QUERY_PATH_LEN strlen(CFG_QUERY_PATH)
+
+#define QUERY_GENERATION "generation"
+#define QUERY_GENERATION_LEN strlen(QUERY_GENERATION)
+
+#define QUERY_STRATUM "stratum"
+#define QUERY_STRATUM_LEN strlen(QUERY_STRATUM)
+
+#define QUERY_SINCE "since"
+#define QUERY_SINCE_LEN strlen(QUERY_SINCE)
+
+#define QUERY_HEALTH "health"
+#define QUERY_HEALTH_LEN strlen(QUERY_HEALTH)
+
+#define QUERY_HOT "hot"
+#define QUERY_HOT_LEN strlen(QUERY_HOT)
+
+/*
+ * Once the tracked changes exceed this many bytes beyond the size of the
+ * configuration itself, stop tracking them.  Queries about older generations
+ * are answered with a full dump.
+ */
+#define CFG_LOG_SLACK (64 * 1024)
+
+/*
+ * Once a stratum misses its deadline this many times in a row, skip it for
+ * BREAKER_COOLDOWN_MS before probing it again.  A single further miss after
+ * that re-opens the breaker; a probe returning in time closes it.
+ */
+#define BREAKER_THRESHOLD 3
+#define BREAKER_COOLDOWN_MS (30 * 1000)
+
+/*
+ * Upper bound on threads used to probe strata with deadlines.  Threads are
+ * started as needed and kept around once started.
+ */
+#define PROBE_WORKERS_MAX 64
+
+/*
+ * Upper bound on a stratum's probes queued for or running on a worker.
+ * Further probes count as missed deadlines rather than waiting behind them,
+ * such that a hung stratum cannot occupy every worker.
+ */
+#define PROBE_INFLIGHT_MAX 2
+
+/*
+ * Configuration snapshot file format identifier and how long the
+ * configuration must go unchanged before it is saved.
+ */
+#define SNAPSHOT_MAGIC "crossfs\1"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_DELAY_MS 1000
+
+/*
+ * Heavy-hitter tracking.  Requests are counted in count-min sketches of
+ * HOT_DEPTH rows of HOT_WIDTH counters, and the HOT_K largest are kept along
+ * with enough information to describe them.  Every HOT_DECAY_MS all counts
+ * are halved such that they reflect recent activity.
+ *
+ * HOT_WIDTH must be a power of two.
+ */
+#define HOT_DEPTH 4
+#define HOT_WIDTH 4096
+#define HOT_K 32
+#define HOT_DECAY_MS (60 * 1000)
+
+/*
+ * Length of /proc/<pid>/comm, including trailing null.
+ */
+#define COMM_LEN 16
+
 /*
  * Symlink to stratum root, used for local alias.
  */
@@ -199,21 +339,41 @@
 #define CMD_RM "rm"
 #define CMD_RM_LEN strlen(CMD_RM)
 
+#define CMD_DEADLINE "deadline"
+#define CMD_DEADLINE_LEN strlen(CMD_DEADLINE)
+
+#define CMD_RELOAD "reload"
+#define CMD_RELOAD_LEN strlen(CMD_RELOAD)
+
+/*
+ * Both of these expect the calling m_*() function's path argument to be named
+ * ipath for tracing.
+ */
 #define FS_IMP_SETUP(lock_type)                                              \
 	int rv;                                                              \
+	TRACE(op__entry, (const char *)__func__, ipath);                     \
+	TRACE_CLASS_RESET();                                                 \
 	set_caller_fsid();                                                   \
-	if ((rv = set_local_stratum()) < 0) {                                \
+	rv = set_local_stratum();                                            \
+	TRACE(local__stratum, local_stratum.name, rv);                       \
+	if (rv < 0) {                                                        \
+		TRACE(op__return, (const char *)__func__, ipath, TRACE_CLASS_GET(), rv); \
 		return rv;                                                   \
 	}                                                                    \
+	hot_record(__func__, ipath);                                         \
+	TRACE(cfg__lock, lock_type);                                         \
 	if (lock_type == CFG_RDLOCK) {                                       \
 		pthread_rwlock_rdlock(&cfg_lock);                            \
 	} else {                                                             \
 		pthread_rwlock_wrlock(&cfg_lock);                            \
-	}
+	}                                                                    \
+	TRACE(cfg__locked, lock_type);
 
 #define FS_IMP_RETURN(rv)                                                    \
 	pthread_rwlock_unlock(&cfg_lock);                                    \
+	TRACE(cfg__unlock);                                                  \
 	close(local_stratum.root_fd);                                        \
+	TRACE(op__return, (const char *)__func__, ipath, TRACE_CLASS_GET(), rv); \
 	return rv;
 
 /*
@@ -244,6 +404,10 @@ enum ipath_class {
 	 * Refers to this filesystem's configuration interface.
 	 */
 	CLASS_CFG,
+	/*
+	 * Refers to this filesystem's configuration query interface.
+	 */
+	CLASS_QUERY,
 	/*
 	 * Refers to symlink pointing to calling process stratum root.
 	 */
@@ -352,6 +516,11 @@ struct stratum {
 	 * directory.
 	 */
 	int root_fd;
+	/*
+	 * The stratum's health entry, looked up on its first probe with a
+	 * deadline configured.  Access with atomic operations.
+	 */
+	struct health *health;
 };
 
 /*
@@ -403,20 +572,50 @@ struct cfg_entry {
 };
 
 /*
- * Hash table entry for a single string.
+ * Per-request bump allocator.  Requests such as readdir() may need thousands
+ * of small, short-lived allocations; rather than malloc()/free() each, they
+ * are carved out of large chunks which are all released together by
+ * arena_free() at the end of the request.
  */
-struct h_str {
-	UT_hash_handle hh;
-	char str[];
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *head;
 };
 
 /*
- * Hash table entry for a key-value pair
+ * Open-addressing string set entry.  Strings are copied into the owning
+ * set's arena.  The hash is stored to avoid recalculating it on table growth
+ * and to skip most memcmp() calls on collisions.
+ *
+ * value is unused by the set itself.  Callers may use it to associate data
+ * with the string, e.g. to implement a key-value map.
  */
-struct h_kv {
-	UT_hash_handle hh;
+struct str_set_entry {
+	char *str;
+	size_t len;
+	uint32_t hash;
 	char *value;
-	char key[];
+};
+
+/*
+ * Open-addressing, linear probing string set.  All memory is owned by arena.
+ */
+struct str_set {
+	struct arena *arena;
+	struct str_set_entry *slots;
+	size_t cnt;
+	/*
+	 * Always a power of two.
+	 */
+	size_t alloc;
 };
 
 /*
@@ -429,12 +628,118 @@ static struct cfg_entry *cfgs = NULL;
 static size_t cfg_cnt = 0;
 static size_t cfg_alloc = 0;
 
+/*
+ * Queries on CFG_QUERY_PATH are classified into the following categories.
+ */
+enum query_class {
+	/*
+	 * CFG_QUERY_PATH or one of its subdirectories.
+	 */
+	QUERY_CLASS_DIR,
+	/*
+	 * The current configuration generation.
+	 */
+	QUERY_CLASS_GENERATION,
+	/*
+	 * The configuration lines for a given stratum.
+	 */
+	QUERY_CLASS_STRATUM,
+	/*
+	 * The configuration changes since a given generation.
+	 */
+	QUERY_CLASS_SINCE,
+	/*
+	 * Per-stratum probe latency and circuit breaker state.
+	 */
+	QUERY_CLASS_HEALTH,
+	/*
+	 * The most frequent recent requests and callers.
+	 */
+	QUERY_CLASS_HOT,
+	/*
+	 * Does not refer to any expected file path.
+	 */
+	QUERY_CLASS_ENOENT,
+};
+
+/*
+ * A single applied configuration change, as written to CFG_NAME.
+ */
+struct cfg_change {
+	uint64_t generation;
+	char *line;
+	size_t line_len;
+};
+
+/*
+ * The configuration generation.  This is incremented on every configuration
+ * change.
+ *
+ * Access should be locked with cfg_lock.
+ */
+static uint64_t cfg_generation = 0;
+
+/*
+ * Configuration changes made after cfg_log_base, in order.
+ *
+ * Access should be locked with cfg_lock.
+ */
+static struct cfg_change *cfg_log = NULL;
+static size_t cfg_log_cnt = 0;
+static size_t cfg_log_alloc = 0;
+static size_t cfg_log_size = 0;
+static uint64_t cfg_log_base = 0;
+
+/*
+ * Cached rendering of the configuration as read from CFG_NAME.  Only
+ * re-rendered when cfg_dump_generation falls behind cfg_generation.
+ *
+ * Reads happen under a read lock on cfg_lock, and so multiple threads may
+ * try to update this concurrently.  Access should be locked with both
+ * cfg_lock and cfg_dump_lock.
+ */
+static char *cfg_dump = NULL;
+static size_t cfg_dump_len = 0;
+static size_t cfg_dump_alloc = 0;
+static uint64_t cfg_dump_generation = 0;
+
+/*
+ * If set with `-o snapshot=<path>`, the configuration is saved to this file
+ * once it has stopped changing for SNAPSHOT_DELAY_MS and loaded from it on
+ * start.  This lets a restarted crossfs serve requests before brl has
+ * reconfigured it.
+ *
+ * The file is referenced relative to a directory file descriptor, as the
+ * process' root directory changes while serving requests.
+ *
+ * snapshot_due_ns and snapshot_thread_started should be locked with
+ * snapshot_lock.
+ */
+static int snapshot_dir_fd = -1;
+static char *snapshot_name = NULL;
+static uint64_t snapshot_due_ns = 0;
+static int snapshot_thread_started = 0;
+
 /*
  * Per-thread information about calling process' stratum.
  */
 static __thread char local_stratum_name[PATH_MAX];
 static __thread struct stratum local_stratum;
 
+/*
+ * The current request's ipath classification, reported when it returns.
+ */
+#ifdef CROSSFS_SDT
+static __thread int trace_class;
+#define TRACE_CLASS_RESET() (trace_class = -1)
+#define TRACE_CLASS_SET(class) (trace_class = (class))
+#define TRACE_CLASS_GET() trace_class
+#else
+#define TRACE_CLASS_RESET()
+#define TRACE_CLASS_SET(class)
+#define TRACE_CLASS_GET() -1
+#endif
+
 /*
  * Reference file descriptors.  Used as fixed reference points while
  * chroot()'ing around.
@@ -454,11 +759,190 @@ static int bouncer_fd;
  */
 static int openat2_available = 0;
 
+/*
+ * Stratum root directories as published in REGISTRY_PATH.  This lets
+ * set_local_stratum() identify the caller's stratum with an fstat() rather
+ * than reading an xattr.
+ *
+ * brl writes `reload` to the configuration file whenever it publishes the
+ * registry, at which point it is reloaded if its stat changed.
+ */
+struct registry_entry {
+	dev_t dev;
+	ino_t ino;
+	int enabled;
+	char *name;
+};
+static struct registry_entry *registry = NULL;
+static size_t registry_cnt = 0;
+static struct stat registry_stat;
+
+/*
+ * Per-stratum probe statistics and circuit breaker state.
+ *
+ * Some strata may be on slow or unreliable storage such as network
+ * filesystems or disks which spin down.  Without a deadline, a hung stratum
+ * stalls every request which probes it, which for something like /bin is
+ * every request.  With a deadline, probes run on a worker thread and the
+ * requesting thread gives up on the stratum after the deadline passes,
+ * treating it as though it did not provide the file.
+ *
+ * Entries are never freed such that pointers to them remain valid while
+ * probes are outstanding and may be cached in struct stratum.
+ *
+ * Fields are accessed with atomic operations such that probes do not contend
+ * on a lock.  healths and health_cnt should be locked with probe_lock.
+ */
+struct health {
+	char *name;
+	size_t name_len;
+	/*
+	 * Milliseconds to wait on a probe.  Negative means use
+	 * default_deadline_ms.  Zero means wait indefinitely.
+	 */
+	long deadline_ms;
+	/*
+	 * Exponentially weighted moving average and maximum probe latency.
+	 */
+	uint64_t avg_ns;
+	uint64_t max_ns;
+	uint64_t probes;
+	uint64_t timeouts;
+	uint64_t skips;
+	/*
+	 * Consecutive missed deadlines.
+	 */
+	unsigned int strikes;
+	/*
+	 * Skip the stratum until this CLOCK_MONOTONIC time.
+	 */
+	uint64_t open_until_ns;
+	/*
+	 * Number of probes which missed their deadline and have yet to
+	 * return.  The stratum is skipped while any are outstanding so that a
+	 * hung stratum does not tie up every worker.
+	 */
+	unsigned int stalled;
+	/*
+	 * Number of probes queued for or running on a worker.  Unlike the
+	 * above, this should be locked with probe_lock.
+	 */
+	unsigned int inflight;
+};
+static struct health **healths = NULL;
+static size_t health_cnt = 0;
+static long default_deadline_ms = 0;
+/*
+ * Set once any deadline is configured, such that probes may skip health
+ * tracking entirely in the common case where none are.  Access with atomic
+ * operations.
+ */
+static int deadlines_set = 0;
+
+enum probe_op {
+	PROBE_STAT,
+	PROBE_OPEN,
+	PROBE_EXISTS,
+	PROBE_FILLDIR,
+};
+
+/*
+ * A probe handed to a worker thread.  If the requesting thread gives up on
+ * it, the worker frees it upon completion.  Thus, it must not reference
+ * anything owned by the requesting thread.
+ *
+ * done, abandoned, and next should be locked with probe_lock.
+ */
+struct probe {
+	enum probe_op op;
+	/*
+	 * dup()'d such that it outlives the request and configuration.
+	 */
+	int root_fd;
+	char bpath[PATH_MAX];
+	int flags;
+	uid_t uid;
+	gid_t gid;
+	struct health *health;
+	/*
+	 * When a worker started the probe, or zero while it is queued.
+	 */
+	uint64_t exec_ns;
+	int rv;
+	int err;
+	struct stat stbuf;
+	struct arena arena;
+	struct str_set files;
+	int done;
+	int abandoned;
+	pthread_cond_t cond;
+	struct probe *next;
+};
+
+/*
+ * Queue of probes waiting on a worker thread.
+ *
+ * Access should be locked with probe_lock.
+ */
+static struct probe *probe_head = NULL;
+static struct probe *probe_tail = NULL;
+static size_t probe_workers = 0;
+static size_t probe_idle = 0;
+
+/*
+ * Count-min sketch.  Counters are updated with atomic operations rather than
+ * under a lock.
+ */
+struct hot_sketch {
+	uint32_t counts[HOT_DEPTH][HOT_WIDTH];
+};
+
+/*
+ * A tracked heavy hitter.  Path entries populate op and key (the ipath).
+ * Caller entries populate pid, comm, and key (the caller's stratum).
+ */
+struct hot_entry {
+	uint64_t hash;
+	uint32_t count;
+	const char *op;
+	pid_t pid;
+	char comm[COMM_LEN];
+	char key[PATH_MAX];
+};
+
+/*
+ * The HOT_K largest entries seen, as a min-heap on count such that the
+ * smallest is readily replaced.  min mirrors the smallest count once full
+ * such that most requests can skip taking hot_lock.
+ *
+ * Access to everything but the sketch and min should be locked with
+ * hot_lock.
+ */
+struct hot_list {
+	struct hot_sketch sketch;
+	struct hot_entry pool[HOT_K];
+	struct hot_entry *heap[HOT_K];
+	size_t cnt;
+	uint32_t min;
+};
+
+static struct hot_list hot_paths;
+static struct hot_list hot_callers;
+static uint64_t hot_decay_ns = 0;
+
 /*
  * Locks
  */
 static pthread_rwlock_t cfg_lock;
+static pthread_mutex_t cfg_dump_lock;
 static pthread_mutex_t root_lock;
+static pthread_rwlock_t registry_lock;
+static pthread_mutex_t probe_lock;
+static pthread_cond_t probe_queue_cond;
+static pthread_condattr_t monotonic_condattr;
+static pthread_mutex_t hot_lock;
+static pthread_mutex_t snapshot_lock;
+static pthread_cond_t snapshot_cond;
 
 /*
  * Pre-calculated stat information.
@@ -588,7 +1072,7 @@ static inline struct stratum *deref(struct back_entry *back)
 /*
  * Classify an incoming file path into one of ipath_class.
  */
-static inline enum ipath_class classify_ipath(const char *ipath, size_t ipath_len, struct cfg_entry **cfg)
+static inline enum ipath_class classify_ipath_untraced(const char *ipath, size_t ipath_len, struct cfg_entry **cfg)
 {
 	/*
 	 * In the most performance sensitive situations, CLASS_PATH is the most
@@ -616,6 +1100,10 @@ static inline enum ipath_class classify_ipath(const char *ipath, size_t ipath_le
 		return CLASS_CFG;
 	}
 
+	if (is_equal_or_parent(CFG_QUERY_PATH, CFG_QUERY_PATH_LEN, ipath, ipath_len)) {
+		return CLASS_QUERY;
+	}
+
 	if (pstrcmp(ipath, ipath_len, LOCAL_ALIAS_PATH, LOCAL_ALIAS_PATH_LEN) == 0) {
 		return CLASS_LOCAL;
 	}
@@ -623,6 +1111,61 @@ static inline enum ipath_class classify_ipath(const char *ipath, size_t ipath_le
 	return CLASS_ENOENT;
 }
 
+static inline enum ipath_class classify_ipath(const char *ipath, size_t ipath_len, struct cfg_entry **cfg)
+{
+	enum ipath_class class = classify_ipath_untraced(ipath, ipath_len, cfg);
+	TRACE_CLASS_SET(class);
+	return class;
+}
+
+/*
+ * Classify a CLASS_QUERY ipath into one of query_class.  If the query takes an
+ * argument, such as a stratum name, arg is pointed at it.
+ */
+static inline enum query_class classify_query(const char *ipath, size_t ipath_len, const char **arg)
+{
+	if (ipath_len == CFG_QUERY_PATH_LEN) {
+		return QUERY_CLASS_DIR;
+	}
+
+	const char *name = ipath + CFG_QUERY_PATH_LEN + 1;
+	size_t name_len = ipath_len - CFG_QUERY_PATH_LEN - 1;
+
+	if (pstrcmp(name, name_len, QUERY_GENERATION, QUERY_GENERATION_LEN) == 0) {
+		return QUERY_CLASS_GENERATION;
+	}
+
+	if (pstrcmp(name, name_len, QUERY_HEALTH, QUERY_HEALTH_LEN) == 0) {
+		return QUERY_CLASS_HEALTH;
+	}
+
+	if (pstrcmp(name, name_len, QUERY_HOT, QUERY_HOT_LEN) == 0) {
+		return QUERY_CLASS_HOT;
+	}
+
+	enum query_class class;
+	size_t prefix_len;
+	if (is_equal_or_parent(QUERY_STRATUM, QUERY_STRATUM_LEN, name, name_len)) {
+		class = QUERY_CLASS_STRATUM;
+		prefix_len = QUERY_STRATUM_LEN;
+	} else if (is_equal_or_parent(QUERY_SINCE, QUERY_SINCE_LEN, name, name_len)) {
+		class = QUERY_CLASS_SINCE;
+		prefix_len = QUERY_SINCE_LEN;
+	} else {
+		return QUERY_CLASS_ENOENT;
+	}
+
+	if (name[prefix_len] == '\0') {
+		return QUERY_CLASS_DIR;
+	}
+
+	*arg = name + prefix_len + 1;
+	if ((*arg)[0] == '\0' || strchr(*arg, '/') != NULL) {
+		return QUERY_CLASS_ENOENT;
+	}
+	return class;
+}
+
 /*
  * Calculate the backing path for a given cfg_entry, back_entry, and incoming
  * path.
@@ -649,92 +1192,239 @@ static inline char *calc_bpath(struct cfg_entry *cfg, struct back_entry *back,
 }
 
 /*
- * Insert a string into a hash table.
+ * Allocate memory from an arena.  The memory is valid until arena_free() is
+ * called on the arena.
  */
-static inline int insert_h_str(struct h_str **strs, char *str, size_t str_len)
+static inline void *arena_alloc(struct arena *arena, size_t size)
 {
-	struct h_str *e = NULL;
-
 	/*
-	 * If we already have a match, use pre-existing.
+	 * Keep returned memory suitably aligned for any of our structs.
 	 */
-	HASH_FIND(hh, *strs, str, str_len, e);
-	if (e != NULL) {
-		return 0;
-	}
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
 
-	e = malloc(sizeof(struct h_str) + str_len + 1);
-	if (e == NULL) {
-		return -ENOMEM;
+	struct arena_chunk *chunk = arena->head;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		chunk->next = arena->head;
+		arena->head = chunk;
 	}
 
-	memcpy(e->str, str, str_len + 1);
-
-	HASH_ADD_KEYPTR(hh, *strs, e->str, str_len, e);
-	return 0;
+	void *rv = chunk->data + chunk->used;
+	chunk->used += size;
+	return rv;
 }
 
 /*
- * Insert a key/value pair into a hash table.
+ * Release everything allocated from an arena.
  */
-static inline int insert_h_kv(struct h_kv **kvs, char *key, size_t key_len, char *value)
+static inline void arena_free(struct arena *arena)
 {
-	struct h_kv *e = NULL;
-
-	/*
-	 * If we already have a match, use pre-existing.
-	 */
-	HASH_FIND(hh, *kvs, key, key_len, e);
-	if (e != NULL) {
-		return 0;
+	struct arena_chunk *chunk = arena->head;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
+	arena->head = NULL;
+}
 
-	e = malloc(sizeof(struct h_kv) + key_len + 1);
-	if (e == NULL) {
-		return -ENOMEM;
+/*
+ * FNV-1a.  Directory entry names are short; this is cheap and distributes
+ * well enough for a linear probing table.
+ */
+static inline uint32_t str_hash(const char *str, size_t str_len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < str_len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
 	}
+	return hash;
+}
 
-	size_t value_len = strlen(value);
-	e->value = malloc(value_len + 1);
-	if (e->value == NULL) {
-		free(e);
+static inline void str_set_init(struct str_set *set, struct arena *arena)
+{
+	set->arena = arena;
+	set->slots = NULL;
+	set->cnt = 0;
+	set->alloc = 0;
+}
+
+/*
+ * Double the number of slots.  The old slots are abandoned in the arena.
+ */
+static inline int str_set_grow(struct str_set *set)
+{
+	size_t alloc = set->alloc == 0 ? 256 : set->alloc * 2;
+	struct str_set_entry *slots = arena_alloc(set->arena, alloc * sizeof(struct str_set_entry));
+	if (slots == NULL) {
 		return -ENOMEM;
 	}
+	memset(slots, 0, alloc * sizeof(struct str_set_entry));
 
-	memcpy(e->key, key, key_len + 1);
-	memcpy(e->value, value, value_len + 1);
+	for (size_t i = 0; i < set->alloc; i++) {
+		if (set->slots[i].str == NULL) {
+			continue;
+		}
+		size_t j = set->slots[i].hash & (alloc - 1);
+		while (slots[j].str != NULL) {
+			j = (j + 1) & (alloc - 1);
+		}
+		slots[j] = set->slots[i];
+	}
 
-	HASH_ADD_KEYPTR(hh, *kvs, e->key, key_len, e);
+	set->slots = slots;
+	set->alloc = alloc;
 	return 0;
 }
 
 /*
- * Perform open() with a given chroot()
+ * Returns non-zero if the set contains the given string.
  */
-static inline int fchroot_open(int root_fd, const char *bpath, int flags)
+static inline int str_set_contains(struct str_set *set, const char *str, size_t str_len)
 {
-	if (openat2_available) {
-		return openat2_fchroot_open(root_fd, bpath, O_NONBLOCK | flags, 0);
+	if (set->cnt == 0) {
+		return 0;
 	}
 
-	int rv = -EINVAL;
-	pthread_mutex_lock(&root_lock);
-
-	if ((current_root_fd == root_fd)
-		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
-		current_root_fd = root_fd;
-
-		rv = open(bpath, O_NONBLOCK | flags);
+	uint32_t hash = str_hash(str, str_len);
+	size_t i = hash & (set->alloc - 1);
+	while (set->slots[i].str != NULL) {
+		struct str_set_entry *e = &set->slots[i];
+		if (e->hash == hash && pstrcmp(e->str, e->len, str, str_len) == 0) {
+			return 1;
+		}
+		i = (i + 1) & (set->alloc - 1);
 	}
-
-	pthread_mutex_unlock(&root_lock);
-	return rv;
+	return 0;
 }
 
 /*
- * Perform stat() with a given chroot()
+ * Insert a string into a set.
+ *
+ * Returns 1 if the string was added, 0 if it was already present, and a
+ * negative errno on error.  If entry is non-NULL, it is pointed at the
+ * (possibly pre-existing) entry for the string.
  */
-static inline int fchroot_stat(int root_fd, const char *bpath, struct stat *buf)
+static inline int str_set_insert(struct str_set *set, const char *str, size_t str_len, struct str_set_entry **entry)
+{
+	/*
+	 * Keep the load factor at or below one half.
+	 */
+	if ((set->cnt + 1) * 2 > set->alloc && str_set_grow(set) < 0) {
+		return -ENOMEM;
+	}
+
+	uint32_t hash = str_hash(str, str_len);
+	size_t i = hash & (set->alloc - 1);
+	while (set->slots[i].str != NULL) {
+		struct str_set_entry *e = &set->slots[i];
+		if (e->hash == hash && pstrcmp(e->str, e->len, str, str_len) == 0) {
+			if (entry != NULL) {
+				*entry = e;
+			}
+			return 0;
+		}
+		i = (i + 1) & (set->alloc - 1);
+	}
+
+	char *copy = arena_alloc(set->arena, str_len + 1);
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(copy, str, str_len);
+	copy[str_len] = '\0';
+
+	struct str_set_entry *e = &set->slots[i];
+	e->str = copy;
+	e->len = str_len;
+	e->hash = hash;
+	e->value = NULL;
+	set->cnt++;
+
+	if (entry != NULL) {
+		*entry = e;
+	}
+	return 1;
+}
+
+/*
+ * Insert a string into a set, discarding whether or not it was already
+ * present.
+ */
+static inline int insert_str(struct str_set *set, const char *str, size_t str_len)
+{
+	int rv = str_set_insert(set, str, str_len, NULL);
+	return rv < 0 ? rv : 0;
+}
+
+/*
+ * Insert a key/value pair into a set.  If the key is already present, the
+ * pre-existing value is kept.
+ */
+static inline int insert_kv(struct str_set *set, const char *key, size_t key_len, const char *value)
+{
+	struct str_set_entry *e;
+	int rv = str_set_insert(set, key, key_len, &e);
+	if (rv <= 0) {
+		return rv;
+	}
+
+	size_t value_len = strlen(value);
+	e->value = arena_alloc(set->arena, value_len + 1);
+	if (e->value == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(e->value, value, value_len + 1);
+	return 0;
+}
+
+static inline void lock_root(void)
+{
+	TRACE(root__lock);
+	pthread_mutex_lock(&root_lock);
+	TRACE(root__locked);
+}
+
+static inline void unlock_root(void)
+{
+	pthread_mutex_unlock(&root_lock);
+	TRACE(root__unlock);
+}
+
+/*
+ * Perform open() with a given chroot()
+ */
+static inline int fchroot_open(int root_fd, const char *bpath, int flags)
+{
+	if (openat2_available) {
+		return openat2_fchroot_open(root_fd, bpath, O_NONBLOCK | flags, 0);
+	}
+
+	int rv = -EINVAL;
+	lock_root();
+
+	if ((current_root_fd == root_fd)
+		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
+		current_root_fd = root_fd;
+
+		rv = open(bpath, O_NONBLOCK | flags);
+	}
+
+	unlock_root();
+	return rv;
+}
+
+/*
+ * Perform stat() with a given chroot()
+ */
+static inline int fchroot_stat(int root_fd, const char *bpath, struct stat *buf)
 {
 	if (openat2_available) {
 		/*
@@ -756,7 +1446,7 @@ static inline int fchroot_stat(int root_fd, const char *bpath, struct stat *buf)
 	}
 
 	int rv = -EAGAIN;
-	pthread_mutex_lock(&root_lock);
+	lock_root();
 
 	if ((current_root_fd == root_fd)
 		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
@@ -765,7 +1455,7 @@ static inline int fchroot_stat(int root_fd, const char *bpath, struct stat *buf)
 		rv = stat(bpath, buf);
 	}
 
-	pthread_mutex_unlock(&root_lock);
+	unlock_root();
 	return rv;
 }
 
@@ -784,7 +1474,7 @@ static inline int fchroot_file_exists(int root_fd, const char *bpath)
 	}
 
 	int rv = -EINVAL;
-	pthread_mutex_lock(&root_lock);
+	lock_root();
 
 	if ((current_root_fd == root_fd)
 		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
@@ -794,7 +1484,7 @@ static inline int fchroot_file_exists(int root_fd, const char *bpath)
 		rv = stat(bpath, &stbuf) >= 0;
 	}
 
-	pthread_mutex_unlock(&root_lock);
+	unlock_root();
 	return rv;
 }
 
@@ -819,7 +1509,7 @@ static inline FILE *fchroot_fopen_rdonly(int root_fd, const char *bpath)
 	}
 
 	FILE *rv = NULL;
-	pthread_mutex_lock(&root_lock);
+	lock_root();
 
 	if ((current_root_fd == root_fd)
 		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
@@ -828,19 +1518,68 @@ static inline FILE *fchroot_fopen_rdonly(int root_fd, const char *bpath)
 		rv = fopen(bpath, "r");
 	}
 
-	pthread_mutex_unlock(&root_lock);
+	unlock_root();
 	return rv;
 }
 
 /*
- * Fill a hash table with directory entries given a chroot().
+ * Fill a string set with directory entries using openat2() rather than
+ * chroot().  Only call this function if openat2_available is set.
  */
-static inline int fchroot_filldir(int root_fd, const char *const bpath, struct h_str *files)
+static inline int openat2_fchroot_filldir(int root_fd, const char *const bpath, struct str_set *files)
+{
+	DIR *d = NULL;
+	char buf[2];
+	int rv = 0;
+	int fd = openat2_fchroot_open(root_fd, bpath, O_PATH | O_NOFOLLOW, 0);
+	if (fd >= 0 && readlinkat(fd, "", buf, sizeof(buf)) == 1 && buf[0] == '.') {
+		// skip self-symlinks such as the common /usr/bin/X11
+		close(fd);
+		return 0;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if ((fd = openat2_fchroot_open(root_fd, bpath, O_RDONLY | O_DIRECTORY, 0)) >= 0 && (d = fdopendir(fd)) != NULL) {
+		struct dirent *dir;
+		while ((dir = readdir(d)) != NULL) {
+			size_t len = strlen(dir->d_name);
+			if (str_set_contains(files, dir->d_name, len)) {
+				continue;
+			}
+
+			char tmp[PATH_MAX];
+			int s = snprintf(tmp, PATH_MAX, "%s/%s", bpath, dir->d_name);
+			if (s < 0 || s >= (int)sizeof(tmp)) {
+				continue;
+			}
+			if (!fchroot_file_exists(root_fd, tmp)) {
+				continue;
+			}
+
+			rv |= insert_str(files, dir->d_name, len);
+		}
+	} else if (errno != ENOENT) {
+		rv = -errno;
+	}
+	if (d != NULL) {
+		closedir(d);
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	return rv;
+}
+
+/*
+ * Fill a string set with directory entries given a chroot().
+ */
+static inline int fchroot_filldir(int root_fd, const char *const bpath, struct str_set *files)
 {
 	/*
-	 * The openat2_available code path here was found to be slower on
-	 * average than the chroot code path on large directories, even in
-	 * heavily multithreaded workflows.
+	 * openat2_fchroot_filldir() was found to be slower on average than
+	 * the chroot code path on large directories, even in heavily
+	 * multithreaded workflows.
 	 *
 	 * This is likely because the no-chroot check to see if any given
 	 * directory entry is a dangling symbolic link takes two system calls,
@@ -850,48 +1589,13 @@ static inline int fchroot_filldir(int root_fd, const char *const bpath, struct h
 	 * Note this reasoning does not apply to the other fchroot_*()
 	 * functions which perform far fewer internal system calls.
 	 *
-	 * if (openat2_available) {
-	 *      DIR *d = NULL;
-	 *      char buf[2];
-	 *      int fd = -1;
-	 *      int rv = 0;
-	 *      if (fchroot_readlink(root_fd, bpath, buf, sizeof(buf)) == 1 && buf[0] == '.') {
-	 *              // skip the common /usr/bin/X11 symlink to `.`
-	 *      } else if ((fd = openat2_fchroot_open(root_fd, bpath, O_RDONLY | O_DIRECTORY, 0)) >= 0 && (d = fdopendir(fd)) != NULL) {
-	 *              struct dirent *dir;
-	 *              while ((dir = readdir(d)) != NULL) {
-	 *                      struct h_str *e = NULL;
-	 *                      size_t len = strlen(dir->d_name);
-	 *                      HASH_FIND(hh, files, dir->d_name, len, e);
-	 *                      if (e != NULL) {
-	 *                              continue;
-	 *                      }
-	 * 
-	 *                      char tmp[PATH_MAX];
-	 *                      int s = snprintf(tmp, PATH_MAX, "%s/%s", bpath, dir->d_name);
-	 *                      if (s < 0 || s >= (int)sizeof(tmp)) {
-	 *                              continue;
-	 *                      }
-	 *                      if (!fchroot_file_exists(root_fd, tmp)) {
-	 *                              continue;
-	 *                      }
-	 * 
-	 *                      rv |= insert_h_str(&files, dir->d_name, len);
-	 *              }
-	 *      } else if (errno != ENOENT) {
-	 *              rv = -errno;
-	 *      }
-	 *      if (d != NULL) {
-	 *              closedir(d);
-	 *      } else if (fd >= 0) {
-	 *              close(fd);
-	 *      }
-	 *      return rv;
-	 * }
+	 * It is still used by probe workers, as the chroot path holds
+	 * root_lock for the duration and so a hung stratum would stall every
+	 * other chroot()-based call.
 	 */
 
 	int rv = 0;
-	pthread_mutex_lock(&root_lock);
+	lock_root();
 
 	if ((current_root_fd == root_fd)
 		|| (fchdir(root_fd) >= 0 && chroot(".") >= 0)) {
@@ -904,10 +1608,8 @@ static inline int fchroot_filldir(int root_fd, const char *const bpath, struct h
 		} else if (chdir(bpath) >= 0 && (d = opendir(".")) != NULL) {
 			struct dirent *dir;
 			while ((dir = readdir(d)) != NULL) {
-				struct h_str *e = NULL;
 				size_t len = strlen(dir->d_name);
-				HASH_FIND(hh, files, dir->d_name, len, e);
-				if (e != NULL) {
+				if (str_set_contains(files, dir->d_name, len)) {
 					continue;
 				}
 
@@ -915,7 +1617,7 @@ static inline int fchroot_filldir(int root_fd, const char *const bpath, struct h
 				if (stat(dir->d_name, &stbuf) < 0) {
 					continue;
 				}
-				rv |= insert_h_str(&files, dir->d_name, len);
+				rv |= insert_str(files, dir->d_name, len);
 			}
 			closedir(d);
 		} else if (errno != ENOENT) {
@@ -923,122 +1625,1098 @@ static inline int fchroot_filldir(int root_fd, const char *const bpath, struct h
 		}
 	}
 
-	pthread_mutex_unlock(&root_lock);
+	unlock_root();
+	return rv;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Find or create the health entry for a given stratum.
+ *
+ * Should be called with probe_lock held.
+ */
+static struct health *health_get(const char *name, size_t name_len)
+{
+	for (size_t i = 0; i < health_cnt; i++) {
+		if (pstrcmp(healths[i]->name, healths[i]->name_len, name, name_len) == 0) {
+			return healths[i];
+		}
+	}
+
+	struct health **new_healths = realloc(healths, (health_cnt + 1) * sizeof(struct health *));
+	if (new_healths == NULL) {
+		return NULL;
+	}
+	healths = new_healths;
+
+	struct health *h = calloc(1, sizeof(struct health));
+	if (h == NULL) {
+		return NULL;
+	}
+	if ((h->name = malloc(name_len + 1)) == NULL) {
+		free(h);
+		return NULL;
+	}
+	memcpy(h->name, name, name_len);
+	h->name[name_len] = '\0';
+	h->name_len = name_len;
+	h->deadline_ms = -1;
+
+	healths[health_cnt++] = h;
+	return h;
+}
+
+/*
+ * Get a stratum's health entry, caching it in the stratum such that later
+ * probes do not search for it.
+ */
+static inline struct health *stratum_health(struct stratum *stratum)
+{
+	struct health *h = __atomic_load_n(&stratum->health, __ATOMIC_ACQUIRE);
+	if (h == NULL) {
+		pthread_mutex_lock(&probe_lock);
+		h = health_get(stratum->name, stratum->name_len);
+		pthread_mutex_unlock(&probe_lock);
+		__atomic_store_n(&stratum->health, h, __ATOMIC_RELEASE);
+	}
+	return h;
+}
+
+/*
+ * The deadline to apply to a stratum's probes, or zero to wait indefinitely.
+ *
+ * Without openat2(), probes take root_lock and a hung stratum stalls every
+ * other probe regardless.  Don't bother handing them to another thread.
+ */
+static inline long health_deadline(struct health *h)
+{
+	if (!openat2_available) {
+		return 0;
+	}
+	long deadline_ms = __atomic_load_n(&h->deadline_ms, __ATOMIC_RELAXED);
+	return deadline_ms >= 0 ? deadline_ms : __atomic_load_n(&default_deadline_ms, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns non-zero if the stratum's breaker is open and it should not be
+ * probed.
+ */
+static inline int health_skip(struct health *h, uint64_t now)
+{
+	if (__atomic_load_n(&h->stalled, __ATOMIC_RELAXED) > 0
+		|| __atomic_load_n(&h->open_until_ns, __ATOMIC_RELAXED) > now) {
+		__atomic_add_fetch(&h->skips, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Record a probe's latency.  in_time indicates whether it returned before
+ * its deadline, which closes the breaker.
+ *
+ * Concurrent probes may lose each other's contribution to the average, which
+ * is close enough for a statistic.
+ */
+static inline void health_record(struct health *h, uint64_t elapsed, int in_time)
+{
+	if (__atomic_fetch_add(&h->probes, 1, __ATOMIC_RELAXED) == 0) {
+		__atomic_store_n(&h->avg_ns, elapsed, __ATOMIC_RELAXED);
+	} else {
+		uint64_t avg = __atomic_load_n(&h->avg_ns, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->avg_ns, avg - avg / 8 + elapsed / 8, __ATOMIC_RELAXED);
+	}
+	uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (elapsed > max && !__atomic_compare_exchange_n(&h->max_ns, &max, elapsed, 0, __ATOMIC_RELAXED,
+			__ATOMIC_RELAXED)) {
+	}
+	if (in_time) {
+		__atomic_store_n(&h->strikes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->open_until_ns, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Record a probe which missed its deadline, opening the breaker if it keeps
+ * happening.
+ */
+static inline void health_timeout(struct health *h, uint64_t now)
+{
+	__atomic_add_fetch(&h->timeouts, 1, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&h->strikes, 1, __ATOMIC_RELAXED) >= BREAKER_THRESHOLD) {
+		__atomic_store_n(&h->open_until_ns, now + (uint64_t)BREAKER_COOLDOWN_MS * 1000000,
+			__ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Perform a probe's operation.  The return value and errno follow the
+ * underlying fchroot_*() function.
+ */
+static inline int probe_exec(enum probe_op op, int root_fd, const char *bpath, int flags, struct stat *stbuf,
+	struct str_set *files, int threaded)
+{
+	switch (op) {
+	case PROBE_STAT:
+		return fchroot_stat(root_fd, bpath, stbuf);
+	case PROBE_OPEN:
+		return fchroot_open(root_fd, bpath, flags);
+	case PROBE_EXISTS:
+		return fchroot_file_exists(root_fd, bpath);
+	case PROBE_FILLDIR:
+	default:
+		if (threaded) {
+			return openat2_fchroot_filldir(root_fd, bpath, files);
+		}
+		return fchroot_filldir(root_fd, bpath, files);
+	}
+}
+
+static void probe_free(struct probe *p)
+{
+	if (p->op == PROBE_OPEN && p->rv >= 0) {
+		close(p->rv);
+	}
+	close(p->root_fd);
+	arena_free(&p->arena);
+	pthread_cond_destroy(&p->cond);
+	free(p);
+}
+
+static void *probe_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&probe_lock);
+	for (;;) {
+		while (probe_head == NULL) {
+			probe_idle++;
+			pthread_cond_wait(&probe_queue_cond, &probe_lock);
+			probe_idle--;
+		}
+		struct probe *p = probe_head;
+		probe_head = p->next;
+		if (probe_head == NULL) {
+			probe_tail = NULL;
+		}
+		/*
+		 * The requesting thread's deadline starts now.
+		 */
+		p->exec_ns = now_ns();
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&probe_lock);
+
+		setfsuid(p->uid);
+		setfsgid(p->gid);
+		p->rv = probe_exec(p->op, p->root_fd, p->bpath, p->flags, &p->stbuf, &p->files, 1);
+		p->err = errno;
+		uint64_t elapsed = now_ns() - p->exec_ns;
+
+		pthread_mutex_lock(&probe_lock);
+		p->done = 1;
+		p->health->inflight--;
+		if (p->abandoned) {
+			__atomic_sub_fetch(&p->health->stalled, 1, __ATOMIC_RELAXED);
+			health_record(p->health, elapsed, 0);
+			probe_free(p);
+		} else {
+			health_record(p->health, elapsed, 1);
+			pthread_cond_signal(&p->cond);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Queue a probe for a worker thread, starting one if none are idle.
+ *
+ * Should be called with probe_lock held.  Returns non-zero if there is no
+ * worker to run the probe, in which case it is not queued.
+ */
+static int probe_submit(struct probe *p)
+{
+	if (probe_idle == 0 && probe_workers < PROBE_WORKERS_MAX) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		if (pthread_attr_init(&attr) == 0) {
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&thread, &attr, probe_worker, NULL) == 0) {
+				probe_workers++;
+			}
+			pthread_attr_destroy(&attr);
+		}
+	}
+	if (probe_workers == 0) {
+		return -1;
+	}
+
+	p->next = NULL;
+	if (probe_tail == NULL) {
+		probe_head = p;
+	} else {
+		probe_tail->next = p;
+	}
+	probe_tail = p;
+	pthread_cond_signal(&probe_queue_cond);
+	return 0;
+}
+
+/*
+ * Remove a probe which no worker has started from the queue.
+ *
+ * Should be called with probe_lock held.
+ */
+static void probe_unqueue(struct probe *p)
+{
+	struct probe *prev = NULL;
+	for (struct probe *cur = probe_head; cur != NULL; prev = cur, cur = cur->next) {
+		if (cur != p) {
+			continue;
+		}
+		if (prev == NULL) {
+			probe_head = p->next;
+		} else {
+			prev->next = p->next;
+		}
+		if (probe_tail == p) {
+			probe_tail = prev;
+		}
+		return;
+	}
+}
+
+/*
+ * Probe a stratum's bpath, honoring its deadline and circuit breaker.
+ *
+ * If the stratum is skipped or misses its deadline, this acts as though the
+ * stratum does not provide the bpath.  Otherwise, the return value and errno
+ * follow the underlying fchroot_*() function.
+ */
+static int probe(struct stratum *stratum, enum probe_op op, const char *bpath, int flags, struct stat *stbuf,
+	struct str_set *files)
+{
+	int rv;
+	int err;
+
+	/*
+	 * Most systems configure no deadlines.  Don't pay for tracking them.
+	 */
+	if (!openat2_available || !__atomic_load_n(&deadlines_set, __ATOMIC_RELAXED)) {
+		return probe_exec(op, stratum->root_fd, bpath, flags, stbuf, files, 0);
+	}
+
+	uint64_t start = now_ns();
+	struct health *h = stratum_health(stratum);
+	if (h != NULL && health_skip(h, start)) {
+		TRACE(stratum__skip, stratum->name);
+		goto skip;
+	}
+	long deadline_ms = h != NULL ? health_deadline(h) : 0;
+	if (deadline_ms <= 0) {
+		goto sync;
+	}
+
+	struct probe *p = calloc(1, sizeof(struct probe));
+	if (p == NULL) {
+		goto sync;
+	}
+	if ((p->root_fd = fcntl(stratum->root_fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		free(p);
+		goto sync;
+	}
+	if (pthread_cond_init(&p->cond, &monotonic_condattr) != 0) {
+		close(p->root_fd);
+		free(p);
+		goto sync;
+	}
+	struct fuse_context *context = fuse_get_context();
+	p->op = op;
+	strcpy(p->bpath, bpath);
+	p->flags = flags;
+	p->uid = context->uid;
+	p->gid = context->gid;
+	p->health = h;
+	p->rv = -1;
+	str_set_init(&p->files, &p->arena);
+
+	pthread_mutex_lock(&probe_lock);
+	if (h->inflight >= PROBE_INFLIGHT_MAX) {
+		pthread_mutex_unlock(&probe_lock);
+		probe_free(p);
+		health_timeout(h, start);
+		TRACE(stratum__timeout, stratum->name, deadline_ms);
+		goto skip;
+	}
+	if (probe_submit(p) < 0) {
+		pthread_mutex_unlock(&probe_lock);
+		probe_free(p);
+		goto sync;
+	}
+	h->inflight++;
+
+	/*
+	 * The deadline covers the probe itself rather than time spent queued
+	 * behind other strata's probes.  Push it back once a worker starts the
+	 * probe.
+	 */
+	uint64_t deadline_ns = start + (uint64_t)deadline_ms * 1000000;
+	int wait_rv = 0;
+	while (!p->done && wait_rv != ETIMEDOUT) {
+		struct timespec abstime = {
+			deadline_ns / 1000000000,
+			deadline_ns % 1000000000,
+		};
+		wait_rv = pthread_cond_timedwait(&p->cond, &probe_lock, &abstime);
+		if (p->exec_ns != 0 && p->exec_ns + (uint64_t)deadline_ms * 1000000 > deadline_ns) {
+			deadline_ns = p->exec_ns + (uint64_t)deadline_ms * 1000000;
+			wait_rv = 0;
+		}
+	}
+	if (!p->done && p->exec_ns == 0) {
+		/*
+		 * No worker was free in time.  This says nothing about the
+		 * stratum, so skip it without a strike.
+		 */
+		probe_unqueue(p);
+		h->inflight--;
+		pthread_mutex_unlock(&probe_lock);
+		probe_free(p);
+		__atomic_add_fetch(&h->skips, 1, __ATOMIC_RELAXED);
+		TRACE(stratum__skip, stratum->name);
+		goto skip;
+	}
+	if (!p->done) {
+		p->abandoned = 1;
+		__atomic_add_fetch(&h->stalled, 1, __ATOMIC_RELAXED);
+		health_timeout(h, now_ns());
+		pthread_mutex_unlock(&probe_lock);
+		TRACE(stratum__timeout, stratum->name, deadline_ms);
+		goto skip;
+	}
+	pthread_mutex_unlock(&probe_lock);
+
+	rv = p->rv;
+	err = p->err;
+	switch (op) {
+	case PROBE_STAT:
+		*stbuf = p->stbuf;
+		break;
+	case PROBE_OPEN:
+		/*
+		 * Ownership of the file descriptor passes to the caller.
+		 */
+		p->rv = -1;
+		break;
+	case PROBE_FILLDIR:
+		for (size_t i = 0; i < p->files.alloc; i++) {
+			if (p->files.slots[i].str != NULL) {
+				rv |= insert_str(files, p->files.slots[i].str, p->files.slots[i].len);
+			}
+		}
+		break;
+	case PROBE_EXISTS:
+	default:
+		break;
+	}
+	probe_free(p);
+	errno = err;
+	return rv;
+
+sync:
+	rv = probe_exec(op, stratum->root_fd, bpath, flags, stbuf, files, 0);
+	err = errno;
+	if (h != NULL) {
+		health_record(h, now_ns() - start, 1);
+	}
+	errno = err;
 	return rv;
+
+skip:
+	switch (op) {
+	case PROBE_STAT:
+	case PROBE_OPEN:
+		errno = ENOENT;
+		return -1;
+	case PROBE_EXISTS:
+	case PROBE_FILLDIR:
+	default:
+		return 0;
+	}
+}
+
+/*
+ * 64-bit FNV-1a, continuing from a previous hash.  Start with
+ * 14695981039346656037.
+ */
+static inline uint64_t hot_hash(uint64_t hash, const char *str, size_t str_len)
+{
+	for (size_t i = 0; i < str_len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+/*
+ * Count an occurrence of hash and return the estimated total.  Each row's
+ * index is derived from the two halves of the hash.
+ */
+static inline uint32_t sketch_add(struct hot_sketch *sketch, uint64_t hash)
+{
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	uint32_t est = UINT32_MAX;
+	for (uint32_t i = 0; i < HOT_DEPTH; i++) {
+		uint32_t c = __atomic_add_fetch(&sketch->counts[i][(h1 + i * h2) & (HOT_WIDTH - 1)], 1,
+			__ATOMIC_RELAXED);
+		est = MIN(est, c);
+	}
+	return est;
+}
+
+static inline uint32_t sketch_get(struct hot_sketch *sketch, uint64_t hash)
+{
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	uint32_t est = UINT32_MAX;
+	for (uint32_t i = 0; i < HOT_DEPTH; i++) {
+		uint32_t c = __atomic_load_n(&sketch->counts[i][(h1 + i * h2) & (HOT_WIDTH - 1)], __ATOMIC_RELAXED);
+		est = MIN(est, c);
+	}
+	return est;
+}
+
+static void hot_sift_down(struct hot_list *list, size_t i)
+{
+	for (;;) {
+		size_t least = i;
+		size_t l = 2 * i + 1;
+		size_t r = 2 * i + 2;
+		if (l < list->cnt && list->heap[l]->count < list->heap[least]->count) {
+			least = l;
+		}
+		if (r < list->cnt && list->heap[r]->count < list->heap[least]->count) {
+			least = r;
+		}
+		if (least == i) {
+			return;
+		}
+		struct hot_entry *tmp = list->heap[i];
+		list->heap[i] = list->heap[least];
+		list->heap[least] = tmp;
+		i = least;
+	}
+}
+
+static void hot_sift_up(struct hot_list *list, size_t i)
+{
+	while (i > 0 && list->heap[(i - 1) / 2]->count > list->heap[i]->count) {
+		struct hot_entry *tmp = list->heap[i];
+		list->heap[i] = list->heap[(i - 1) / 2];
+		list->heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+/*
+ * Offer an estimated count for hash to a hot_list.  If hash is newly
+ * tracked, returns its entry for the caller to describe.  Otherwise returns
+ * NULL.
+ *
+ * Should be called with hot_lock held.
+ */
+static struct hot_entry *hot_offer(struct hot_list *list, uint64_t hash, uint32_t count)
+{
+	struct hot_entry *e = NULL;
+	for (size_t i = 0; i < list->cnt; i++) {
+		if (list->heap[i]->hash == hash) {
+			if (count > list->heap[i]->count) {
+				list->heap[i]->count = count;
+				hot_sift_down(list, i);
+			}
+			goto update_min;
+		}
+	}
+
+	if (list->cnt < HOT_K) {
+		e = &list->pool[list->cnt];
+		list->heap[list->cnt] = e;
+		e->hash = hash;
+		e->count = count;
+		hot_sift_up(list, list->cnt++);
+	} else if (count > list->heap[0]->count) {
+		e = list->heap[0];
+		e->hash = hash;
+		e->count = count;
+		hot_sift_down(list, 0);
+	}
+
+update_min:
+	__atomic_store_n(&list->min, list->cnt < HOT_K ? 0 : list->heap[0]->count, __ATOMIC_RELAXED);
+	return e;
+}
+
+/*
+ * Halve all counts.  Relative order is unchanged, and so the heaps remain
+ * valid.
+ */
+static void hot_decay(void)
+{
+	struct hot_list *lists[] = { &hot_paths, &hot_callers };
+	for (size_t l = 0; l < ARRAY_LEN(lists); l++) {
+		for (size_t i = 0; i < HOT_DEPTH; i++) {
+			for (size_t j = 0; j < HOT_WIDTH; j++) {
+				uint32_t *c = &lists[l]->sketch.counts[i][j];
+				__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&hot_lock);
+	for (size_t l = 0; l < ARRAY_LEN(lists); l++) {
+		for (size_t i = 0; i < lists[l]->cnt; i++) {
+			lists[l]->heap[i]->count /= 2;
+		}
+		__atomic_store_n(&lists[l]->min, lists[l]->cnt < HOT_K ? 0 : lists[l]->heap[0]->count,
+			__ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&hot_lock);
+}
+
+/*
+ * Count a request against its (op, ipath) and its caller.
+ *
+ * Expects local_stratum to be populated.
+ */
+static inline void hot_record(const char *op, const char *ipath)
+{
+	uint64_t now = now_ns();
+	uint64_t decay = __atomic_load_n(&hot_decay_ns, __ATOMIC_RELAXED);
+	if (now >= decay && __atomic_compare_exchange_n(&hot_decay_ns, &decay,
+			now + (uint64_t)HOT_DECAY_MS * 1000000, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		hot_decay();
+	}
+
+	size_t ipath_len = strlen(ipath);
+	uint64_t path_hash = hot_hash(hot_hash(14695981039346656037u, op, strlen(op) + 1), ipath, ipath_len);
+	uint32_t path_count = sketch_add(&hot_paths.sketch, path_hash);
+
+	pid_t pid = fuse_get_context()->pid;
+	uint64_t caller_hash = hot_hash(14695981039346656037u, (const char *)&pid, sizeof(pid));
+	uint32_t caller_count = sketch_add(&hot_callers.sketch, caller_hash);
+
+	int path_hot = path_count > __atomic_load_n(&hot_paths.min, __ATOMIC_RELAXED);
+	int caller_hot = caller_count > __atomic_load_n(&hot_callers.min, __ATOMIC_RELAXED);
+	if (!path_hot && !caller_hot) {
+		return;
+	}
+
+	pthread_mutex_lock(&hot_lock);
+	struct hot_entry *e;
+	if (path_hot && (e = hot_offer(&hot_paths, path_hash, path_count)) != NULL) {
+		e->op = op;
+		e->key[PATH_MAX - 1] = '\0';
+		strncpy(e->key, ipath, PATH_MAX - 1);
+	}
+	if (caller_hot && (e = hot_offer(&hot_callers, caller_hash, caller_count)) != NULL) {
+		e->pid = pid;
+		e->key[PATH_MAX - 1] = '\0';
+		strncpy(e->key, local_stratum.name, PATH_MAX - 1);
+		strcpy(e->comm, "?");
+		char comm_path[PATH_MAX];
+		int s = snprintf(comm_path, sizeof(comm_path), "%d/comm", pid);
+		int fd = -1;
+		if (s >= 0 && s < (int)sizeof(comm_path) && (fd = openat(procfs_fd, comm_path, O_RDONLY)) >= 0) {
+			ssize_t len = read(fd, e->comm, sizeof(e->comm) - 1);
+			if (len > 0) {
+				e->comm[len] = '\0';
+				e->comm[strcspn(e->comm, "\n")] = '\0';
+			}
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&hot_lock);
+}
+
+static int hot_entry_cmp(const void *a, const void *b)
+{
+	const struct hot_entry *e1 = a;
+	const struct hot_entry *e2 = b;
+	return e1->count < e2->count ? 1 : e1->count > e2->count ? -1 : 0;
+}
+
+/*
+ * Snapshot a hot_list with current counts, most frequent first.
+ */
+static size_t hot_snapshot(struct hot_list *list, struct hot_entry *out)
+{
+	pthread_mutex_lock(&hot_lock);
+	size_t cnt = list->cnt;
+	for (size_t i = 0; i < cnt; i++) {
+		out[i] = *list->heap[i];
+		out[i].count = sketch_get(&list->sketch, out[i].hash);
+	}
+	pthread_mutex_unlock(&hot_lock);
+
+	qsort(out, cnt, sizeof(struct hot_entry), hot_entry_cmp);
+	return cnt;
 }
 
 /*
  * Perform a stat() against every bpath and return after the first non-ENOENT
  * hit.
  */
-static inline int stat_first_bpath(struct cfg_entry *cfg, const char *ipath, size_t ipath_len, struct stat *stbuf)
+static inline int stat_first_bpath(struct cfg_entry *cfg, const char *ipath, size_t ipath_len, struct stat *stbuf)
+{
+	int rv = -ENOENT;
+	for (size_t i = 0; i < cfg->back_cnt; i++) {
+		char tmp[PATH_MAX];
+		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
+			ipath_len, tmp);
+		if (bpath == NULL) {
+			continue;
+		}
+
+		rv = probe(deref(&cfg->back[i]), PROBE_STAT, bpath, 0, stbuf, NULL);
+		TRACE(stat__bpath, deref(&cfg->back[i])->name, bpath, rv < 0 ? -errno : rv);
+		if (rv >= 0 || errno != ENOENT) {
+			break;
+		}
+	}
+	return rv;
+}
+
+/*
+ * Perform a open() against every bpath and return after the first non-ENOENT
+ * hit.
+ */
+static inline int open_first_bpath(struct cfg_entry *entry, const char *ipath, size_t ipath_len, int flags)
+{
+	int rv = -ENOENT;
+	for (size_t i = 0; i < entry->back_cnt; i++) {
+		char tmp[PATH_MAX];
+		char *bpath = calc_bpath(entry, &entry->back[i], ipath,
+			ipath_len, tmp);
+		if (bpath == NULL) {
+			continue;
+		}
+
+		rv = probe(deref(&entry->back[i]), PROBE_OPEN, bpath, flags, NULL, NULL);
+		TRACE(open__bpath, deref(&entry->back[i])->name, bpath, rv < 0 ? -errno : rv);
+		if (rv >= 0 || errno != ENOENT) {
+			break;
+		}
+	}
+	return rv;
+}
+
+/*
+ * Retrieves the location of the first file (except dangling symlinks) for the
+ * given ipath/entry.
+ */
+static inline int loc_first_bpath(struct cfg_entry *cfg,
+	const char *ipath, size_t ipath_len, struct back_entry **back, char obpath[PATH_MAX])
+{
+	int rv = -ENOENT;
+	for (size_t i = 0; i < cfg->back_cnt; i++) {
+		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
+			ipath_len, obpath);
+		if (bpath == NULL) {
+			continue;
+		}
+
+		int exists = probe(deref(&cfg->back[i]), PROBE_EXISTS, bpath, 0, NULL, NULL);
+		TRACE(loc__bpath, deref(&cfg->back[i])->name, bpath, exists ? 0 : -ENOENT);
+		if (exists) {
+			*back = &cfg->back[i];
+			obpath[PATH_MAX - 1] = '\0';
+			strncpy(obpath, bpath, PATH_MAX);
+			if (obpath[PATH_MAX - 1] != '\0') {
+				rv = -E2BIG;
+			} else {
+				rv = 0;
+			}
+			break;
+		}
+	}
+	return rv;
+}
+
+/*
+ * Perform a filldir() against every bpath.
+ */
+static inline int filldir_all_bpath(struct cfg_entry *cfg, const char *ipath, size_t ipath_len, struct str_set *files)
+{
+	int rv = 0;
+	for (size_t i = 0; i < cfg->back_cnt; i++) {
+		char tmp[PATH_MAX];
+		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
+			ipath_len, tmp);
+		if (bpath == NULL) {
+			continue;
+		}
+
+		(void)probe(deref(&cfg->back[i]), PROBE_FILLDIR, bpath, 0, NULL, files);
+	}
+	return rv;
+}
+
+/*
+ * Like strncat, except:
+ * - Do not use trailing null; track offset into buffer instead
+ * - Skip set number of input bytes before writing into buffer
+ */
+void strcatoff(char *buf, const char *const str, size_t str_len, size_t *offset, size_t *wrote, size_t max)
+{
+	if ((*offset) >= str_len) {
+		(*offset) -= str_len;
+		return;
+	}
+
+	size_t len = MIN(str_len - (*offset), max - (*wrote));
+	memcpy(buf + (*wrote), str + (*offset), len);
+
+	(*wrote) += len;
+	(*offset) = 0;
+}
+
+/*
+ * Append a string to a growable, malloc()'d buffer.
+ */
+static int buf_append(char **buf, size_t *len, size_t *alloc, const char *str, size_t str_len)
+{
+	if (*len + str_len + 1 > *alloc) {
+		size_t new_alloc = *alloc == 0 ? 4096 : *alloc;
+		while (*len + str_len + 1 > new_alloc) {
+			new_alloc *= 2;
+		}
+		char *new_buf = realloc(*buf, new_alloc);
+		if (new_buf == NULL) {
+			return -ENOMEM;
+		}
+		*buf = new_buf;
+		*alloc = new_alloc;
+	}
+
+	memcpy(*buf + *len, str, str_len);
+	*len += str_len;
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+/*
+ * Append a configuration line, as read from CFG_NAME, to a buffer.
+ */
+static int buf_append_cfg_line(char **buf, size_t *len, size_t *alloc, struct cfg_entry *cfg, struct back_entry *back)
+{
+	int rv = 0;
+	rv |= buf_append(buf, len, alloc, filter_str[cfg->filter], strlen(filter_str[cfg->filter]));
+	rv |= buf_append(buf, len, alloc, " ", 1);
+	rv |= buf_append(buf, len, alloc, cfg->cpath, cfg->cpath_len);
+	rv |= buf_append(buf, len, alloc, " ", 1);
+	rv |= buf_append(buf, len, alloc, back->alias.name, back->alias.name_len);
+	rv |= buf_append(buf, len, alloc, ":", 1);
+	rv |= buf_append(buf, len, alloc, back->lpath, back->lpath_len);
+	rv |= buf_append(buf, len, alloc, "\n", 1);
+	return rv;
+}
+
+/*
+ * Append an integer to a growable buffer in host byte order.  Snapshots are
+ * only read back by the machine which wrote them.
+ */
+static int buf_append_u64(char **buf, size_t *len, size_t *alloc, uint64_t val)
+{
+	return buf_append(buf, len, alloc, (const char *)&val, sizeof(val));
+}
+
+static int buf_append_u32(char **buf, size_t *len, size_t *alloc, uint32_t val)
+{
+	return buf_append(buf, len, alloc, (const char *)&val, sizeof(val));
+}
+
+static int buf_append_u16(char **buf, size_t *len, size_t *alloc, uint16_t val)
+{
+	return buf_append(buf, len, alloc, (const char *)&val, sizeof(val));
+}
+
+/*
+ * Serialize the configuration.  The format is:
+ *
+ *     magic[SNAPSHOT_MAGIC_LEN]
+ *     u64 generation
+ *     u32 stratum count, then per stratum: u16 name length, name
+ *     u32 cfg count, then per cfg:
+ *         u8 filter, u16 cpath length, cpath, u32 back count,
+ *         then per back: u16 stratum index, u16 lpath length, lpath
+ *     u64 checksum of all of the above
+ *
+ * Each stratum name is stored once such that loading can open one root
+ * directory per stratum rather than one per line.
+ *
+ * Caller should rdlock cfg_lock.
+ */
+static int snapshot_render(char **buf, size_t *len, size_t *alloc)
+{
+	const struct stratum **strata = NULL;
+	size_t strata_cnt = 0;
+	int rv = 0;
+
+	/*
+	 * Index strata by first appearance.  The number of strata is small
+	 * enough that a linear scan is fine.
+	 */
+	for (size_t i = 0; i < cfg_cnt && rv >= 0; i++) {
+		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+			const struct stratum *alias = &cfgs[i].back[j].alias;
+			size_t k;
+			for (k = 0; k < strata_cnt; k++) {
+				if (pstrcmp(strata[k]->name, strata[k]->name_len, alias->name, alias->name_len) == 0) {
+					break;
+				}
+			}
+			if (k < strata_cnt) {
+				continue;
+			}
+			const struct stratum **tmp = realloc(strata, (strata_cnt + 1) * sizeof(*strata));
+			if (tmp == NULL) {
+				rv = -ENOMEM;
+				break;
+			}
+			strata = tmp;
+			strata[strata_cnt++] = alias;
+		}
+	}
+	if (rv < 0 || strata_cnt > UINT16_MAX) {
+		free(strata);
+		return -ENOMEM;
+	}
+
+	rv |= buf_append(buf, len, alloc, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	rv |= buf_append_u64(buf, len, alloc, cfg_generation);
+	rv |= buf_append_u32(buf, len, alloc, strata_cnt);
+	for (size_t i = 0; i < strata_cnt; i++) {
+		rv |= buf_append_u16(buf, len, alloc, strata[i]->name_len);
+		rv |= buf_append(buf, len, alloc, strata[i]->name, strata[i]->name_len);
+	}
+
+	rv |= buf_append_u32(buf, len, alloc, cfg_cnt);
+	for (size_t i = 0; i < cfg_cnt; i++) {
+		uint8_t filter = cfgs[i].filter;
+		rv |= buf_append(buf, len, alloc, (const char *)&filter, sizeof(filter));
+		rv |= buf_append_u16(buf, len, alloc, cfgs[i].cpath_len);
+		rv |= buf_append(buf, len, alloc, cfgs[i].cpath, cfgs[i].cpath_len);
+		rv |= buf_append_u32(buf, len, alloc, cfgs[i].back_cnt);
+		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+			struct back_entry *back = &cfgs[i].back[j];
+			uint16_t k;
+			for (k = 0; k < strata_cnt; k++) {
+				if (pstrcmp(strata[k]->name, strata[k]->name_len, back->alias.name,
+						back->alias.name_len) == 0) {
+					break;
+				}
+			}
+			rv |= buf_append_u16(buf, len, alloc, k);
+			rv |= buf_append_u16(buf, len, alloc, back->lpath_len);
+			rv |= buf_append(buf, len, alloc, back->lpath, back->lpath_len);
+		}
+	}
+
+	free(strata);
+	return rv;
+}
+
+/*
+ * Write the configuration to the snapshot file.  The file is written in
+ * full to a temporary name then renamed over the previous snapshot such that
+ * a crash never leaves a partial snapshot behind.
+ */
+static void snapshot_save(void)
 {
-	int rv = -ENOENT;
-	for (size_t i = 0; i < cfg->back_cnt; i++) {
-		char tmp[PATH_MAX];
-		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
-			ipath_len, tmp);
-		if (bpath == NULL) {
+	char *buf = NULL;
+	size_t len = 0;
+	size_t alloc = 0;
+
+	pthread_rwlock_rdlock(&cfg_lock);
+	int rv = snapshot_render(&buf, &len, &alloc);
+	pthread_rwlock_unlock(&cfg_lock);
+
+	rv |= buf_append_u64(&buf, &len, &alloc, hot_hash(14695981039346656037u, buf, len));
+	if (rv < 0) {
+		free(buf);
+		return;
+	}
+
+	char tmp_name[PATH_MAX];
+	if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", snapshot_name) >= (int)sizeof(tmp_name)) {
+		free(buf);
+		return;
+	}
+
+	int fd = openat(snapshot_dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		free(buf);
+		return;
+	}
+	size_t written = 0;
+	while (written < len) {
+		ssize_t w = write(fd, buf + written, len - written);
+		if (w < 0 && errno == EINTR) {
 			continue;
 		}
-
-		rv = fchroot_stat(deref(&cfg->back[i])->root_fd, bpath, stbuf);
-		if (rv >= 0 || errno != ENOENT) {
+		if (w <= 0) {
 			break;
 		}
+		written += w;
+	}
+	free(buf);
+	if (close(fd) < 0 || written < len) {
+		unlinkat(snapshot_dir_fd, tmp_name, 0);
+		return;
+	}
+	if (renameat(snapshot_dir_fd, tmp_name, snapshot_dir_fd, snapshot_name) < 0) {
+		unlinkat(snapshot_dir_fd, tmp_name, 0);
 	}
-	return rv;
 }
 
 /*
- * Perform a open() against every bpath and return after the first non-ENOENT
- * hit.
+ * Save the configuration once it has stopped changing.  `brl apply` makes
+ * many changes in quick succession; there is no need to snapshot each one.
  */
-static inline int open_first_bpath(struct cfg_entry *entry, const char *ipath, size_t ipath_len, int flags)
+static void *snapshot_worker(void *arg)
 {
-	int rv = -ENOENT;
-	for (size_t i = 0; i < entry->back_cnt; i++) {
-		char tmp[PATH_MAX];
-		char *bpath = calc_bpath(entry, &entry->back[i], ipath,
-			ipath_len, tmp);
-		if (bpath == NULL) {
+	(void)arg;
+
+	/*
+	 * Credentials are per-thread.  Ensure the snapshot is written as root
+	 * regardless of which request started this thread.
+	 */
+	setfsuid(0);
+	setfsgid(0);
+
+	pthread_mutex_lock(&snapshot_lock);
+	for (;;) {
+		if (snapshot_due_ns == 0) {
+			pthread_cond_wait(&snapshot_cond, &snapshot_lock);
 			continue;
 		}
-
-		rv = fchroot_open(deref(&entry->back[i])->root_fd, bpath, flags);
-		if (rv >= 0 || errno != ENOENT) {
-			break;
+		uint64_t due = snapshot_due_ns;
+		if (now_ns() < due) {
+			struct timespec abstime = {
+				.tv_sec = due / 1000000000,
+				.tv_nsec = due % 1000000000,
+			};
+			pthread_cond_timedwait(&snapshot_cond, &snapshot_lock, &abstime);
+			continue;
 		}
+		snapshot_due_ns = 0;
+		pthread_mutex_unlock(&snapshot_lock);
+		snapshot_save();
+		pthread_mutex_lock(&snapshot_lock);
 	}
-	return rv;
+	return NULL;
 }
 
 /*
- * Retrieves the location of the first file (except dangling symlinks) for the
- * given ipath/entry.
+ * Schedule a snapshot SNAPSHOT_DELAY_MS from now, superseding any pending
+ * one.
+ *
+ * The worker thread is started on first use rather than in main(), as
+ * fuse_main() may fork to daemonize and threads do not survive a fork.
  */
-static inline int loc_first_bpath(struct cfg_entry *cfg,
-	const char *ipath, size_t ipath_len, struct back_entry **back, char obpath[PATH_MAX])
+static void snapshot_mark(void)
 {
-	int rv = -ENOENT;
-	for (size_t i = 0; i < cfg->back_cnt; i++) {
-		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
-			ipath_len, obpath);
-		if (bpath == NULL) {
-			continue;
-		}
+	if (snapshot_name == NULL) {
+		return;
+	}
 
-		if (fchroot_file_exists(deref(&cfg->back[i])->root_fd, bpath)) {
-			*back = &cfg->back[i];
-			obpath[PATH_MAX - 1] = '\0';
-			strncpy(obpath, bpath, PATH_MAX);
-			if (obpath[PATH_MAX - 1] != '\0') {
-				rv = -E2BIG;
-			} else {
-				rv = 0;
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot_due_ns = now_ns() + (uint64_t)SNAPSHOT_DELAY_MS * 1000000;
+	if (!snapshot_thread_started) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		if (pthread_attr_init(&attr) == 0) {
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&thread, &attr, snapshot_worker, NULL) == 0) {
+				snapshot_thread_started = 1;
 			}
-			break;
+			pthread_attr_destroy(&attr);
 		}
 	}
-	return rv;
+	pthread_cond_signal(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_lock);
 }
 
 /*
- * Perform a filldir() against every bpath.
+ * Drop all tracked configuration changes.  Changes since any generation
+ * before cfg_log_base will be reported as a full dump.
  */
-static inline int filldir_all_bpath(struct cfg_entry *cfg, const char *ipath, size_t ipath_len, struct h_str *files)
+static void cfg_log_clear(void)
 {
-	int rv = 0;
-	for (size_t i = 0; i < cfg->back_cnt; i++) {
-		char tmp[PATH_MAX];
-		char *bpath = calc_bpath(cfg, &cfg->back[i], ipath,
-			ipath_len, tmp);
-		if (bpath == NULL) {
-			continue;
-		}
-
-		(void)fchroot_filldir(deref(&cfg->back[i])->root_fd, bpath, files);
+	for (size_t i = 0; i < cfg_log_cnt; i++) {
+		free(cfg_log[i].line);
 	}
-	return rv;
+	free(cfg_log);
+	cfg_log = NULL;
+	cfg_log_cnt = 0;
+	cfg_log_alloc = 0;
+	cfg_log_size = 0;
+	cfg_log_base = cfg_generation;
 }
 
 /*
- * Like strncat, except:
- * - Do not use trailing null; track offset into buffer instead
- * - Skip set number of input bytes before writing into buffer
+ * Record an applied configuration change and advance the generation.
+ *
+ * buf should be the line as written to CFG_NAME.  Only the content up to and
+ * including the first newline is recorded.
  */
-void strcatoff(char *buf, const char *const str, size_t str_len, size_t *offset, size_t *wrote, size_t max)
+static void cfg_log_change(const char *const buf)
 {
-	if ((*offset) >= str_len) {
-		(*offset) -= str_len;
+	cfg_generation++;
+	snapshot_mark();
+
+	const char *newline = strchr(buf, '\n');
+	size_t line_len = newline != NULL ? (size_t)(newline - buf) + 1 : strlen(buf);
+
+	/*
+	 * Bound memory usage.  Tracking changes is an optimization for
+	 * consumers; they can always fall back to a full dump.
+	 */
+	if (cfg_log_size + line_len > (size_t)cfg_stat.st_size * 2 + CFG_LOG_SLACK) {
+		cfg_log_clear();
 		return;
 	}
 
-	size_t len = MIN(str_len - (*offset), max - (*wrote));
-	memcpy(buf + (*wrote), str + (*offset), len);
+	if (cfg_log_alloc < cfg_log_cnt + 1) {
+		size_t new_alloc = cfg_log_alloc == 0 ? 256 : cfg_log_alloc * 2;
+		struct cfg_change *new_log = realloc(cfg_log, new_alloc * sizeof(struct cfg_change));
+		if (new_log == NULL) {
+			cfg_log_clear();
+			return;
+		}
+		cfg_log = new_log;
+		cfg_log_alloc = new_alloc;
+	}
 
-	(*wrote) += len;
-	(*offset) = 0;
+	char *line = malloc(line_len + 1);
+	if (line == NULL) {
+		cfg_log_clear();
+		return;
+	}
+	memcpy(line, buf, line_len);
+	line[line_len] = '\0';
+
+	cfg_log[cfg_log_cnt].generation = cfg_generation;
+	cfg_log[cfg_log_cnt].line = line;
+	cfg_log[cfg_log_cnt].line_len = line_len;
+	cfg_log_cnt++;
+	cfg_log_size += line_len;
 }
 
 /*
@@ -1088,6 +2766,9 @@ static void cfg_clear(void)
  * writes if necessary.
  *
  * The filter value is only meaningful in the first submission for a path.
+ *
+ * Returns 1 if the configuration changed, 0 if the line was already present,
+ * and a negative errno on error.
  */
 static int cfg_add(const char *const buf)
 {
@@ -1253,12 +2934,13 @@ static int cfg_add(const char *const buf)
 	back->alias.name = stratum;
 	back->alias.name_len = stratum_len;
 	back->alias.root_fd = root_fd;
+	back->alias.health = NULL;
 	back->local = local;
 	cfg->back_cnt++;
 
 	cfg_stat.st_size += strlen(buf) - CMD_ADD_LEN - 1;
 
-	return 0;
+	return 1;
 
 free_and_abort_enomem:
 	if (lpath != NULL) {
@@ -1359,90 +3041,697 @@ static int cfg_rm(const char *const buf)
 		return -EINVAL;
 	}
 
-	/*
-	 * Check if root_fd is shared
-	 */
-	int root_fd_cnt = 0;
-	for (size_t i = 0; i < cfg_cnt; i++) {
-		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
-			if (cfgs[i].back[j].alias.root_fd == back->alias.root_fd) {
-				root_fd_cnt++;
+	/*
+	 * Check if root_fd is shared
+	 */
+	int root_fd_cnt = 0;
+	for (size_t i = 0; i < cfg_cnt; i++) {
+		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+			if (cfgs[i].back[j].alias.root_fd == back->alias.root_fd) {
+				root_fd_cnt++;
+			}
+		}
+	}
+
+	/*
+	 * Free
+	 */
+	free(back->alias.name);
+	free(back->lpath);
+	if (!back->local && root_fd_cnt == 1) {
+		close(back->alias.root_fd);
+	}
+
+	if (&cfg->back[cfg->back_cnt - 1] != back) {
+		*back = cfg->back[cfg->back_cnt - 1];
+	}
+	cfg->back_cnt--;
+	cfg_stat.st_size -= strlen(buf) - CMD_RM_LEN - 1;
+
+	if (cfg->back_cnt == 0) {
+		free(cfg->cpath);
+		free(cfg->back);
+		if (&cfgs[cfg_cnt - 1] != cfg) {
+			*cfg = cfgs[cfg_cnt - 1];
+		}
+		cfg_cnt--;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse and apply instruction to set how long to wait on strata when
+ * probing for backing files.  Expected format is either:
+ *
+ *     deadline [milliseconds]\n
+ *
+ * to set the default for all strata, or
+ *
+ *     deadline [stratum]:[milliseconds]\n
+ *
+ * to set it for a specific stratum.  Zero disables the deadline.
+ *
+ * Deadlines are reset to none by a clear.  They do not change which files
+ * are configured, and so are not reflected in CFG_NAME or the generation.
+ * The health query lists every stratum which may have its own deadline.
+ */
+static int cfg_deadline(const char *const buf)
+{
+	/*
+	 * Tokenize
+	 */
+	char buf_cmd[PIPE_BUF];
+	char space;
+	char buf_value[PIPE_BUF];
+	char newline;
+	if (sscanf(buf, "%s%c%s%c", buf_cmd, &space, buf_value, &newline) != 4) {
+		return -EINVAL;
+	}
+
+	/*
+	 * Sanity check
+	 */
+	if (strcmp(buf_cmd, CMD_DEADLINE) != 0 || space != ' ' || newline != '\n' || strchr(buf_value, '/') != NULL) {
+		return -EINVAL;
+	}
+
+	char *colon = strrchr(buf_value, ':');
+	char *ms_str = colon != NULL ? colon + 1 : buf_value;
+	char *end;
+	errno = 0;
+	long ms = strtol(ms_str, &end, 10);
+	if (errno != 0 || end == ms_str || *end != '\0' || ms < 0) {
+		return -EINVAL;
+	}
+
+	int rv = 0;
+	pthread_mutex_lock(&probe_lock);
+	if (colon == NULL) {
+		__atomic_store_n(&default_deadline_ms, ms, __ATOMIC_RELAXED);
+	} else {
+		struct health *h = health_get(buf_value, colon - buf_value);
+		if (h == NULL) {
+			rv = -ENOMEM;
+		} else {
+			__atomic_store_n(&h->deadline_ms, ms, __ATOMIC_RELAXED);
+		}
+	}
+	int set = default_deadline_ms > 0;
+	for (size_t i = 0; i < health_cnt && !set; i++) {
+		set = healths[i]->deadline_ms > 0;
+	}
+	__atomic_store_n(&deadlines_set, set, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&probe_lock);
+	return rv;
+}
+
+/*
+ * Reset all deadlines to none.
+ */
+static void cfg_deadline_clear(void)
+{
+	pthread_mutex_lock(&probe_lock);
+	__atomic_store_n(&deadlines_set, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&default_deadline_ms, 0, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < health_cnt; i++) {
+		__atomic_store_n(&healths[i]->deadline_ms, -1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&probe_lock);
+}
+
+/*
+ * (Re)load REGISTRY_PATH if it changed since it was last loaded.  On any
+ * error, the registry is emptied and set_local_stratum() falls back to xattrs.
+ *
+ * Returns 1 if the registry was reloaded and 0 if it was unchanged.
+ */
+static int registry_load(void)
+{
+	struct stat stbuf;
+	if (stat(REGISTRY_PATH, &stbuf) >= 0 && stbuf.st_dev == registry_stat.st_dev
+		&& stbuf.st_ino == registry_stat.st_ino
+		&& stbuf.st_mtim.tv_sec == registry_stat.st_mtim.tv_sec
+		&& stbuf.st_mtim.tv_nsec == registry_stat.st_mtim.tv_nsec) {
+		return 0;
+	}
+
+	struct registry_entry *new_registry = NULL;
+	size_t new_cnt = 0;
+	memset(&stbuf, 0, sizeof(stbuf));
+
+	FILE *fp = fopen(REGISTRY_PATH, "re");
+	if (fp == NULL) {
+		goto swap_registry;
+	}
+	if (fstat(fileno(fp), &stbuf) < 0 || stbuf.st_uid != 0 || (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		memset(&stbuf, 0, sizeof(stbuf));
+		goto close_fp;
+	}
+
+	char line[PATH_MAX];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char name[PATH_MAX];
+		int enabled;
+		unsigned long long dev;
+		unsigned long long ino;
+		if (sscanf(line, "stratum %s %d %llu %llu", name, &enabled, &dev, &ino) != 4) {
+			continue;
+		}
+		struct registry_entry *tmp = realloc(new_registry, (new_cnt + 1) * sizeof(struct registry_entry));
+		if (tmp == NULL) {
+			break;
+		}
+		new_registry = tmp;
+		if ((new_registry[new_cnt].name = strdup(name)) == NULL) {
+			break;
+		}
+		new_registry[new_cnt].dev = dev;
+		new_registry[new_cnt].ino = ino;
+		new_registry[new_cnt].enabled = enabled;
+		new_cnt++;
+	}
+close_fp:
+	fclose(fp);
+swap_registry:
+	pthread_rwlock_wrlock(&registry_lock);
+	struct registry_entry *old_registry = registry;
+	size_t old_cnt = registry_cnt;
+	registry = new_registry;
+	registry_cnt = new_cnt;
+	registry_stat = stbuf;
+	pthread_rwlock_unlock(&registry_lock);
+
+	for (size_t i = 0; i < old_cnt; i++) {
+		free(old_registry[i].name);
+	}
+	free(old_registry);
+	return 1;
+}
+
+/*
+ * Check whether the registry lists root_fd as the root of the enabled stratum
+ * called name.  Without a registry, there is nothing to check against.
+ */
+static int registry_has_root(const char *name, int root_fd)
+{
+	struct stat stbuf;
+	if (fstat(root_fd, &stbuf) < 0) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&registry_lock);
+	int rv = registry_cnt == 0;
+	for (size_t i = 0; i < registry_cnt && !rv; i++) {
+		rv = registry[i].enabled && registry[i].dev == stbuf.st_dev && registry[i].ino == stbuf.st_ino
+			&& strcmp(registry[i].name, name) == 0;
+	}
+	pthread_rwlock_unlock(&registry_lock);
+	return rv;
+}
+
+/*
+ * Consume len bytes from a snapshot being parsed.  Returns NULL if the
+ * snapshot is truncated.
+ */
+static inline const char *snapshot_take(const char **cur, const char *end, size_t len)
+{
+	if ((size_t)(end - *cur) < len) {
+		return NULL;
+	}
+	const char *rv = *cur;
+	*cur += len;
+	return rv;
+}
+
+#define SNAPSHOT_TAKE_INT(cur, end, var)                       \
+	do {                                                   \
+		const char *p_ = snapshot_take(cur, end, sizeof(var)); \
+		if (p_ == NULL) {                              \
+			goto invalid;                          \
+		}                                              \
+		memcpy(&(var), p_, sizeof(var));               \
+	} while (0)
+
+/*
+ * Load the configuration from the snapshot file, as written by
+ * snapshot_save().  Only called from main() before any requests are served,
+ * so no locking is needed.
+ *
+ * Strata which can no longer be opened, or which the registry does not list
+ * as enabled at the same root, are dropped along with any cfg left without
+ * backing.  On any other error the configuration is left empty, as though no
+ * snapshot existed.
+ */
+static int snapshot_load(void)
+{
+	int fd = openat(snapshot_dir_fd, snapshot_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0 || !S_ISREG(stbuf.st_mode) || stbuf.st_uid != 0
+		|| (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0
+		|| stbuf.st_size < SNAPSHOT_MAGIC_LEN + (off_t)sizeof(uint64_t) * 2) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	char *buf = malloc(stbuf.st_size);
+	if (buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	size_t len = 0;
+	while (len < (size_t)stbuf.st_size) {
+		ssize_t r = read(fd, buf + len, stbuf.st_size - len);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
+		len += r;
+	}
+	close(fd);
+
+	uint64_t checksum;
+	if (len < (size_t)stbuf.st_size) {
+		free(buf);
+		return -EIO;
+	}
+	len -= sizeof(checksum);
+	memcpy(&checksum, buf + len, sizeof(checksum));
+	if (checksum != hot_hash(14695981039346656037u, buf, len)
+		|| memcmp(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	const char *cur = buf + SNAPSHOT_MAGIC_LEN;
+	const char *end = buf + len;
+	struct stratum *strata = NULL;
+	uint32_t strata_cnt = 0;
+	uint8_t *strata_used = NULL;
+	uint64_t generation;
+	uint32_t new_cfg_cnt;
+
+	SNAPSHOT_TAKE_INT(&cur, end, generation);
+	SNAPSHOT_TAKE_INT(&cur, end, strata_cnt);
+	if (strata_cnt > UINT16_MAX) {
+		goto invalid;
+	}
+	strata = calloc(strata_cnt, sizeof(struct stratum));
+	strata_used = calloc(strata_cnt, sizeof(uint8_t));
+	if ((strata == NULL || strata_used == NULL) && strata_cnt > 0) {
+		free(strata);
+		strata = NULL;
+		goto invalid;
+	}
+	for (uint32_t i = 0; i < strata_cnt; i++) {
+		strata[i].root_fd = -1;
+	}
+
+	/*
+	 * Open each stratum's root directory once and share it among all of
+	 * its back_entry, as cfg_add() does.
+	 */
+	for (uint32_t i = 0; i < strata_cnt; i++) {
+		uint16_t name_len;
+		SNAPSHOT_TAKE_INT(&cur, end, name_len);
+		const char *name = snapshot_take(&cur, end, name_len);
+		if (name == NULL || name_len == 0 || memchr(name, '/', name_len) != NULL
+			|| memchr(name, '\0', name_len) != NULL) {
+			goto invalid;
+		}
+		if ((strata[i].name = malloc(name_len + 1)) == NULL) {
+			goto invalid;
+		}
+		memcpy(strata[i].name, name, name_len);
+		strata[i].name[name_len] = '\0';
+		strata[i].name_len = name_len;
+		if (pstrcmp(strata[i].name, name_len, LOCAL, LOCAL_LEN) != 0) {
+			strata[i].root_fd = fchroot_open(strata_root_fd, strata[i].name, O_DIRECTORY);
+		}
+		if (strata[i].root_fd >= 0 && !registry_has_root(strata[i].name, strata[i].root_fd)) {
+			close(strata[i].root_fd);
+			strata[i].root_fd = -1;
+		}
+	}
+
+	SNAPSHOT_TAKE_INT(&cur, end, new_cfg_cnt);
+	if (new_cfg_cnt > (size_t)(end - cur)) {
+		goto invalid;
+	}
+	if (new_cfg_cnt > 0 && (cfgs = calloc(new_cfg_cnt, sizeof(struct cfg_entry))) == NULL) {
+		goto invalid;
+	}
+	cfg_alloc = new_cfg_cnt;
+
+	for (uint32_t i = 0; i < new_cfg_cnt; i++) {
+		uint8_t filter;
+		uint16_t cpath_len;
+		uint32_t back_cnt;
+		SNAPSHOT_TAKE_INT(&cur, end, filter);
+		SNAPSHOT_TAKE_INT(&cur, end, cpath_len);
+		const char *cpath = snapshot_take(&cur, end, cpath_len);
+		SNAPSHOT_TAKE_INT(&cur, end, back_cnt);
+		if (filter >= ARRAY_LEN(filter_str) || cpath == NULL || cpath_len == 0 || cpath[0] != '/'
+			|| memchr(cpath, '\0', cpath_len) != NULL || back_cnt > (size_t)(end - cur)) {
+			goto invalid;
+		}
+
+		struct cfg_entry *cfg = &cfgs[cfg_cnt];
+		if ((cfg->cpath = malloc(cpath_len + 1)) == NULL) {
+			goto invalid;
+		}
+		memcpy(cfg->cpath, cpath, cpath_len);
+		cfg->cpath[cpath_len] = '\0';
+		cfg->cpath_len = cpath_len;
+		cfg->filter = filter;
+		cfg_cnt++;
+		if (back_cnt > 0 && (cfg->back = calloc(back_cnt, sizeof(struct back_entry))) == NULL) {
+			goto invalid;
+		}
+		cfg->back_alloc = back_cnt;
+
+		for (uint32_t j = 0; j < back_cnt; j++) {
+			uint16_t stratum;
+			uint16_t lpath_len;
+			SNAPSHOT_TAKE_INT(&cur, end, stratum);
+			SNAPSHOT_TAKE_INT(&cur, end, lpath_len);
+			const char *lpath = snapshot_take(&cur, end, lpath_len);
+			if (stratum >= strata_cnt || lpath == NULL || lpath_len == 0 || lpath[0] != '/'
+				|| memchr(lpath, '\0', lpath_len) != NULL) {
+				goto invalid;
+			}
+
+			int local = pstrcmp(strata[stratum].name, strata[stratum].name_len, LOCAL, LOCAL_LEN) == 0;
+			if (!local && strata[stratum].root_fd < 0) {
+				continue;
+			}
+
+			struct back_entry *back = &cfg->back[cfg->back_cnt];
+			if ((back->lpath = malloc(lpath_len + 1)) == NULL) {
+				goto invalid;
 			}
+			memcpy(back->lpath, lpath, lpath_len);
+			back->lpath[lpath_len] = '\0';
+			back->lpath_len = lpath_len;
+			if ((back->alias.name = strdup(strata[stratum].name)) == NULL) {
+				free(back->lpath);
+				goto invalid;
+			}
+			back->alias.name_len = strata[stratum].name_len;
+			back->alias.root_fd = strata[stratum].root_fd;
+			back->alias.health = NULL;
+			back->local = local;
+			cfg->back_cnt++;
+			strata_used[stratum] = 1;
+
+			cfg_stat.st_size += strlen(filter_str[filter]) + 1 + cpath_len + 1
+				+ back->alias.name_len + 1 + lpath_len + 1;
+		}
+
+		/*
+		 * Every backing stratum is gone.  Drop the cfg as cfg_rm()
+		 * would.
+		 */
+		if (cfg->back_cnt == 0) {
+			free(cfg->cpath);
+			free(cfg->back);
+			memset(cfg, 0, sizeof(*cfg));
+			cfg_cnt--;
 		}
 	}
+	if (cur != end) {
+		goto invalid;
+	}
 
 	/*
-	 * Free
+	 * If brl republished the registry while the snapshot was being
+	 * restored, the strata were checked against a stale copy.  Start
+	 * empty instead and let brl populate the configuration.
 	 */
-	free(back->alias.name);
-	free(back->lpath);
-	if (!back->local && root_fd_cnt == 1) {
-		close(back->alias.root_fd);
-	}
-
-	if (&cfg->back[cfg->back_cnt - 1] != back) {
-		*back = cfg->back[cfg->back_cnt - 1];
+	if (registry_load() != 0) {
+		goto invalid;
 	}
-	cfg->back_cnt--;
-	cfg_stat.st_size -= strlen(buf) - CMD_RM_LEN - 1;
 
-	if (cfg->back_cnt == 0) {
-		free(cfg->cpath);
-		free(cfg->back);
-		if (&cfgs[cfg_cnt - 1] != cfg) {
-			*cfg = cfgs[cfg_cnt - 1];
+	for (uint32_t i = 0; i < strata_cnt; i++) {
+		if (!strata_used[i] && strata[i].root_fd >= 0) {
+			close(strata[i].root_fd);
 		}
-		cfg_cnt--;
+		free(strata[i].name);
 	}
+	free(strata);
+	free(strata_used);
+	free(buf);
 
+	cfg_generation = generation;
+	cfg_log_clear();
 	return 0;
+
+invalid:
+	cfg_clear();
+	for (uint32_t i = 0; strata != NULL && i < strata_cnt; i++) {
+		if (!strata_used[i] && strata[i].root_fd >= 0) {
+			close(strata[i].root_fd);
+		}
+		free(strata[i].name);
+	}
+	free(strata);
+	free(strata_used);
+	free(buf);
+	return -EINVAL;
 }
 
+#undef SNAPSHOT_TAKE_INT
+
 static int cfg_read(char *buf, size_t size, off_t offset)
 {
-	if (cfg_cnt == 0) {
-		buf[0] = '\0';
-		return 0;
+	pthread_mutex_lock(&cfg_dump_lock);
+
+	int rv = 0;
+	if (cfg_dump == NULL || cfg_dump_generation != cfg_generation) {
+		cfg_dump_len = 0;
+		for (size_t i = 0; i < cfg_cnt; i++) {
+			for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+				rv |= buf_append_cfg_line(&cfg_dump, &cfg_dump_len, &cfg_dump_alloc, &cfgs[i],
+					&cfgs[i].back[j]);
+			}
+		}
+		if (rv < 0) {
+			free(cfg_dump);
+			cfg_dump = NULL;
+			cfg_dump_len = 0;
+			cfg_dump_alloc = 0;
+			pthread_mutex_unlock(&cfg_dump_lock);
+			return -ENOMEM;
+		}
+		cfg_dump_generation = cfg_generation;
 	}
 
-	char *str = malloc(cfg_stat.st_size + 1);
-	if (str == NULL) {
-		return -ENOMEM;
+	if (offset < 0) {
+		rv = -EINVAL;
+	} else if ((size_t)offset >= cfg_dump_len) {
+		rv = 0;
+	} else {
+		rv = MIN(cfg_dump_len - offset, size);
+		memcpy(buf, cfg_dump + offset, rv);
 	}
-	str[0] = '\0';
 
-	for (size_t i = 0; i < cfg_cnt; i++) {
-		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
-			strcat(str, filter_str[cfgs[i].filter]);
-			strcat(str, " ");
-			strcat(str, cfgs[i].cpath);
-			strcat(str, " ");
-			strcat(str, cfgs[i].back[j].alias.name);
-			strcat(str, ":");
-			strcat(str, cfgs[i].back[j].lpath);
-			strcat(str, "\n");
+	pthread_mutex_unlock(&cfg_dump_lock);
+	return rv;
+}
+
+/*
+ * Render the response to a configuration query into a malloc()'d buffer.
+ */
+static int cfg_query_render(enum query_class class, const char *arg, char **out, size_t *out_len)
+{
+	size_t alloc = 0;
+	*out = NULL;
+	*out_len = 0;
+
+	int rv = 0;
+	char tmp[64];
+	int s;
+	switch (class) {
+	case QUERY_CLASS_GENERATION:
+		s = snprintf(tmp, sizeof(tmp), "%llu\n", (unsigned long long)cfg_generation);
+		if (s < 0 || s >= (int)sizeof(tmp)) {
+			return -EINVAL;
+		}
+		rv = buf_append(out, out_len, &alloc, tmp, s);
+		break;
+
+	case QUERY_CLASS_HEALTH:
+		;
+		uint64_t now = now_ns();
+		pthread_mutex_lock(&probe_lock);
+		for (size_t i = 0; i < health_cnt; i++) {
+			struct health *h = healths[i];
+			const char *state = "ok";
+			if (__atomic_load_n(&h->stalled, __ATOMIC_RELAXED) > 0) {
+				state = "stalled";
+			} else if (__atomic_load_n(&h->open_until_ns, __ATOMIC_RELAXED) > now) {
+				state = "open";
+			}
+			char line[PATH_MAX];
+			s = snprintf(line, sizeof(line), "%s %s %ld %llu %llu %llu %llu %llu\n", h->name, state,
+				health_deadline(h),
+				(unsigned long long)__atomic_load_n(&h->avg_ns, __ATOMIC_RELAXED) / 1000,
+				(unsigned long long)__atomic_load_n(&h->max_ns, __ATOMIC_RELAXED) / 1000,
+				(unsigned long long)__atomic_load_n(&h->probes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&h->timeouts, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&h->skips, __ATOMIC_RELAXED));
+			if (s < 0 || s >= (int)sizeof(line)) {
+				continue;
+			}
+			rv |= buf_append(out, out_len, &alloc, line, s);
+		}
+		pthread_mutex_unlock(&probe_lock);
+		break;
+
+	case QUERY_CLASS_HOT:
+		;
+		struct hot_entry *entries = malloc(HOT_K * sizeof(struct hot_entry));
+		if (entries == NULL) {
+			return -ENOMEM;
+		}
+		size_t cnt = hot_snapshot(&hot_paths, entries);
+		for (size_t i = 0; i < cnt; i++) {
+			s = snprintf(tmp, sizeof(tmp), "path %lu %s ", (unsigned long)entries[i].count,
+				entries[i].op + strlen("m_"));
+			if (s < 0 || s >= (int)sizeof(tmp)) {
+				continue;
+			}
+			rv |= buf_append(out, out_len, &alloc, tmp, s);
+			rv |= buf_append(out, out_len, &alloc, entries[i].key, strlen(entries[i].key));
+			rv |= buf_append(out, out_len, &alloc, "\n", 1);
+		}
+		cnt = hot_snapshot(&hot_callers, entries);
+		for (size_t i = 0; i < cnt; i++) {
+			s = snprintf(tmp, sizeof(tmp), "caller %lu %d %s ", (unsigned long)entries[i].count,
+				(int)entries[i].pid, entries[i].comm);
+			if (s < 0 || s >= (int)sizeof(tmp)) {
+				continue;
+			}
+			rv |= buf_append(out, out_len, &alloc, tmp, s);
+			rv |= buf_append(out, out_len, &alloc, entries[i].key, strlen(entries[i].key));
+			rv |= buf_append(out, out_len, &alloc, "\n", 1);
+		}
+		free(entries);
+		break;
+
+	case QUERY_CLASS_STRATUM:
+		;
+		size_t arg_len = strlen(arg);
+		for (size_t i = 0; i < cfg_cnt; i++) {
+			for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+				if (pstrcmp(cfgs[i].back[j].alias.name, cfgs[i].back[j].alias.name_len, arg,
+						arg_len) == 0) {
+					rv |= buf_append_cfg_line(out, out_len, &alloc, &cfgs[i], &cfgs[i].back[j]);
+				}
+			}
+		}
+		break;
+
+	case QUERY_CLASS_SINCE:
+		;
+		char *end;
+		errno = 0;
+		unsigned long long since = strtoull(arg, &end, 10);
+		if (errno != 0 || *end != '\0' || arg[0] == '-') {
+			return -ENOENT;
+		}
+
+		if (since >= cfg_generation) {
+			/*
+			 * Already up to date.
+			 */
+		} else if (since >= cfg_log_base) {
+			/*
+			 * Binary search for the first change after since.
+			 */
+			size_t lo = 0;
+			size_t hi = cfg_log_cnt;
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				if (cfg_log[mid].generation <= since) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			for (size_t i = lo; i < cfg_log_cnt; i++) {
+				s = snprintf(tmp, sizeof(tmp), "%llu ", (unsigned long long)cfg_log[i].generation);
+				if (s < 0 || s >= (int)sizeof(tmp)) {
+					rv = -EINVAL;
+					break;
+				}
+				rv |= buf_append(out, out_len, &alloc, tmp, s);
+				rv |= buf_append(out, out_len, &alloc, cfg_log[i].line, cfg_log[i].line_len);
+			}
+		} else {
+			/*
+			 * Changes are no longer tracked that far back.  Describe
+			 * how to get from any state to the current one.
+			 */
+			s = snprintf(tmp, sizeof(tmp), "%llu ", (unsigned long long)cfg_generation);
+			if (s < 0 || s >= (int)sizeof(tmp)) {
+				return -EINVAL;
+			}
+			rv |= buf_append(out, out_len, &alloc, tmp, s);
+			rv |= buf_append(out, out_len, &alloc, CMD_CLEAR "\n", CMD_CLEAR_LEN + 1);
+			for (size_t i = 0; i < cfg_cnt; i++) {
+				for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+					rv |= buf_append(out, out_len, &alloc, tmp, s);
+					rv |= buf_append(out, out_len, &alloc, CMD_ADD " ", CMD_ADD_LEN + 1);
+					rv |= buf_append_cfg_line(out, out_len, &alloc, &cfgs[i], &cfgs[i].back[j]);
+				}
+			}
 		}
+		break;
+
+	case QUERY_CLASS_DIR:
+	case QUERY_CLASS_ENOENT:
+	default:
+		return -ENOENT;
 	}
 
-	int rv = MIN(strlen(str + offset), size);
-	memcpy(buf, str + offset, rv);
-	free(str);
-	return rv;
+	if (rv < 0) {
+		free(*out);
+		*out = NULL;
+		*out_len = 0;
+		return -ENOMEM;
+	}
+	return 0;
 }
 
-int vstrcmp(void *a, void *b)
+int vstrcmp(const void *a, const void *b)
 {
-	struct h_kv *kv1 = (struct h_kv *)a;
-	struct h_kv *kv2 = (struct h_kv *)b;
-	return strcmp(kv1->key, kv2->key);
+	const struct str_set_entry *kv1 = a;
+	const struct str_set_entry *kv2 = b;
+	return strcmp(kv1->str, kv2->str);
 }
 
 /*
- * Populate hash table with the contents of all backing fonts.dir or
- * fonts.alias file contents.
+ * Merge the contents of all backing fonts.dir or fonts.alias files.
+ *
+ * Populates kvs with an arena-allocated array of the merged key-value pairs,
+ * sorted by key.  Where multiple files provide the same key, the first one
+ * wins.
  */
-static inline int font_merge_kv(struct cfg_entry *cfg, const char *ipath, size_t ipath_len, struct h_kv **kvs)
+static inline int font_merge_kv(struct cfg_entry *cfg, const char *ipath,
+	size_t ipath_len, struct arena *arena, struct str_set_entry **kvs, size_t *kv_cnt)
 {
+	struct str_set set;
+	str_set_init(&set, arena);
+	*kvs = NULL;
+	*kv_cnt = 0;
+
 	int rv = -ENOENT;
 	for (size_t i = 0; i < cfg->back_cnt; i++) {
 		char tmp[PATH_MAX];
@@ -1452,8 +3741,13 @@ static inline int font_merge_kv(struct cfg_entry *cfg, const char *ipath, size_t
 			continue;
 		}
 
-		FILE *fp = fchroot_fopen_rdonly(deref(&cfg->back[i])->root_fd, bpath);
+		int fd = probe(deref(&cfg->back[i]), PROBE_OPEN, bpath, O_RDONLY, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		FILE *fp = fdopen(fd, "r");
 		if (fp == NULL) {
+			close(fd);
 			continue;
 		}
 		/*
@@ -1485,7 +3779,7 @@ static inline int font_merge_kv(struct cfg_entry *cfg, const char *ipath, size_t
 				*sep = '\0';
 				sep++;
 			} while (*sep == ' ' || *sep == '\t');
-			rv = insert_h_kv(kvs, line, key_len, sep);
+			rv = insert_kv(&set, line, key_len, sep);
 			if (rv < 0) {
 				break;
 			}
@@ -1493,13 +3787,31 @@ static inline int font_merge_kv(struct cfg_entry *cfg, const char *ipath, size_t
 		fclose(fp);
 
 	}
+	if (rv < 0 || set.cnt == 0) {
+		return rv;
+	}
+
+	/*
+	 * Compact the set's populated slots into a sorted array.
+	 */
+	*kvs = arena_alloc(arena, set.cnt * sizeof(struct str_set_entry));
+	if (*kvs == NULL) {
+		return -ENOMEM;
+	}
+	for (size_t i = 0; i < set.alloc; i++) {
+		if (set.slots[i].str != NULL) {
+			(*kvs)[(*kv_cnt)++] = set.slots[i];
+		}
+	}
+	qsort(*kvs, *kv_cnt, sizeof(struct str_set_entry), vstrcmp);
+
 	return rv;
 }
 
 /*
  * Populate contents of a virtual directory.
  */
-static inline int virt_filldir(const char *ipath, size_t ipath_len, struct h_str *files)
+static inline int virt_filldir(const char *ipath, size_t ipath_len, struct str_set *files)
 {
 	int rv = 0;
 	for (size_t i = 0; i < cfg_cnt; i++) {
@@ -1530,7 +3842,7 @@ static inline int virt_filldir(const char *ipath, size_t ipath_len, struct h_str
 			memcpy(tmp, cfgs[i].cpath + ipath_len + 1, slash - cfgs[i].cpath);
 			size_t len = slash - cfgs[i].cpath - ipath_len - 1;
 			tmp[len] = '\0';
-			rv |= insert_h_str(&files, tmp, len);
+			rv |= insert_str(files, tmp, len);
 			continue;
 		}
 
@@ -1540,9 +3852,9 @@ static inline int virt_filldir(const char *ipath, size_t ipath_len, struct h_str
 		 */
 		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
 			struct stat stbuf;
-			if (fchroot_stat(deref(&cfgs[i].back[j])->root_fd, cfgs[i].back[j].lpath, &stbuf) >= 0) {
+			if (probe(deref(&cfgs[i].back[j]), PROBE_STAT, cfgs[i].back[j].lpath, 0, &stbuf, NULL) >= 0) {
 				size_t len = strlen(cfgs[i].cpath + ipath_len + 1);
-				rv |= insert_h_str(&files, cfgs[i].cpath + ipath_len + 1, len);
+				rv |= insert_str(files, cfgs[i].cpath + ipath_len + 1, len);
 				break;
 			}
 		}
@@ -1551,6 +3863,32 @@ static inline int virt_filldir(const char *ipath, size_t ipath_len, struct h_str
 	return rv;
 }
 
+/*
+ * Look up the stratum whose root directory is described by stbuf, populating
+ * local_stratum's name on success.
+ */
+static inline int registry_lookup(const struct stat *stbuf)
+{
+	int rv = -ENOENT;
+	pthread_rwlock_rdlock(&registry_lock);
+	for (size_t i = 0; i < registry_cnt; i++) {
+		if (registry[i].dev != stbuf->st_dev || registry[i].ino != stbuf->st_ino) {
+			continue;
+		}
+		size_t len = strlen(registry[i].name);
+		if (len >= sizeof(local_stratum_name)) {
+			rv = -ENAMETOOLONG;
+			break;
+		}
+		memcpy(local_stratum_name, registry[i].name, len + 1);
+		local_stratum.name_len = len;
+		rv = 0;
+		break;
+	}
+	pthread_rwlock_unlock(&registry_lock);
+	return rv;
+}
+
 /*
  * Populate thread-local storage with information about calling process'
  * stratum.
@@ -1561,6 +3899,7 @@ static inline int set_local_stratum(void)
 	local_stratum.name[0] = '\0';
 	local_stratum.name_len = 0;
 	local_stratum.root_fd = 0;
+	local_stratum.health = NULL;
 
 	struct fuse_context *context = fuse_get_context();
 	if (context == NULL) {
@@ -1587,6 +3926,11 @@ static inline int set_local_stratum(void)
 		goto fallback_virtual;
 	}
 
+	struct stat stbuf;
+	if (fstat(local_stratum.root_fd, &stbuf) >= 0 && registry_lookup(&stbuf) >= 0) {
+		return 0;
+	}
+
 	ssize_t len = fgetxattr(local_stratum.root_fd, STRATUM_XATTR,
 		local_stratum_name, sizeof(local_stratum_name) - 1);
 	if (len < 0) {
@@ -1624,6 +3968,7 @@ static inline int getattr_back(struct cfg_entry *cfg, const char *ipath, size_t
 		return -errno;
 	}
 
+	TRACE(filter__size__start, ipath, cfg->filter);
 	switch (cfg->filter) {
 	case FILTER_BIN:
 	case FILTER_BIN_RESTRICT:
@@ -1708,36 +4053,25 @@ static inline int getattr_back(struct cfg_entry *cfg, const char *ipath, size_t
 		 * Need to get lines from every instance of file and merge
 		 * them.
 		 */
-		struct h_kv *kvs = NULL;
-		rv = font_merge_kv(cfg, ipath, ipath_len, &kvs);
+		struct arena arena = { NULL };
+		struct str_set_entry *kvs;
+		size_t kv_cnt;
+		rv = font_merge_kv(cfg, ipath, ipath_len, &arena, &kvs, &kv_cnt);
 		if (rv < 0) {
+			arena_free(&arena);
 			break;
 		}
 
 		stbuf->st_size = 0;
-		size_t count = 0;
-		struct h_kv *kv;
-		struct h_kv *tmp;
-		HASH_ITER(hh, kvs, kv, tmp) {
-			if (rv == 0) {
-				stbuf->st_size += strlen(kv->key);
-				stbuf->st_size += strlen("\t");
-				stbuf->st_size += strlen(kv->value);
-			}
-#ifndef __clang_analyzer__
-			/*
-			 * clang-analyzer gets confused by uthash:
-			 * https://groups.google.com/forum/#!topic/uthash/l6vflep00p0
-			 */
-			HASH_DEL(kvs, kv);
-#endif
-			free(kv->value);
-			free(kv);
+		for (size_t i = 0; i < kv_cnt; i++) {
+			stbuf->st_size += kvs[i].len;
+			stbuf->st_size += strlen("\t");
+			stbuf->st_size += strlen(kvs[i].value);
 		}
+		arena_free(&arena);
 		if (pstrcmp(slash + 1, len, FONTS_DIR, FONTS_DIR_LEN) == 0) {
-			/* TODO: populate count line */
 			char buf[PATH_MAX];
-			int wrote = snprintf(buf, sizeof(buf), "%lu\n", count);
+			int wrote = snprintf(buf, sizeof(buf), "%zu\n", kv_cnt);
 			if (wrote < 0 || wrote >= (int)sizeof(buf)) {
 				rv = -EINVAL;
 			} else {
@@ -1750,6 +4084,7 @@ static inline int getattr_back(struct cfg_entry *cfg, const char *ipath, size_t
 	default:
 		break;
 	}
+	TRACE(filter__size__done, ipath, cfg->filter, rv);
 
 	/*
 	 * Remove setuid/setgid properties and write properties.
@@ -1765,6 +4100,92 @@ static inline int getattr_back(struct cfg_entry *cfg, const char *ipath, size_t
 	return rv;
 }
 
+static inline int getattr_query(const char *ipath, size_t ipath_len, struct stat *stbuf)
+{
+	const char *arg = NULL;
+	enum query_class class = classify_query(ipath, ipath_len, &arg);
+	if (class == QUERY_CLASS_DIR) {
+		*stbuf = vdir_stat;
+		stbuf->st_mode = S_IFDIR | 0500;
+		return 0;
+	}
+
+	char *out;
+	size_t out_len;
+	int rv = cfg_query_render(class, arg, &out, &out_len);
+	if (rv < 0) {
+		return rv;
+	}
+	free(out);
+
+	*stbuf = cfg_stat;
+	stbuf->st_mode = S_IFREG | 0400;
+	stbuf->st_size = out_len;
+	return 0;
+}
+
+static inline int read_query(const char *ipath, size_t ipath_len, char *buf, size_t size, off_t offset)
+{
+	const char *arg = NULL;
+	enum query_class class = classify_query(ipath, ipath_len, &arg);
+	if (class == QUERY_CLASS_DIR) {
+		return -EISDIR;
+	}
+	if (offset < 0) {
+		return -EINVAL;
+	}
+
+	char *out;
+	size_t out_len;
+	int rv = cfg_query_render(class, arg, &out, &out_len);
+	if (rv < 0) {
+		return rv;
+	}
+
+	if ((size_t)offset >= out_len) {
+		rv = 0;
+	} else {
+		rv = MIN(out_len - offset, size);
+		memcpy(buf, out + offset, rv);
+	}
+	free(out);
+	return rv;
+}
+
+static inline int readdir_query(const char *ipath, size_t ipath_len, struct str_set *files)
+{
+	if (ipath_len == CFG_QUERY_PATH_LEN) {
+		int rv = 0;
+		rv |= insert_str(files, QUERY_GENERATION, QUERY_GENERATION_LEN);
+		rv |= insert_str(files, QUERY_STRATUM, QUERY_STRATUM_LEN);
+		rv |= insert_str(files, QUERY_SINCE, QUERY_SINCE_LEN);
+		rv |= insert_str(files, QUERY_HEALTH, QUERY_HEALTH_LEN);
+		rv |= insert_str(files, QUERY_HOT, QUERY_HOT_LEN);
+		return rv;
+	}
+
+	const char *arg = NULL;
+	if (classify_query(ipath, ipath_len, &arg) != QUERY_CLASS_DIR) {
+		return -ENOTDIR;
+	}
+
+	/*
+	 * List configured strata.  since/ has no meaningful listing.
+	 */
+	const char *name = ipath + CFG_QUERY_PATH_LEN + 1;
+	size_t name_len = ipath_len - CFG_QUERY_PATH_LEN - 1;
+	if (pstrcmp(name, name_len, QUERY_STRATUM, QUERY_STRATUM_LEN) != 0) {
+		return 0;
+	}
+	int rv = 0;
+	for (size_t i = 0; i < cfg_cnt; i++) {
+		for (size_t j = 0; j < cfgs[i].back_cnt; j++) {
+			rv |= insert_str(files, cfgs[i].back[j].alias.name, cfgs[i].back[j].alias.name_len);
+		}
+	}
+	return rv;
+}
+
 static int m_getattr(const char *ipath, struct stat *stbuf, struct fuse_file_info *fi)
 {
 	(void)fi;
@@ -1789,6 +4210,10 @@ static int m_getattr(const char *ipath, struct stat *stbuf, struct fuse_file_inf
 		rv = 0;
 		break;
 
+	case CLASS_QUERY:
+		rv = getattr_query(ipath, ipath_len, stbuf);
+		break;
+
 	case CLASS_LOCAL:
 		*stbuf = local_stat;
 		stbuf->st_size = local_stratum.name_len;
@@ -1814,6 +4239,7 @@ static int m_readlink(const char *ipath, char *buf, size_t size)
 	case CLASS_VDIR:
 	case CLASS_ROOT:
 	case CLASS_CFG:
+	case CLASS_QUERY:
 		rv = -EINVAL;
 		break;
 
@@ -1844,25 +4270,32 @@ static int m_readdir(const char *ipath, void *buf, fuse_fill_dir_t filler,
 
 	FS_IMP_SETUP(CFG_RDLOCK);
 
-	struct h_str *files = NULL;
-	rv |= insert_h_str(&files, ".", 1);
-	rv |= insert_h_str(&files, "..", 2);
+	struct arena arena = { NULL };
+	struct str_set files;
+	str_set_init(&files, &arena);
+	rv |= insert_str(&files, ".", 1);
+	rv |= insert_str(&files, "..", 2);
 
 	size_t ipath_len = strlen(ipath);
 	struct cfg_entry *cfg;
 	switch (classify_ipath(ipath, ipath_len, &cfg)) {
 	case CLASS_BACK:
-		rv |= filldir_all_bpath(cfg, ipath, ipath_len, files);
+		rv |= filldir_all_bpath(cfg, ipath, ipath_len, &files);
 
 		break;
 
 	case CLASS_ROOT:
-		rv |= insert_h_str(&files, CFG_NAME, CFG_NAME_LEN);
-		rv |= insert_h_str(&files, LOCAL_ALIAS_NAME, LOCAL_ALIAS_NAME_LEN);
+		rv |= insert_str(&files, CFG_NAME, CFG_NAME_LEN);
+		rv |= insert_str(&files, LOCAL_ALIAS_NAME, LOCAL_ALIAS_NAME_LEN);
+		rv |= insert_str(&files, CFG_QUERY_NAME, CFG_QUERY_NAME_LEN);
 		ipath_len = 0;
 		/* fallthrough */
 	case CLASS_VDIR:
-		rv |= virt_filldir(ipath, ipath_len, files);
+		rv |= virt_filldir(ipath, ipath_len, &files);
+		break;
+
+	case CLASS_QUERY:
+		rv |= readdir_query(ipath, ipath_len, &files);
 		break;
 
 	case CLASS_CFG:
@@ -1873,21 +4306,12 @@ static int m_readdir(const char *ipath, void *buf, fuse_fill_dir_t filler,
 		break;
 	}
 
-	struct h_str *file = NULL;
-	struct h_str *tmp = NULL;
-	HASH_ITER(hh, files, file, tmp) {
-		if (rv == 0) {
-			filler(buf, file->str, NULL, 0, 0);
+	for (size_t i = 0; rv == 0 && i < files.alloc; i++) {
+		if (files.slots[i].str != NULL) {
+			filler(buf, files.slots[i].str, NULL, 0, 0);
 		}
-#ifndef __clang_analyzer__
-		/*
-		 * clang-analyzer gets confused by uthash:
-		 * https://groups.google.com/forum/#!topic/uthash/l6vflep00p0
-		 */
-		HASH_DEL(files, file);
-#endif
-		free(file);
 	}
+	arena_free(&arena);
 
 	FS_IMP_RETURN(rv);
 }
@@ -1942,6 +4366,22 @@ static int m_open(const char *ipath, struct fuse_file_info *fi)
 		}
 		break;
 
+	case CLASS_QUERY:
+		if (fuse_get_context()->uid != 0) {
+			rv = -EACCES;
+		} else if ((fi->flags & 3) != O_RDONLY) {
+			rv = -EROFS;
+		} else {
+			/*
+			 * Query content may change between getattr() and
+			 * read().  Do not let the kernel truncate reads to a
+			 * stale size.
+			 */
+			fi->direct_io = 1;
+			rv = 0;
+		}
+		break;
+
 	case CLASS_LOCAL:
 		rv = -ELOOP;
 		break;
@@ -1974,6 +4414,7 @@ static inline int read_back(struct cfg_entry *cfg, const char *ipath, size_t
 {
 	int rv;
 
+	TRACE(filter__start, ipath, cfg->filter);
 	switch (cfg->filter) {
 	case FILTER_BIN:
 	case FILTER_BIN_RESTRICT:
@@ -2063,9 +4504,12 @@ static inline int read_back(struct cfg_entry *cfg, const char *ipath, size_t
 		 * Need to get lines from every instance of file and merge
 		 * them.
 		 */
-		struct h_kv *kvs = NULL;
-		rv = font_merge_kv(cfg, ipath, ipath_len, &kvs);
+		struct arena arena = { NULL };
+		struct str_set_entry *kvs;
+		size_t kv_cnt;
+		rv = font_merge_kv(cfg, ipath, ipath_len, &arena, &kvs, &kv_cnt);
 		if (rv < 0) {
+			arena_free(&arena);
 			break;
 		}
 
@@ -2077,9 +4521,9 @@ static inline int read_back(struct cfg_entry *cfg, const char *ipath, size_t
 		 */
 		if (pstrcmp(slash + 1, len, FONTS_DIR, FONTS_DIR_LEN) == 0) {
 			char count[PATH_MAX];
-			int s = snprintf(count, sizeof(count), "%u\n",
-				HASH_COUNT(kvs));
-			if (s < 0 || s >= (int)sizeof(buf)) {
+			int s = snprintf(count, sizeof(count), "%zu\n", kv_cnt);
+			if (s < 0 || s >= (int)sizeof(count)) {
+				arena_free(&arena);
 				rv = -EINVAL;
 				break;
 			}
@@ -2087,27 +4531,14 @@ static inline int read_back(struct cfg_entry *cfg, const char *ipath, size_t
 		}
 
 		/*
-		 * return key-value pairs, sorted
+		 * return key-value pairs, already sorted by font_merge_kv()
 		 */
-		HASH_SORT(kvs, vstrcmp);
-		struct h_kv *kv;
-		struct h_kv *tmp;
-		HASH_ITER(hh, kvs, kv, tmp) {
-			if (rv >= 0) {
-				strcatoff(buf, kv->key, strlen(kv->key), &off, &wrote, size);
-				strcatoff(buf, "\t", 1, &off, &wrote, size);
-				strcatoff(buf, kv->value, strlen(kv->value), &off, &wrote, size);
-			}
-#ifndef __clang_analyzer__
-			/*
-			 * clang-analyzer gets confused by uthash:
-			 * https://groups.google.com/forum/#!topic/uthash/l6vflep00p0
-			 */
-			HASH_DEL(kvs, kv);
-#endif
-			free(kv->value);
-			free(kv);
+		for (size_t i = 0; i < kv_cnt && wrote < size; i++) {
+			strcatoff(buf, kvs[i].str, kvs[i].len, &off, &wrote, size);
+			strcatoff(buf, "\t", 1, &off, &wrote, size);
+			strcatoff(buf, kvs[i].value, strlen(kvs[i].value), &off, &wrote, size);
 		}
+		arena_free(&arena);
 		rv = wrote;
 		break;
 
@@ -2116,6 +4547,7 @@ static inline int read_back(struct cfg_entry *cfg, const char *ipath, size_t
 		rv = read_pass(cfg, ipath, ipath_len, buf, size, offset);
 		break;
 	}
+	TRACE(filter__done, ipath, cfg->filter, rv);
 
 	return rv;
 }
@@ -2143,6 +4575,14 @@ static int m_read(const char *ipath, char *buf, size_t size, off_t offset, struc
 		}
 		break;
 
+	case CLASS_QUERY:
+		if (fuse_get_context()->uid == 0) {
+			rv = read_query(ipath, ipath_len, buf, size, offset);
+		} else {
+			rv = -EACCES;
+		}
+		break;
+
 	case CLASS_VDIR:
 	case CLASS_ROOT:
 		rv = -EISDIR;
@@ -2204,13 +4644,32 @@ static int m_write(const char *ipath, const char *buf, size_t size, off_t offset
 			rv = size;
 		} else if (size >= CMD_CLEAR_LEN && memcmp(nbuf, CMD_CLEAR, CMD_CLEAR_LEN) == 0) {
 			cfg_clear();
+			cfg_deadline_clear();
+			/*
+			 * Nothing before a clear is needed to describe later
+			 * states.
+			 */
+			cfg_log_clear();
+			cfg_log_change(nbuf);
+			registry_load();
+			rv = size;
+		} else if (size >= CMD_RELOAD_LEN && memcmp(nbuf, CMD_RELOAD, CMD_RELOAD_LEN) == 0) {
+			registry_load();
 			rv = size;
 		} else if (size >= CMD_ADD_LEN && memcmp(nbuf, CMD_ADD, CMD_ADD_LEN) == 0) {
-			if ((rv = cfg_add(nbuf)) >= 0) {
+			if ((rv = cfg_add(nbuf)) > 0) {
+				cfg_log_change(nbuf);
+			}
+			if (rv >= 0) {
 				rv = size;
 			}
 		} else if (size >= CMD_RM_LEN && memcmp(nbuf, CMD_RM, CMD_RM_LEN) == 0) {
 			if ((rv = cfg_rm(nbuf)) >= 0) {
+				cfg_log_change(nbuf);
+				rv = size;
+			}
+		} else if (size >= CMD_DEADLINE_LEN && memcmp(nbuf, CMD_DEADLINE, CMD_DEADLINE_LEN) == 0) {
+			if ((rv = cfg_deadline(nbuf)) >= 0) {
 				rv = size;
 			}
 		} else {
@@ -2261,6 +4720,7 @@ static int m_getxattr(const char *ipath, const char *name, char *value, size_t s
 	case CLASS_VDIR:
 	case CLASS_ROOT:
 	case CLASS_CFG:
+	case CLASS_QUERY:
 	case CLASS_LOCAL:
 		if (pstrcmp(name, name_len, STRATUM_XATTR, STRATUM_XATTR_LEN) == 0) {
 			rv = 0;
@@ -2329,6 +4789,19 @@ static struct fuse_operations m_oper = {
 	.destroy = m_destroy,
 };
 
+/*
+ * crossfs-specific mount options.  Everything else is passed through to
+ * libfuse.
+ */
+struct options {
+	char *snapshot;
+};
+
+static const struct fuse_opt option_spec[] = {
+	{ "snapshot=%s", offsetof(struct options, snapshot), 0 },
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
 	/*
@@ -2371,7 +4844,14 @@ int main(int argc, char *argv[])
 	/*
 	 * Initialize mutexes
 	 */
-	if (pthread_rwlock_init(&cfg_lock, NULL) < 0 || pthread_mutex_init(&root_lock, NULL) < 0) {
+	if (pthread_rwlock_init(&cfg_lock, NULL) < 0 || pthread_mutex_init(&cfg_dump_lock, NULL) < 0
+		|| pthread_mutex_init(&root_lock, NULL) < 0 || pthread_rwlock_init(&registry_lock, NULL) < 0
+		|| pthread_mutex_init(&probe_lock, NULL) < 0 || pthread_cond_init(&probe_queue_cond, NULL) < 0
+		|| pthread_mutex_init(&hot_lock, NULL) < 0
+		|| pthread_condattr_init(&monotonic_condattr) < 0
+		|| pthread_condattr_setclock(&monotonic_condattr, CLOCK_MONOTONIC) < 0
+		|| pthread_mutex_init(&snapshot_lock, NULL) < 0
+		|| pthread_cond_init(&snapshot_cond, &monotonic_condattr) < 0) {
 		fprintf(stderr, "crossfs: error initializing mutexes\n");
 		return 1;
 	}
@@ -2400,11 +4880,46 @@ int main(int argc, char *argv[])
 	}
 	bouncer_size = bouncer_stat.st_size;
 
+	registry_load();
+
+	/*
+	 * Parse crossfs-specific options.
+	 */
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct options options = { 0 };
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) < 0) {
+		fprintf(stderr, "crossfs: unable to parse options\n");
+		return 1;
+	}
+
+	/*
+	 * Restore the configuration from the previous instance, if any.  A
+	 * missing or invalid snapshot is not an error; brl will populate the
+	 * configuration as usual.
+	 */
+	if (options.snapshot != NULL) {
+		char *slash = strrchr(options.snapshot, '/');
+		if (slash == NULL || slash[1] == '\0') {
+			fprintf(stderr, "crossfs: snapshot must be an absolute file path\n");
+			return 1;
+		}
+		*slash = '\0';
+		const char *dir = slash == options.snapshot ? "/" : options.snapshot;
+		if ((snapshot_dir_fd = open(dir, O_DIRECTORY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "crossfs: unable to open \"%s\"\n", dir);
+			return 1;
+		}
+		snapshot_name = slash + 1;
+		snapshot_load();
+	}
+
 	/*
 	 * Mount filesystem.
 	 *
 	 * Incoming filesystem calls will be fulfilled by the functions listed
 	 * in m_oper above.
 	 */
-	return fuse_main(argc, argv, &m_oper, NULL);
+	int rv = fuse_main(args.argc, args.argv, &m_oper, NULL);
+	fuse_opt_free_args(&args);
+	return rv;
 }
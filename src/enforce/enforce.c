@@ -0,0 +1,834 @@
+/*
+ * enforce.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program reconciles strata with bedrock.conf expectations which are
+ * cheap to check but were expensive to check from shell:
+ *
+ * - Every [symlinks] entry exists in each given stratum and points where
+ *   bedrock.conf indicates.  Where a file is in the way it is moved to the
+ *   symlink's target, mirroring what package managers expect.
+ * - Every given stratum's /etc/shells lists every other stratum's shells via
+ *   /bedrock/cross/bin.
+ *
+ * bedrock.conf is parsed once, then all strata are processed in parallel.
+ * Every stratum is accessed through a directory file descriptor for its root
+ * as seen by init.  Paths within a stratum are resolved with openat2()'s
+ * RESOLVE_IN_ROOT where available, such that absolute symlinks within the
+ * stratum, such as /var/run -> /run, are resolved against the stratum rather
+ * than the calling process' root.  Files are only ever replaced with
+ * renameat(), such that there is never a moment where an expected symlink is
+ * missing.  Files moved out of the way of a symlink are renamed where
+ * possible and otherwise copied and removed, as mv would.
+ *
+ * Warnings which require user attention are printed to stdout, one per line,
+ * for the caller to present.  Errors are printed to stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define CROSS_BIN "/bedrock/cross/bin/"
+#define DBUS_MACHINE_ID "/var/lib/dbus/machine-id"
+
+struct symlink_cfg {
+	char *link;
+	char *tgt;
+};
+
+struct lines {
+	char **v;
+	size_t cnt;
+	size_t alloc;
+};
+
+struct stratum {
+	char *name;
+	/*
+	 * Root from init's point of view: empty for the init-providing
+	 * stratum, otherwise /bedrock/strata/<name>.
+	 */
+	char *root;
+	int root_fd;
+	/*
+	 * Warnings to print once all strata are processed, such that output
+	 * is in the order strata were given rather than completion order.
+	 */
+	struct lines warnings;
+	/*
+	 * /etc/shells content, if readable.
+	 */
+	int shells_readable;
+	struct lines shells;
+};
+
+static struct symlink_cfg *symlinks = NULL;
+static size_t symlink_cnt = 0;
+
+static struct stratum *strata = NULL;
+static size_t stratum_cnt = 0;
+static void (*stratum_fn)(struct stratum *) = NULL;
+
+static int force = 0;
+static int error_cnt = 0;
+
+/*
+ * The union of all strata's shells as /bedrock/cross/bin paths, sorted and
+ * deduplicated.
+ */
+static struct lines cross_shells;
+
+/*
+ * Should a user configure /etc/shells as global, multiple strata may share
+ * the same underlying file.  Serialize updates such that they do not race.
+ */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lines_add(struct lines *l, char *s)
+{
+	if (l->cnt >= l->alloc) {
+		l->alloc = l->alloc ? l->alloc * 2 : 16;
+		l->v = xrealloc(l->v, l->alloc * sizeof(l->v[0]));
+	}
+	l->v[l->cnt++] = s;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Sort and remove duplicates, as `sort | uniq` would.
+ */
+static void lines_sort_uniq(struct lines *l)
+{
+	if (l->cnt == 0) {
+		return;
+	}
+	qsort(l->v, l->cnt, sizeof(l->v[0]), cmp_str);
+	size_t j = 1;
+	for (size_t i = 1; i < l->cnt; i++) {
+		if (strcmp(l->v[i], l->v[j - 1]) != 0) {
+			l->v[j++] = l->v[i];
+		}
+	}
+	l->cnt = j;
+}
+
+static void error(struct stratum *s, const char *path, const char *msg, int err)
+{
+	__atomic_add_fetch(&error_cnt, 1, __ATOMIC_RELAXED);
+	fprintf(stderr, "enforce: %s: %s \"%s%s\": %s\n", s->name, msg, INIT_ROOT, path, strerror(err));
+}
+
+static void warn(struct stratum *s, const char *fmt, const char *a, const char *b)
+{
+	int len = snprintf(NULL, 0, fmt, a, b, s->name);
+	char *msg = xmalloc(len + 1);
+	snprintf(msg, len + 1, fmt, a, b, s->name);
+	lines_add(&s->warnings, msg);
+}
+
+/*
+ * Load the [symlinks] section.
+ */
+static void load_symlink(const char *section, const char *key, char *value)
+{
+	static size_t alloc = 0;
+
+	if (strcmp(section, "symlinks") != 0) {
+		return;
+	}
+	value[strcspn(value, ",")] = '\0';
+
+	if (symlink_cnt >= alloc) {
+		alloc = alloc ? alloc * 2 : 32;
+		symlinks = xrealloc(symlinks, alloc * sizeof(symlinks[0]));
+	}
+	symlinks[symlink_cnt].link = xstrdup(key);
+	symlinks[symlink_cnt].tgt = xstrdup(trim(value));
+	symlink_cnt++;
+}
+
+/*
+ * Resolve a stratum name, which may be an alias, to its root from init's
+ * point of view.  This mirrors common-code's stratum_root --empty.
+ */
+static char *stratum_root(const char *name)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	char init_real[PATH_MAX];
+
+	snprintf(path, sizeof(path), STRATA_PATH "%s", name);
+	if (realpath(path, real) == NULL) {
+		return NULL;
+	}
+	if (realpath(STRATA_PATH "init", init_real) != NULL && strcmp(real, init_real) == 0) {
+		return xstrdup("");
+	}
+
+	const char *base = strrchr(real, '/');
+	base = base ? base + 1 : real;
+	if (snprintf(path, sizeof(path), STRATA_PATH "%s", base) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return xstrdup(path);
+}
+
+/*
+ * Split a path into its parent directory and final component.  Returns the
+ * final component, which points into dir.
+ */
+static const char *split_path(const char *path, char *dir, size_t dir_size)
+{
+	snprintf(dir, dir_size, "%s", path);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		dir[0] = '\0';
+		return path;
+	}
+	*slash = '\0';
+	return slash + 1;
+}
+
+/*
+ * Equivalent to `mkdir -p` within a stratum.
+ */
+static int mkdir_in_root(int root_fd, const char *path)
+{
+	int fd = open_in_root(root_fd, path, O_PATH | O_DIRECTORY);
+	if (fd >= 0) {
+		close(fd);
+		return 0;
+	} else if (errno != ENOENT) {
+		return -1;
+	}
+
+	char dir[PATH_MAX];
+	const char *base = split_path(path, dir, sizeof(dir));
+	if (mkdir_in_root(root_fd, dir) < 0) {
+		return -1;
+	}
+	int dir_fd = open_in_root(root_fd, dir, O_PATH | O_DIRECTORY);
+	if (dir_fd < 0) {
+		return -1;
+	}
+	int ret = mkdirat(dir_fd, base, 0755);
+	int err = errno;
+	close(dir_fd);
+	if (ret < 0 && err != EEXIST) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open the directory containing path within a stratum, optionally creating
+ * it.  Returns -1 with errno ENOENT if it does not exist and create is unset.
+ */
+static int open_parent(int root_fd, const char *path, int create, const char **base)
+{
+	char dir[PATH_MAX];
+	*base = strrchr(path, '/');
+	*base = *base ? *base + 1 : path;
+	split_path(path, dir, sizeof(dir));
+
+	if (create && mkdir_in_root(root_fd, dir) < 0) {
+		return -1;
+	}
+	return open_in_root(root_fd, dir, O_PATH | O_DIRECTORY);
+}
+
+/*
+ * Equivalent to `rm -rf`.  Does not check for mount points; callers ensure
+ * there are none.
+ */
+static int remove_tree(int dir_fd, const char *name)
+{
+	struct stat stbuf;
+	if (fstatat(dir_fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (!S_ISDIR(stbuf.st_mode)) {
+		return unlinkat(dir_fd, name, 0);
+	}
+
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return -1;
+	}
+	int ret = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		if (remove_tree(fd, ent->d_name) < 0) {
+			ret = -1;
+		}
+	}
+	closedir(d);
+	if (ret < 0) {
+		return -1;
+	}
+	return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+/*
+ * Equivalent to `cp -a` without extended attributes or hard links, as mv
+ * does when moving across filesystems.  Fails with EBUSY rather than copy a
+ * mount point's contents.
+ */
+static int copy_tree(int src_dir_fd, const char *src_name, int dst_dir_fd, const char *dst_name, dev_t dev)
+{
+	struct stat stbuf;
+	if (fstatat(src_dir_fd, src_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -1;
+	}
+	if (stbuf.st_dev != dev) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	int ret = 0;
+	if (S_ISDIR(stbuf.st_mode)) {
+		if (mkdirat(dst_dir_fd, dst_name, 0700) < 0) {
+			return -1;
+		}
+		int src_fd = openat(src_dir_fd, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (src_fd < 0) {
+			return -1;
+		}
+		DIR *d = fdopendir(src_fd);
+		if (d == NULL) {
+			close(src_fd);
+			return -1;
+		}
+		int dst_fd = openat(dst_dir_fd, dst_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dst_fd < 0) {
+			closedir(d);
+			return -1;
+		}
+		struct dirent *ent;
+		while (ret == 0 && (ent = readdir(d)) != NULL) {
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+				continue;
+			}
+			ret = copy_tree(src_fd, ent->d_name, dst_fd, ent->d_name, dev);
+		}
+		closedir(d);
+		close(dst_fd);
+	} else if (S_ISREG(stbuf.st_mode)) {
+		int in = openat(src_dir_fd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (in < 0) {
+			return -1;
+		}
+		int out = openat(dst_dir_fd, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (out < 0) {
+			close(in);
+			return -1;
+		}
+		char buf[65536];
+		ssize_t len;
+		while ((len = read(in, buf, sizeof(buf))) != 0) {
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			if (len < 0) {
+				ret = -1;
+				break;
+			}
+			for (ssize_t off = 0; off < len;) {
+				ssize_t n = write(out, buf + off, len - off);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0) {
+					ret = -1;
+					break;
+				}
+				off += n;
+			}
+			if (ret < 0) {
+				break;
+			}
+		}
+		int err = errno;
+		close(in);
+		if (close(out) < 0 && ret == 0) {
+			err = errno;
+			ret = -1;
+		}
+		errno = err;
+	} else if (S_ISLNK(stbuf.st_mode)) {
+		char tgt[PATH_MAX];
+		ssize_t len = readlinkat(src_dir_fd, src_name, tgt, sizeof(tgt) - 1);
+		if (len < 0) {
+			return -1;
+		}
+		tgt[len] = '\0';
+		if (symlinkat(tgt, dst_dir_fd, dst_name) < 0) {
+			return -1;
+		}
+	} else if (mknodat(dst_dir_fd, dst_name, stbuf.st_mode, stbuf.st_rdev) < 0) {
+		return -1;
+	}
+	if (ret < 0) {
+		return -1;
+	}
+
+	/*
+	 * Ownership first, as changing it clears setuid and setgid bits.
+	 * Times last, as populating a directory changes them.
+	 */
+	struct timespec times[2] = { stbuf.st_atim, stbuf.st_mtim };
+	if (fchownat(dst_dir_fd, dst_name, stbuf.st_uid, stbuf.st_gid, AT_SYMLINK_NOFOLLOW) < 0
+		|| (!S_ISLNK(stbuf.st_mode) && fchmodat(dst_dir_fd, dst_name, stbuf.st_mode & 07777, 0) < 0)
+		|| utimensat(dst_dir_fd, dst_name, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Equivalent to `mv`.  Where the two are on different filesystems, copy then
+ * remove the original.  Should the copy fail, it is removed and the original
+ * is left in place.
+ */
+static int move_tree(int src_dir_fd, const char *src_name, int dst_dir_fd, const char *dst_name)
+{
+	if (renameat(src_dir_fd, src_name, dst_dir_fd, dst_name) == 0) {
+		return 0;
+	} else if (errno != EXDEV) {
+		return -1;
+	}
+
+	struct stat stbuf;
+	if (fstatat(src_dir_fd, src_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+		return -1;
+	}
+	if (copy_tree(src_dir_fd, src_name, dst_dir_fd, dst_name, stbuf.st_dev) < 0) {
+		int err = errno;
+		remove_tree(dst_dir_fd, dst_name);
+		errno = err;
+		return -1;
+	}
+	return remove_tree(src_dir_fd, src_name);
+}
+
+/*
+ * Create or atomically replace a symlink.
+ */
+static int place_symlink(int dir_fd, const char *name, const char *tgt)
+{
+	char tmp[NAME_MAX + 1];
+	snprintf(tmp, sizeof(tmp), ".%.200s.brl-enforce", name);
+	unlinkat(dir_fd, tmp, 0);
+	if (symlinkat(tgt, dir_fd, tmp) < 0) {
+		return -1;
+	}
+	if (renameat(dir_fd, tmp, dir_fd, name) < 0) {
+		int err = errno;
+		unlinkat(dir_fd, tmp, 0);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Whether anything is mounted at or under the stratum's root.  This mirrors
+ * common-code's mounts_in_dir, including treating the init stratum's empty
+ * root as having none.
+ */
+static int has_mounts(const char *root)
+{
+	char real[PATH_MAX];
+	if (root[0] == '\0' || realpath(root, real) == NULL) {
+		return 0;
+	}
+	size_t real_len = strlen(real);
+
+	FILE *fp = fopen("/proc/self/mountinfo", "re");
+	if (fp == NULL) {
+		return 1;
+	}
+	char *line = NULL;
+	size_t line_alloc = 0;
+	int found = 0;
+	while (!found && getline(&line, &line_alloc, fp) > 0) {
+		char mnt[PATH_MAX];
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) != 1) {
+			continue;
+		}
+		if (strncmp(mnt, real, real_len) == 0 && (mnt[real_len] == '\0' || mnt[real_len] == '/')) {
+			found = 1;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return found;
+}
+
+static void enforce_symlink(struct stratum *s, struct symlink_cfg *cfg)
+{
+	char proc_link[PATH_MAX];
+	char proc_tgt[PATH_MAX];
+	snprintf(proc_link, sizeof(proc_link), INIT_ROOT "%s%s", s->root, cfg->link);
+	snprintf(proc_tgt, sizeof(proc_tgt), INIT_ROOT "%s%s", s->root, cfg->tgt);
+	const char *link_path = proc_link + strlen(INIT_ROOT);
+
+	const char *link_base;
+	int link_fd = open_parent(s->root_fd, cfg->link, 0, &link_base);
+	if (link_fd < 0 && errno != ENOENT) {
+		error(s, link_path, "unable to open parent of", errno);
+		return;
+	}
+
+	struct stat link_stat;
+	int link_exists = link_fd >= 0 && fstatat(link_fd, link_base, &link_stat, AT_SYMLINK_NOFOLLOW) == 0;
+
+	if (link_exists && S_ISLNK(link_stat.st_mode)) {
+		char cur[PATH_MAX];
+		ssize_t len = readlinkat(link_fd, link_base, cur, sizeof(cur) - 1);
+		if (len >= 0) {
+			cur[len] = '\0';
+			if (strcmp(cur, cfg->tgt) == 0) {
+				/*
+				 * This is the desired situation.  Everything
+				 * is already setup.
+				 */
+				close(link_fd);
+				return;
+			}
+		}
+		/*
+		 * The symlink exists but is pointing to the wrong location.
+		 * Fix it.
+		 */
+		if (place_symlink(link_fd, link_base, cfg->tgt) < 0) {
+			error(s, link_path, "unable to replace symlink", errno);
+		}
+		close(link_fd);
+		return;
+	}
+
+	if (!link_exists) {
+		/*
+		 * Nothing exists at the symlink location.  Create it.
+		 */
+		if (link_fd < 0 && (link_fd = open_parent(s->root_fd, cfg->link, 1, &link_base)) < 0) {
+			error(s, link_path, "unable to create parent of", errno);
+			return;
+		}
+		if (place_symlink(link_fd, link_base, cfg->tgt) < 0) {
+			error(s, link_path, "unable to create symlink", errno);
+		}
+		close(link_fd);
+		return;
+	}
+
+	const char *tgt_base;
+	int tgt_fd = open_parent(s->root_fd, cfg->tgt, 0, &tgt_base);
+	if (tgt_fd < 0 && errno != ENOENT) {
+		error(s, link_path, "unable to open parent of", errno);
+		close(link_fd);
+		return;
+	}
+	/*
+	 * Do not follow the target.  An absolute symlink would resolve against
+	 * enforce's root rather than the stratum's.
+	 */
+	struct stat tgt_stat;
+	int tgt_exists = tgt_fd >= 0 && fstatat(tgt_fd, tgt_base, &tgt_stat, AT_SYMLINK_NOFOLLOW) == 0;
+	int tgt_is_symlink = tgt_exists && S_ISLNK(tgt_stat.st_mode);
+
+	if (tgt_is_symlink || !tgt_exists) {
+		/*
+		 * Non-symlink file exists at symlink location and either a
+		 * symlink or nothing exists at the target location.  Move the
+		 * file to the target location and ensure the symlink points
+		 * where we want it to.
+		 */
+		if (tgt_fd < 0 && (tgt_fd = open_parent(s->root_fd, cfg->tgt, 1, &tgt_base)) < 0) {
+			error(s, link_path, "unable to create parent of", errno);
+		} else if (tgt_is_symlink && unlinkat(tgt_fd, tgt_base, 0) < 0) {
+			error(s, proc_tgt + strlen(INIT_ROOT), "unable to remove", errno);
+		} else if (move_tree(link_fd, link_base, tgt_fd, tgt_base) < 0) {
+			error(s, link_path, "unable to move", errno);
+		} else if (place_symlink(link_fd, link_base, cfg->tgt) < 0) {
+			error(s, link_path, "unable to create symlink", errno);
+		}
+	} else if ((force && !has_mounts(s->root)) || strcmp(cfg->link, DBUS_MACHINE_ID) == 0) {
+		/*
+		 * A file exists both at the desired location and at the
+		 * target location.  Either --force was indicated and we found
+		 * no mount points to indicate otherwise, such that we assume
+		 * this is a newly fetched stratum and we are free to
+		 * manipulate its files aggressively, or this is
+		 * /var/lib/dbus/machine-id which occurs relatively often, such
+		 * as when hand creating a stratum.  Rather than nag end-users,
+		 * pick which to use ourselves.
+		 */
+		if (remove_tree(link_fd, link_base) < 0) {
+			error(s, link_path, "unable to remove", errno);
+		} else if (place_symlink(link_fd, link_base, cfg->tgt) < 0) {
+			error(s, link_path, "unable to create symlink", errno);
+		}
+	} else {
+		/*
+		 * A file exists both at the desired location and at the target
+		 * location.  We do not know which of the two the user wishes
+		 * to retain.  Play it safe and just generate a warning.
+		 */
+		warn(s, "WARNING: File or directory exists at both `%s` and `%s`.  Bedrock Linux expects only one to exist.  Inspect both and determine which you wish to keep, then remove the other, and finally run `brl repair %s` to remedy the situation.", proc_link, proc_tgt);
+	}
+
+	if (tgt_fd >= 0) {
+		close(tgt_fd);
+	}
+	close(link_fd);
+}
+
+static void enforce_symlinks(struct stratum *s)
+{
+	for (size_t i = 0; i < symlink_cnt; i++) {
+		enforce_symlink(s, &symlinks[i]);
+	}
+}
+
+/*
+ * Split a buffer into lines as awk would: a trailing newline does not
+ * produce an empty final line.
+ */
+static void split_lines(char *buf, size_t len, struct lines *l)
+{
+	char *p = buf;
+	char *end = buf + len;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			nl = end;
+		}
+		*nl = '\0';
+		lines_add(l, p);
+		p = nl + 1;
+	}
+}
+
+static void read_shells(struct stratum *s)
+{
+	int fd = open_in_root(s->root_fd, "/etc/shells", O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	size_t len;
+	char *buf = read_file(fd, &len);
+	close(fd);
+	if (buf == NULL) {
+		return;
+	}
+	s->shells_readable = 1;
+	split_lines(buf, len, &s->shells);
+}
+
+static void write_shells(struct stratum *s)
+{
+	struct lines cur = { 0 };
+	for (size_t i = 0; i < s->shells.cnt; i++) {
+		if (strncmp(s->shells.v[i], CROSS_BIN, strlen(CROSS_BIN)) == 0) {
+			lines_add(&cur, s->shells.v[i]);
+		}
+	}
+	int up_to_date = s->shells_readable && cur.cnt == cross_shells.cnt;
+	for (size_t i = 0; up_to_date && i < cur.cnt; i++) {
+		up_to_date = strcmp(cur.v[i], cross_shells.v[i]) == 0;
+	}
+	free(cur.v);
+	if (up_to_date) {
+		return;
+	}
+
+	struct lines out = { 0 };
+	for (size_t i = 0; i < s->shells.cnt; i++) {
+		lines_add(&out, s->shells.v[i]);
+	}
+	for (size_t i = 0; i < cross_shells.cnt; i++) {
+		lines_add(&out, cross_shells.v[i]);
+	}
+	lines_sort_uniq(&out);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/etc/shells", s->root);
+
+	pthread_mutex_lock(&write_lock);
+	int dir_fd = open_in_root(s->root_fd, "/etc", O_PATH | O_DIRECTORY);
+	int fd = -1;
+	if (dir_fd < 0) {
+		error(s, path, "unable to open parent of", errno);
+		goto out;
+	}
+	if ((fd = openat(dir_fd, "shells-", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		error(s, path, "unable to write", errno);
+		goto out;
+	}
+	FILE *fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		error(s, path, "unable to write", errno);
+		goto out;
+	}
+	fd = -1;
+	for (size_t i = 0; i < out.cnt; i++) {
+		fprintf(fp, "%s\n", out.v[i]);
+	}
+	if (fclose(fp) != 0) {
+		error(s, path, "unable to write", errno);
+	} else if (renameat(dir_fd, "shells-", dir_fd, "shells") < 0) {
+		error(s, path, "unable to replace", errno);
+	}
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (dir_fd >= 0) {
+		close(dir_fd);
+	}
+	pthread_mutex_unlock(&write_lock);
+	free(out.v);
+}
+
+/*
+ * Run a function against every stratum in parallel.
+ */
+static void run_stratum(size_t i)
+{
+	stratum_fn(&strata[i]);
+}
+
+static void for_each_stratum(void (*fn)(struct stratum *))
+{
+	stratum_fn = fn;
+	for_each_index(stratum_cnt, run_stratum);
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: enforce [options] <strata>\n"
+		"\n"
+		"Reconcile the specified strata with bedrock.conf expectations.\n"
+		"\n"
+		"Options:\n"
+		"  -l  ensure [symlinks] entries exist in each stratum\n"
+		"  -s  ensure each stratum's /etc/shells lists every stratum's shells via\n"
+		"      /bedrock/cross/bin\n"
+		"  -f  with -l, should a file exist at both a symlink and its target, remove\n"
+		"      the file at the symlink rather than warn, provided no mount points\n"
+		"      are found within the stratum\n"
+		"  -h  print this message\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int do_symlinks = 0;
+	int do_shells = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "lsfh")) != -1) {
+		switch (c) {
+		case 'l':
+			do_symlinks = 1;
+			break;
+		case 's':
+			do_shells = 1;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+
+	if (do_symlinks && cfg_load(load_symlink) < 0) {
+		return 1;
+	}
+
+	stratum_cnt = argc - optind;
+	strata = xmalloc((stratum_cnt + 1) * sizeof(strata[0]));
+	memset(strata, 0, (stratum_cnt + 1) * sizeof(strata[0]));
+	for (size_t i = 0; i < stratum_cnt; i++) {
+		struct stratum *s = &strata[i];
+		s->name = argv[optind + i];
+		if ((s->root = stratum_root(s->name)) == NULL) {
+			fprintf(stderr, "enforce: unable to resolve stratum \"%s\": %s\n", s->name, strerror(errno));
+			return 1;
+		}
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), INIT_ROOT "%s/", s->root);
+		if ((s->root_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "enforce: unable to open \"%s\": %s\n", path, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (do_symlinks) {
+		for_each_stratum(enforce_symlinks);
+		for (size_t i = 0; i < stratum_cnt; i++) {
+			for (size_t j = 0; j < strata[i].warnings.cnt; j++) {
+				printf("%s\n", strata[i].warnings.v[j]);
+			}
+		}
+	}
+
+	if (do_shells) {
+		for_each_stratum(read_shells);
+		for (size_t i = 0; i < stratum_cnt; i++) {
+			struct lines *l = &strata[i].shells;
+			for (size_t j = 0; j < l->cnt; j++) {
+				if (l->v[j][0] != '/') {
+					continue;
+				}
+				const char *name = strrchr(l->v[j], '/') + 1;
+				char *shell = xmalloc(strlen(CROSS_BIN) + strlen(name) + 1);
+				strcpy(shell, CROSS_BIN);
+				strcat(shell, name);
+				lines_add(&cross_shells, shell);
+			}
+		}
+		lines_sort_uniq(&cross_shells);
+		for_each_stratum(write_shells);
+	}
+
+	return error_cnt > 0;
+}
@@ -0,0 +1,816 @@
+/*
+ * bench.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program measures etcfs throughput and latency on the kinds of requests
+ * /etc typically sees:
+ *
+ * - dpkg: create a temporary file, write and fsync() it, then rename() it over
+ *   its final name, as package managers do when installing configuration.
+ * - xdev: rename() a new local file over a global one.  The global and local
+ *   directories are on different filesystems, and so etcfs falls back to
+ *   copying the file.
+ * - nss: read /etc/passwd from many threads, as NSS does on user lookups.
+ * - ls: list /etc and lstat() every entry, as `ls -l /etc` does.
+ * - inject: read a file with injected content, as a login shell does with
+ *   /etc/profile.
+ *
+ * To avoid disturbing the system's own etcfs mounts, the benchmark runs in a
+ * new mount and PID namespace.  etcfs looks for global files below PID 1's
+ * root, and so the benchmark becomes PID 1 and mounts a scratch tmpfs over
+ * /bedrock/strata/bedrock to hold global files.  Local files are in a
+ * temporary directory over which etcfs is mounted.  etcfs is configured
+ * through its configuration file as `brl apply` would with the default
+ * bedrock.conf.
+ *
+ * Results are printed as JSON.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CFG_NAME ".bedrock-config-filesystem"
+
+#define STRATUM_XATTR "user.bedrock.stratum"
+
+/*
+ * etcfs looks for global files below this directory in PID 1's root.
+ */
+#define GLOBAL_ROOT "/bedrock/strata/bedrock"
+
+/*
+ * Number of distinct configuration files the dpkg workload installs.
+ */
+#define DPKG_FILES 64
+
+/*
+ * Number of additional local files in /etc, which the ls workload lists.
+ */
+#define LOCAL_FILES 200
+
+/*
+ * Size of files written by the dpkg and xdev workloads.
+ */
+#define FILE_SIZE 4096
+
+/*
+ * Latencies are recorded in a log-linear histogram: every power of two
+ * nanoseconds is split into HIST_SUB buckets.  This bounds the error on
+ * reported percentiles to about 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LEN (64 * HIST_SUB)
+
+enum workload {
+	WL_DPKG,
+	WL_XDEV,
+	WL_NSS,
+	WL_LS,
+	WL_INJECT,
+	WL_CNT,
+};
+
+static const char *const workload_str[] = {
+	"dpkg",
+	"xdev",
+	"nss",
+	"ls",
+	"inject",
+};
+
+struct hist {
+	uint64_t buckets[HIST_LEN];
+	uint64_t cnt;
+	uint64_t errors;
+	uint64_t max;
+};
+
+/*
+ * Per-thread state.  Each thread has its own histogram so that recording a
+ * sample does not require synchronization.
+ */
+struct worker {
+	pthread_t thread;
+	enum workload workload;
+	int id;
+	uint64_t rand;
+	struct hist hist;
+};
+
+/*
+ * Content injected into /etc/profile, as bedrock.conf's [etc-inject] does.
+ */
+static const char inject_content[] = ""
+	"# Added by Bedrock Linux\n"
+	". /bedrock/share/shells/include-bedrock\n";
+
+static char scratch[] = "/tmp/etcfs-bench.XXXXXX";
+static char mnt[PATH_MAX];
+static char inject_path[PATH_MAX];
+static char etcfs_path[PATH_MAX];
+
+static int mnt_fd = -1;
+static int user_cnt = 500;
+static int writeback = 0;
+
+static char payload[FILE_SIZE];
+
+static volatile int running = 1;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * xorshift64.  Good enough to spread requests across paths.
+ */
+static inline uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static inline size_t hist_index(uint64_t ns)
+{
+	if (ns < HIST_SUB) {
+		return ns;
+	}
+	int exp = 63 - __builtin_clzll(ns);
+	size_t sub = (ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/*
+ * Largest value which maps to the given bucket.
+ */
+static inline uint64_t hist_value(size_t index)
+{
+	if (index < HIST_SUB) {
+		return index;
+	}
+	int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t sub = index % HIST_SUB;
+	return ((HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+static inline void hist_record(struct hist *hist, uint64_t ns, int error)
+{
+	hist->buckets[hist_index(ns)]++;
+	hist->cnt++;
+	if (error) {
+		hist->errors++;
+	}
+	if (ns > hist->max) {
+		hist->max = ns;
+	}
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	for (size_t i = 0; i < HIST_LEN; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->cnt += src->cnt;
+	dst->errors += src->errors;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+static uint64_t hist_percentile(const struct hist *hist, double percentile)
+{
+	if (hist->cnt == 0) {
+		return 0;
+	}
+	uint64_t target = (uint64_t)(hist->cnt * percentile / 100.0);
+	if (target >= hist->cnt) {
+		target = hist->cnt - 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_LEN; i++) {
+		seen += hist->buckets[i];
+		if (seen > target) {
+			uint64_t value = hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t s = write(fd, buf, len);
+		if (s < 0 && errno == EINTR) {
+			continue;
+		}
+		if (s <= 0) {
+			return -1;
+		}
+		buf += s;
+		len -= s;
+	}
+	return 0;
+}
+
+static int read_all(int fd)
+{
+	char buf[65536];
+	ssize_t s;
+	while ((s = read(fd, buf, sizeof(buf))) != 0) {
+		if (s < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int mkdir_p(const char *path)
+{
+	char buf[PATH_MAX];
+	int s = snprintf(buf, sizeof(buf), "%s", path);
+	if (s < 0 || s >= (int)sizeof(buf)) {
+		return -1;
+	}
+	for (char *p = buf + 1; *p != '\0'; p++) {
+		if (*p != '/') {
+			continue;
+		}
+		*p = '\0';
+		if (mkdir(buf, 0755) < 0 && errno != EEXIST) {
+			return -1;
+		}
+		*p = '/';
+	}
+	if (mkdir(buf, 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create a file relative to dir_fd with printf-style content.
+ */
+static int create_file(int dir_fd, const char *path, const char *format, ...)
+{
+	int fd = openat(dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "etcfs-bench: unable to create \"%s\"\n", path);
+		return -1;
+	}
+	va_list ap;
+	va_start(ap, format);
+	int rv = vdprintf(fd, format, ap) < 0 ? -1 : 0;
+	va_end(ap);
+	close(fd);
+	return rv;
+}
+
+/*
+ * Populate the global directory with the files bedrock.conf makes global by
+ * default.  passwd and friends have user_cnt users.
+ */
+static int populate_global(int dir_fd)
+{
+	int fds[4];
+	const char *const names[] = { "passwd", "group", "shadow", "gshadow" };
+	for (size_t i = 0; i < 4; i++) {
+		if ((fds[i] = openat(dir_fd, names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			fprintf(stderr, "etcfs-bench: unable to create \"%s\"\n", names[i]);
+			return -1;
+		}
+	}
+	dprintf(fds[0], "root:x:0:0:root:/root:/bin/sh\n");
+	dprintf(fds[1], "root:x:0:\n");
+	dprintf(fds[2], "root:*:19000:0:99999:7:::\n");
+	dprintf(fds[3], "root:*::\n");
+	for (int i = 0; i < user_cnt; i++) {
+		dprintf(fds[0], "user%d:x:%d:%d:Benchmark User %d:/home/user%d:/bin/bash\n", i, 1000 + i, 1000 + i, i, i);
+		dprintf(fds[1], "user%d:x:%d:\n", i, 1000 + i);
+		dprintf(fds[2], "user%d:$6$salt$hash:19000:0:99999:7:::\n", i);
+		dprintf(fds[3], "user%d:!::\n", i);
+	}
+	for (size_t i = 0; i < 4; i++) {
+		close(fds[i]);
+	}
+
+	if (mkdirat(dir_fd, "default", 0755) < 0 || mkdirat(dir_fd, "modprobe.d", 0755) < 0) {
+		return -1;
+	}
+	if (create_file(dir_fd, "hosts", "127.0.0.1 localhost\n::1 localhost\n") < 0
+		|| create_file(dir_fd, "hostname", "bench\n") < 0
+		|| create_file(dir_fd, "resolv.conf", "nameserver 127.0.0.1\n") < 0
+		|| create_file(dir_fd, "machine-id", "00000000000000000000000000000000\n") < 0
+		|| create_file(dir_fd, "fstab", "# <fs> <mountpoint> <type> <opts> <dump> <pass>\n") < 0
+		|| create_file(dir_fd, "default/grub", "GRUB_TIMEOUT=5\n") < 0
+		|| create_file(dir_fd, "modprobe.d/blacklist.conf", "blacklist pcspkr\n") < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Populate the local directory with enough files to make listing it
+ * representative.
+ */
+static int populate_local(int dir_fd)
+{
+	if (mkdirat(dir_fd, "dpkg", 0755) < 0) {
+		return -1;
+	}
+	if (create_file(dir_fd, "profile", "export PATH=/usr/local/bin:/usr/bin:/bin\numask 022\n") < 0) {
+		return -1;
+	}
+	for (int i = 0; i < LOCAL_FILES; i++) {
+		char name[NAME_MAX];
+		snprintf(name, sizeof(name), "bench-%03d.conf", i);
+		if (create_file(dir_fd, name, "setting%d = value\n", i) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write lines into the configuration file, one write() per line, as
+ * cfg_etcfs() does.  These mirror the default bedrock.conf.  Globals are
+ * listed literally rather than as patterns such that older etcfs builds may be
+ * compared against newer ones.
+ */
+static int configure(void)
+{
+	char inject_line[PATH_MAX + 64];
+	snprintf(inject_line, sizeof(inject_line), "add_override inject /profile %s\n", inject_path);
+
+	const char *const lines[] = {
+		"add_global /adjtime\n",
+		"add_global /crypttab\n",
+		"add_global /default/grub\n",
+		"add_global /fstab\n",
+		"add_global /group\n",
+		"add_global /group+\n",
+		"add_global /group-\n",
+		"add_global /group.OLD\n",
+		"add_global /group.org\n",
+		"add_global /gshadow\n",
+		"add_global /gshadow+\n",
+		"add_global /gshadow-\n",
+		"add_global /gshadow.OLD\n",
+		"add_global /gshadow.org\n",
+		"add_global /hostname\n",
+		"add_global /hosts\n",
+		"add_global /login.defs\n",
+		"add_global /machine-id\n",
+		"add_global /modprobe.d/blacklist.conf\n",
+		"add_global /passwd\n",
+		"add_global /passwd+\n",
+		"add_global /passwd-\n",
+		"add_global /passwd.OLD\n",
+		"add_global /passwd.org\n",
+		"add_global /rc.local\n",
+		"add_global /resolv.conf\n",
+		"add_global /resolvconf/run\n",
+		"add_global /shadow\n",
+		"add_global /shadow+\n",
+		"add_global /shadow-\n",
+		"add_global /shadow.OLD\n",
+		"add_global /shadow.org\n",
+		"add_global /sudoers\n",
+		"add_override symlink /mtab /proc/self/mounts\n",
+		"add_override directory /systemd x\n",
+		"add_override directory /systemd/system x\n",
+		"add_override symlink /systemd/system/bedrock-fix-mounts.service /bedrock/share/systemd/bedrock-fix-mounts.service\n",
+		"add_override symlink /systemd/system/bedrock-fix-resolv.service /bedrock/share/systemd/bedrock-fix-resolv.service\n",
+		inject_line,
+	};
+
+	int fd = openat(mnt_fd, CFG_NAME, O_WRONLY | O_APPEND);
+	if (fd < 0) {
+		return -1;
+	}
+	int rv = 0;
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		size_t len = strlen(lines[i]);
+		if (write(fd, lines[i], len) != (ssize_t)len) {
+			fprintf(stderr, "etcfs-bench: etcfs rejected \"%.*s\"\n", (int)len - 1, lines[i]);
+			rv = -1;
+		}
+	}
+	close(fd);
+	return rv;
+}
+
+static int do_dpkg(struct worker *w)
+{
+	char tmp[PATH_MAX];
+	char final[PATH_MAX];
+	uint64_t n = next_rand(&w->rand) % DPKG_FILES;
+	snprintf(final, sizeof(final), "dpkg/conf-%d-%llu", w->id, (unsigned long long)n);
+	snprintf(tmp, sizeof(tmp), "dpkg/conf-%d-%llu.dpkg-new", w->id, (unsigned long long)n);
+
+	int fd = openat(mnt_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	int rv = 0;
+	if (write_all(fd, payload, sizeof(payload)) < 0 || fsync(fd) < 0) {
+		rv = -1;
+	}
+	if (close(fd) < 0) {
+		rv = -1;
+	}
+	if (rv == 0) {
+		rv = renameat(mnt_fd, tmp, mnt_fd, final);
+	}
+	return rv;
+}
+
+/*
+ * Replace a global file with a new local one, as a tool which writes a
+ * temporary file in /etc then renames it over /etc/passwd- would.
+ */
+static int do_xdev(struct worker *w)
+{
+	const char *const final = "passwd-";
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "xdev-%d.tmp", w->id);
+
+	int fd = openat(mnt_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	int rv = write_all(fd, payload, sizeof(payload));
+	if (close(fd) < 0) {
+		rv = -1;
+	}
+	if (rv == 0) {
+		rv = renameat(mnt_fd, tmp, mnt_fd, final);
+	}
+	return rv;
+}
+
+static int do_read(const char *path)
+{
+	int fd = openat(mnt_fd, path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	int rv = read_all(fd);
+	close(fd);
+	return rv;
+}
+
+static int do_ls(void)
+{
+	int fd = openat(mnt_fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return -1;
+	}
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return -1;
+	}
+	int rv = 0;
+	struct dirent *dir;
+	errno = 0;
+	while ((dir = readdir(d)) != NULL) {
+		struct stat stbuf;
+		if (fstatat(dirfd(d), dir->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			rv = -1;
+		}
+		errno = 0;
+	}
+	if (errno != 0) {
+		rv = -1;
+	}
+	closedir(d);
+	return rv;
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *w = arg;
+
+	while (running) {
+		uint64_t start = now_ns();
+		int rv;
+		switch (w->workload) {
+		case WL_DPKG:
+			rv = do_dpkg(w);
+			break;
+		case WL_XDEV:
+			rv = do_xdev(w);
+			break;
+		case WL_NSS:
+			rv = do_read("passwd");
+			break;
+		case WL_LS:
+			rv = do_ls();
+			break;
+		case WL_INJECT:
+		default:
+			rv = do_read("profile");
+			break;
+		}
+		hist_record(&w->hist, now_ns() - start, rv < 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run a workload on thread_cnt threads for duration seconds and print its
+ * results as a JSON object member.
+ */
+static int run_workload(enum workload workload, int thread_cnt, long duration, int last)
+{
+	struct worker *workers = calloc(thread_cnt, sizeof(struct worker));
+	struct hist *hist = calloc(1, sizeof(struct hist));
+	if (workers == NULL || hist == NULL) {
+		free(workers);
+		free(hist);
+		return -1;
+	}
+
+	fprintf(stderr, "etcfs-bench: running %s\n", workload_str[workload]);
+	running = 1;
+	uint64_t start = now_ns();
+	for (int i = 0; i < thread_cnt; i++) {
+		workers[i].workload = workload;
+		workers[i].id = i;
+		workers[i].rand = 0x9E3779B97F4A7C15ull * (i + 1);
+		if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+			fprintf(stderr, "etcfs-bench: unable to create thread\n");
+			exit(1);
+		}
+	}
+	sleep(duration);
+	running = 0;
+	for (int i = 0; i < thread_cnt; i++) {
+		pthread_join(workers[i].thread, NULL);
+		hist_merge(hist, &workers[i].hist);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	printf("\t\t\"%s\": {\"threads\": %d, \"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, "
+		"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+		workload_str[workload], thread_cnt,
+		(unsigned long long)hist->cnt, (unsigned long long)hist->errors,
+		hist->cnt / elapsed,
+		hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 99) / 1e3,
+		hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3,
+		last ? "" : ",");
+	fflush(stdout);
+
+	free(workers);
+	free(hist);
+	return 0;
+}
+
+/*
+ * Set up the scratch environment and mount etcfs.  Runs as PID 1 of a new
+ * PID namespace.
+ */
+static int setup(void)
+{
+	/*
+	 * Keep our mounts from propagating to the rest of the system.
+	 */
+	if (unshare(CLONE_NEWNS) < 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+		fprintf(stderr, "etcfs-bench: unable to create mount namespace\n");
+		return -1;
+	}
+	/*
+	 * /proc/1 should refer to us rather than the system's init.
+	 */
+	if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) < 0) {
+		fprintf(stderr, "etcfs-bench: unable to mount /proc\n");
+		return -1;
+	}
+	if (mount("etcfs-bench", GLOBAL_ROOT, "tmpfs", 0, "mode=755") < 0) {
+		fprintf(stderr, "etcfs-bench: unable to mount tmpfs on " GLOBAL_ROOT "\n");
+		return -1;
+	}
+
+	char global[PATH_MAX];
+	int s = snprintf(global, sizeof(global), GLOBAL_ROOT "%s", mnt);
+	if (s < 0 || s >= (int)sizeof(global) || mkdir_p(global) < 0 || mkdir(mnt, 0755) < 0) {
+		fprintf(stderr, "etcfs-bench: unable to create scratch directories\n");
+		return -1;
+	}
+
+	int global_fd = open(global, O_RDONLY | O_DIRECTORY);
+	int local_fd = open(mnt, O_RDONLY | O_DIRECTORY);
+	if (global_fd < 0 || local_fd < 0 || populate_global(global_fd) < 0 || populate_local(local_fd) < 0) {
+		fprintf(stderr, "etcfs-bench: unable to populate scratch directories\n");
+		return -1;
+	}
+	close(global_fd);
+	close(local_fd);
+
+	if (create_file(AT_FDCWD, inject_path, "%s", inject_content) < 0) {
+		return -1;
+	}
+
+	/*
+	 * etcfs daemonizes once mounted.
+	 */
+	pid_t pid = fork();
+	if (pid < 0) {
+		return -1;
+	} else if (pid == 0) {
+		execl(etcfs_path, etcfs_path, "-o", writeback ? "allow_other,writeback_cache" : "allow_other",
+			mnt, (char *)NULL);
+		fprintf(stderr, "etcfs-bench: unable to execute \"%s\"\n", etcfs_path);
+		exit(1);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "etcfs-bench: unable to mount etcfs\n");
+		return -1;
+	}
+
+	if ((mnt_fd = open(mnt, O_RDONLY | O_DIRECTORY)) < 0 || faccessat(mnt_fd, CFG_NAME, F_OK, 0) < 0) {
+		fprintf(stderr, "etcfs-bench: etcfs not mounted on \"%s\"\n", mnt);
+		return -1;
+	}
+	if (configure() < 0) {
+		fprintf(stderr, "etcfs-bench: unable to configure etcfs\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	(void)sb;
+	(void)type;
+	(void)ftw;
+	remove(path);
+	return 0;
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: etcfs-bench [options] <etcfs>\n"
+		"\n"
+		"Mount the etcfs binary <etcfs> in a scratch namespace and measure\n"
+		"its performance on common /etc workloads.  Results are printed as\n"
+		"JSON.  Requires root on Bedrock Linux.\n"
+		"\n"
+		"Options:\n"
+		"  -t <SECONDS>  duration of each workload (default 10)\n"
+		"  -n <N>        nss threads (default 8)\n"
+		"  -u <N>        users in passwd (default 500)\n"
+		"  -w            mount etcfs with -o writeback_cache\n"
+		"  -h            print this message\n"
+		"\n"
+		"Example:\n"
+		"  $ ./etcfs-bench -t 5 ./etcfs > results.json\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long duration = 10;
+	int nss_threads = 8;
+
+	int c;
+	while ((c = getopt(argc, argv, "t:n:u:wh")) != -1) {
+		switch (c) {
+		case 't':
+			duration = atol(optarg);
+			break;
+		case 'n':
+			nss_threads = atoi(optarg);
+			break;
+		case 'u':
+			user_cnt = atoi(optarg);
+			break;
+		case 'w':
+			writeback = 1;
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || duration <= 0 || nss_threads <= 0 || user_cnt < 0) {
+		print_help();
+		return 1;
+	}
+
+	if (getuid() != 0) {
+		fprintf(stderr, "etcfs-bench: error not running as root.\n");
+		return 1;
+	}
+
+	/*
+	 * etcfs determines the local stratum from the root directory.
+	 */
+	char stratum[PATH_MAX];
+	if (lgetxattr("/", STRATUM_XATTR, stratum, sizeof(stratum)) < 0 || access(GLOBAL_ROOT, F_OK) < 0) {
+		fprintf(stderr, "etcfs-bench: not running on Bedrock Linux.\n");
+		return 1;
+	}
+
+	if (realpath(argv[optind], etcfs_path) == NULL) {
+		fprintf(stderr, "etcfs-bench: unable to find \"%s\"\n", argv[optind]);
+		return 1;
+	}
+	if (mkdtemp(scratch) == NULL) {
+		fprintf(stderr, "etcfs-bench: unable to create scratch directory\n");
+		return 1;
+	}
+	snprintf(mnt, sizeof(mnt), "%s/etc", scratch);
+	snprintf(inject_path, sizeof(inject_path), "%s/include-bedrock", scratch);
+	memset(payload, 'x', sizeof(payload));
+	for (size_t i = 63; i < sizeof(payload); i += 64) {
+		payload[i] = '\n';
+	}
+
+	if (unshare(CLONE_NEWPID) < 0) {
+		fprintf(stderr, "etcfs-bench: unable to create PID namespace\n");
+		rmdir(scratch);
+		return 1;
+	}
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "etcfs-bench: unable to fork\n");
+		rmdir(scratch);
+		return 1;
+	} else if (pid == 0) {
+		/*
+		 * PID 1 of the new namespace.  When it exits, the kernel kills
+		 * etcfs and tears down its mount.
+		 */
+		if (setup() < 0) {
+			exit(1);
+		}
+		printf("{\n");
+		printf("\t\"writeback\": %s,\n", writeback ? "true" : "false");
+		printf("\t\"seconds\": %ld,\n", duration);
+		printf("\t\"users\": %d,\n", user_cnt);
+		printf("\t\"workloads\": {\n");
+		int rv = 0;
+		rv |= run_workload(WL_DPKG, 1, duration, 0);
+		rv |= run_workload(WL_XDEV, 1, duration, 0);
+		rv |= run_workload(WL_NSS, nss_threads, duration, 0);
+		rv |= run_workload(WL_LS, 1, duration, 0);
+		rv |= run_workload(WL_INJECT, 1, duration, 1);
+		printf("\t}\n");
+		printf("}\n");
+		fflush(stdout);
+
+		close(mnt_fd);
+		umount2(mnt, MNT_DETACH);
+		exit(rv < 0 ? 1 : 0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	/*
+	 * Local files were written to the scratch directory.  Global files
+	 * were on a tmpfs which went away with the namespace.
+	 */
+	nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -24,11 +24,14 @@
 #include <linux/limits.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
@@ -43,6 +46,14 @@
 #define LPATH_XATTR "user.bedrock.localpath"
 #define LPATH_XATTR_LEN strlen(LPATH_XATTR)
 
+/*
+ * Advertises optional configuration syntax on the configuration file, such
+ * that configuration tools may avoid sending older instances lines they would
+ * misinterpret.
+ */
+#define FEATURES_XATTR "user.bedrock.etcfs-features"
+#define FEATURES "glob"
+
 #define CFG_NAME ".bedrock-config-filesystem"
 #define CFG_NAME_LEN strlen(CFG_NAME)
 
@@ -67,6 +78,20 @@
 #define ATOMIC_UPDATE_SUFFIX "-bedrock-backup"
 #define ATOMIC_UPDATE_SUFFIX_LEN strlen(ATOMIC_UPDATE_SUFFIX)
 
+/*
+ * Number of files for which the kernel may be told to retain cached pages
+ * across opens.
+ */
+#define PAGE_CACHE_SLOTS 64
+
+#define PAGE_CACHE_EVENTS (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/*
+ * Maximum number of nodes in the compiled global path matcher, such that they
+ * may be indexed with a uint16_t.
+ */
+#define GLOB_MAX_NODES 4096
+
 /*
  * Various permissions related POSIX functions are per-process, not per thread.
  * The underlying Linux filesystem calls, however, are per-thread.  We can
@@ -232,12 +257,46 @@ int global_ref_fd = -1;
 int local_ref_fd = -1;
 
 /*
- * Paths which should be global.
+ * Paths which should be global.  These may contain `*`, which matches any
+ * characters other than `/`, and `**`, which matches any characters.
  */
 char **globals = NULL;
 size_t global_cnt = 0;
 size_t global_alloc = 0;
 
+/*
+ * globals compiled into a trie, such that a path is matched against all of
+ * them in a single pass.  Wildcards are nodes which, while matching, remain
+ * in the set of active nodes.  Node 0 is the root.
+ */
+enum glob_type {
+	GLOB_LITERAL,
+	GLOB_STAR,
+	GLOB_GLOBSTAR,
+};
+
+struct glob_node {
+	uint16_t child;
+	uint16_t sibling;
+	unsigned char type;
+	char c;
+	unsigned char terminal;
+	/*
+	 * Whether this node is or is below a wildcard.
+	 */
+	unsigned char wild;
+};
+
+struct glob_node *glob_nodes = NULL;
+size_t glob_node_cnt = 0;
+size_t glob_node_alloc = 0;
+/*
+ * Number of nodes which are or are below a wildcard.  Only one node which is
+ * not may be active at a time, namely that spelling out the path matched so
+ * far, and so this plus one bounds the number of active nodes.
+ */
+size_t glob_wild_cnt = 0;
+
 /*
  * Overrides
  */
@@ -271,6 +330,72 @@ pthread_rwlock_t cfg_lock;
  */
 int debug = 0;
 
+/*
+ * NSS and resolver code re-read a handful of files in the root of /etc, such
+ * as passwd and hosts, from every process.  If such a file is unchanged since
+ * it was last opened, the kernel is told to keep its cached pages rather than
+ * re-read the file through etcfs.
+ *
+ * Changes made underneath etcfs are picked up via inotify on the global and
+ * local directories, upon which the kernel's pages are invalidated.  inotify
+ * watches are not recursive, and thus only files directly in the mount point
+ * are tracked.
+ *
+ * page_cache should be locked with page_cache_lock.  page_cache_enabled is
+ * only set once the inotify watches are in place.
+ */
+struct page_cache_entry {
+	/*
+	 * The file path, relative to the mount point, or an empty string if
+	 * the slot is unused.
+	 */
+	char path[NAME_MAX + 2];
+	/*
+	 * The underlying file's identity and content as of its last open.
+	 */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+};
+
+static struct page_cache_entry page_cache[PAGE_CACHE_SLOTS];
+static pthread_mutex_t page_cache_lock;
+static int page_cache_enabled = 0;
+
+/*
+ * Handle used to invalidate the kernel's cache.  Populated by m_init().
+ */
+static struct fuse *fuse_handle = NULL;
+
+/*
+ * If set with `-o writeback_cache`, the kernel buffers writes and sends them
+ * to etcfs in large batches.  writeback_enabled is set once the kernel agrees.
+ *
+ * With writeback caching, the kernel trusts its own idea of a regular file's
+ * size and modification time over etcfs'.  Files which may change outside of
+ * this mount, such as global files and overrides, thus bypass the page cache,
+ * and the kernel is told to forget them whenever inotify reports a change.
+ */
+static int writeback_requested = 0;
+static int writeback_enabled = 0;
+
+/*
+ * inotify file descriptor and the underlying directories it watches.  Each
+ * watch's prefix is the directory's path relative to the mount point, or an
+ * empty string for the mount point itself.
+ *
+ * watches should be locked with page_cache_lock.
+ */
+struct watch {
+	int wd;
+	char *prefix;
+};
+
+static int inotify_fd = -1;
+static struct watch *watches = NULL;
+static size_t watch_cnt = 0;
+
 /*
  * Set the thread's euid, egid, and grouplist to that of the
  * process calling a given FUSE filesystem call.
@@ -393,15 +518,173 @@ static inline void print_debug(const char *const name, const char *const arg)
 	fflush(NULL);
 }
 
+/*
+ * Add a node to a set of active glob nodes along with any wildcard children,
+ * as those may match zero characters.
+ */
+static void glob_activate(uint16_t *set, size_t *cnt, uint16_t n)
+{
+	for (size_t i = 0; i < *cnt; i++) {
+		if (set[i] == n) {
+			return;
+		}
+	}
+	set[(*cnt)++] = n;
+
+	for (uint16_t c = glob_nodes[n].child; c != 0; c = glob_nodes[c].sibling) {
+		if (glob_nodes[c].type != GLOB_LITERAL) {
+			glob_activate(set, cnt, c);
+		}
+	}
+}
+
+/*
+ * Check if a path matches any global.  Each set of active nodes is a subset
+ * of all nodes, and so the cost is linear in the path length.
+ *
+ * Caller should lock cfg_lock.
+ */
+static int glob_match(const char *path)
+{
+	if (glob_node_cnt == 0) {
+		return 0;
+	}
+
+	uint16_t set_a[glob_wild_cnt + 1];
+	uint16_t set_b[glob_wild_cnt + 1];
+	uint16_t *cur = set_a;
+	uint16_t *next = set_b;
+	size_t cur_cnt = 0;
+	glob_activate(cur, &cur_cnt, 0);
+
+	for (const char *p = path; *p != '\0'; p++) {
+		size_t next_cnt = 0;
+		for (size_t i = 0; i < cur_cnt; i++) {
+			struct glob_node *node = &glob_nodes[cur[i]];
+			if (node->type == GLOB_GLOBSTAR || (node->type == GLOB_STAR && *p != '/')) {
+				glob_activate(next, &next_cnt, cur[i]);
+			}
+			for (uint16_t c = node->child; c != 0; c = glob_nodes[c].sibling) {
+				if (glob_nodes[c].type == GLOB_LITERAL && glob_nodes[c].c == *p) {
+					glob_activate(next, &next_cnt, c);
+				}
+			}
+		}
+		if (next_cnt == 0) {
+			return 0;
+		}
+		uint16_t *tmp = cur;
+		cur = next;
+		next = tmp;
+		cur_cnt = next_cnt;
+	}
+
+	for (size_t i = 0; i < cur_cnt; i++) {
+		if (glob_nodes[cur[i]].terminal) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int glob_node_new(uint16_t parent, unsigned char type, char c)
+{
+	if (glob_node_cnt >= GLOB_MAX_NODES) {
+		return -ENOSPC;
+	}
+	if (glob_node_alloc < glob_node_cnt + 1) {
+		size_t alloc = glob_node_alloc == 0 ? 64 : glob_node_alloc * 2;
+		struct glob_node *new_nodes = realloc(glob_nodes, alloc * sizeof(struct glob_node));
+		if (new_nodes == NULL) {
+			return -ENOMEM;
+		}
+		glob_nodes = new_nodes;
+		glob_node_alloc = alloc;
+	}
+
+	uint16_t n = glob_node_cnt++;
+	glob_nodes[n].child = 0;
+	glob_nodes[n].sibling = 0;
+	glob_nodes[n].type = type;
+	glob_nodes[n].c = c;
+	glob_nodes[n].terminal = 0;
+	glob_nodes[n].wild = type != GLOB_LITERAL || (n != 0 && glob_nodes[parent].wild);
+	if (glob_nodes[n].wild) {
+		glob_wild_cnt++;
+	}
+	if (n != 0) {
+		glob_nodes[n].sibling = glob_nodes[parent].child;
+		glob_nodes[parent].child = n;
+	}
+	return n;
+}
+
+/*
+ * Compile a global into the trie.  On failure, any nodes already added are
+ * non-terminal and thus harmless.
+ *
+ * Caller should lock cfg_lock.
+ */
+static int glob_insert(const char *pattern)
+{
+	if (glob_node_cnt == 0 && glob_node_new(0, GLOB_LITERAL, '\0') < 0) {
+		return -ENOMEM;
+	}
+
+	uint16_t n = 0;
+	for (const char *p = pattern; *p != '\0';) {
+		unsigned char type = GLOB_LITERAL;
+		char c = '\0';
+		if (p[0] == '*' && p[1] == '*') {
+			type = GLOB_GLOBSTAR;
+			while (*p == '*') {
+				p++;
+			}
+		} else if (p[0] == '*') {
+			type = GLOB_STAR;
+			p++;
+		} else {
+			c = *p++;
+		}
+
+		int child;
+		for (child = glob_nodes[n].child; child != 0; child = glob_nodes[child].sibling) {
+			if (glob_nodes[child].type == type && glob_nodes[child].c == c) {
+				break;
+			}
+		}
+		if (child == 0 && (child = glob_node_new(n, type, c)) < 0) {
+			return child;
+		}
+		n = child;
+	}
+
+	glob_nodes[n].terminal = 1;
+	return 0;
+}
+
+/*
+ * Recompile the trie from scratch, such as after a global was removed.  This
+ * never needs more nodes than were previously allocated and thus cannot fail.
+ *
+ * Caller should lock cfg_lock.
+ */
+static void glob_rebuild(void)
+{
+	glob_node_cnt = 0;
+	glob_wild_cnt = 0;
+	for (size_t i = 0; i < global_cnt; i++) {
+		(void)glob_insert(globals[i]);
+	}
+}
+
 static inline int get_ref_fd(const char *const path)
 {
 	/*
 	 * Check if file is global
 	 */
-	for (size_t i = 0; i < global_cnt; i++) {
-		if (strcmp(globals[i], path) == 0) {
-			return global_ref_fd;
-		}
+	if (glob_match(path)) {
+		return global_ref_fd;
 	}
 
 	return local_ref_fd;
@@ -455,6 +738,384 @@ static inline int procpath(const int fd, char *buf, size_t size)
 	return 0;
 }
 
+static inline struct page_cache_entry *page_cache_slot(const char *const path)
+{
+	size_t hash = 5381;
+	for (const char *c = path; *c != '\0'; c++) {
+		hash = hash * 33 + (unsigned char)*c;
+	}
+	return &page_cache[hash % PAGE_CACHE_SLOTS];
+}
+
+/*
+ * Determine whether the kernel may keep its cached pages for a file being
+ * opened.  This is the case if the underlying file is the same, unchanged
+ * file as when it was last opened.
+ */
+static int page_cache_keep(const char *const path, int fd, int flags)
+{
+	if (!page_cache_enabled || (flags & O_ACCMODE) != O_RDONLY || strchr(path + 1, '/') != NULL
+		|| strlen(path) >= sizeof(page_cache[0].path)) {
+		return 0;
+	}
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0 || !S_ISREG(stbuf.st_mode)) {
+		return 0;
+	}
+
+	int keep = 0;
+	struct page_cache_entry *entry = page_cache_slot(path);
+	pthread_mutex_lock(&page_cache_lock);
+	if (strcmp(entry->path, path) == 0 && entry->dev == stbuf.st_dev && entry->ino == stbuf.st_ino
+		&& entry->mtime.tv_sec == stbuf.st_mtim.tv_sec
+		&& entry->mtime.tv_nsec == stbuf.st_mtim.tv_nsec && entry->size == stbuf.st_size) {
+		keep = 1;
+	} else {
+		strcpy(entry->path, path);
+		entry->dev = stbuf.st_dev;
+		entry->ino = stbuf.st_ino;
+		entry->mtime = stbuf.st_mtim;
+		entry->size = stbuf.st_size;
+	}
+	pthread_mutex_unlock(&page_cache_lock);
+
+	return keep;
+}
+
+/*
+ * Drop a tracked file and the kernel's cached pages for it.  Files which are
+ * not tracked have not been opened with keep_cache, and so the kernel
+ * already discards their pages on open.
+ */
+static void page_cache_invalidate(const char *const name)
+{
+	char path[sizeof(page_cache[0].path)];
+	int s = snprintf(path, sizeof(path), "/%s", name);
+	if (s < 0 || s >= (int)sizeof(path)) {
+		return;
+	}
+
+	struct page_cache_entry *entry = page_cache_slot(path);
+	pthread_mutex_lock(&page_cache_lock);
+	int tracked = strcmp(entry->path, path) == 0;
+	if (tracked) {
+		entry->path[0] = '\0';
+	}
+	pthread_mutex_unlock(&page_cache_lock);
+
+	if (tracked) {
+		fuse_invalidate_path(fuse_handle, path);
+	}
+}
+
+/*
+ * If inotify events were lost we cannot know what changed.  Drop
+ * everything.
+ */
+static void page_cache_invalidate_all(void)
+{
+	for (size_t i = 0; i < PAGE_CACHE_SLOTS; i++) {
+		char path[sizeof(page_cache[0].path)];
+		pthread_mutex_lock(&page_cache_lock);
+		strcpy(path, page_cache[i].path);
+		page_cache[i].path[0] = '\0';
+		pthread_mutex_unlock(&page_cache_lock);
+
+		if (path[0] != '\0') {
+			fuse_invalidate_path(fuse_handle, path);
+		}
+	}
+}
+
+/*
+ * Whether a file may change other than through this mount.  Global files are
+ * shared with other strata's etcfs instances and overrides are (re)applied by
+ * etcfs directly on the underlying filesystem.
+ *
+ * Caller should lock cfg_lock.
+ */
+static int is_shared_path(const char *const path)
+{
+	if (strcmp(path + 1, CFG_NAME) == 0 || get_ref_fd(path) == global_ref_fd) {
+		return 1;
+	}
+	for (size_t i = 0; i < override_cnt; i++) {
+		if (strcmp(overrides[i].path, path) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Have the kernel drop its entry for a shared file so that the next access
+ * looks it up afresh.  With writeback caching, this is the only way to get the
+ * kernel to pick up a size change made outside of this mount.
+ *
+ * The kernel can only be told about names within directories for which it
+ * has a node ID, and libfuse's high-level API only exposes the mount point's.
+ * Drop the file's top-level ancestor, which drops everything below it.
+ *
+ * Must not be called with cfg_lock held or from a filesystem call, as the
+ * kernel may wait on either to complete the invalidation.
+ */
+static void writeback_invalidate(const char *const path)
+{
+	const char *top = path + 1;
+	size_t top_len = strcspn(top, "/");
+	if (top_len > 0) {
+		fuse_lowlevel_notify_inval_entry(fuse_get_session(fuse_handle), FUSE_ROOT_ID, top, top_len);
+	}
+}
+
+/*
+ * If inotify events were lost we cannot know which shared files changed.
+ * Drop all of them.
+ */
+static void writeback_invalidate_all(void)
+{
+	pthread_rwlock_rdlock(&cfg_lock);
+	size_t cnt = global_cnt + override_cnt;
+	char **paths = malloc(cnt * sizeof(char *));
+	size_t path_cnt = 0;
+	for (size_t i = 0; paths != NULL && i < cnt; i++) {
+		const char *path = i < global_cnt ? globals[i] : overrides[i - global_cnt].path;
+		if ((paths[path_cnt] = strdup(path)) != NULL) {
+			path_cnt++;
+		}
+	}
+	pthread_rwlock_unlock(&cfg_lock);
+
+	for (size_t i = 0; i < path_cnt; i++) {
+		writeback_invalidate(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+}
+
+/*
+ * Watch a directory, relative to dir_fd, for changes.  prefix is the
+ * directory's path relative to the mount point, or an empty string for the
+ * mount point itself.
+ */
+static int watch_add(int dir_fd, const char *const prefix)
+{
+	char buf[PATH_MAX];
+	int s = snprintf(buf, sizeof(buf), "/proc/self/fd/%d%s", dir_fd, prefix);
+	if (s < 0 || s >= (int)sizeof(buf)) {
+		return -1;
+	}
+	int wd = inotify_add_watch(inotify_fd, buf, PAGE_CACHE_EVENTS);
+	if (wd < 0) {
+		return -1;
+	}
+
+	int rv = 0;
+	pthread_mutex_lock(&page_cache_lock);
+	size_t i;
+	for (i = 0; i < watch_cnt; i++) {
+		if (watches[i].wd == wd) {
+			break;
+		}
+	}
+	if (i == watch_cnt) {
+		struct watch *new_watches = realloc(watches, (watch_cnt + 1) * sizeof(struct watch));
+		char *new_prefix = strdup(prefix);
+		if (new_watches != NULL) {
+			watches = new_watches;
+		}
+		if (new_watches == NULL || new_prefix == NULL) {
+			free(new_prefix);
+			rv = -1;
+		} else {
+			watches[watch_cnt].wd = wd;
+			watches[watch_cnt].prefix = new_prefix;
+			watch_cnt++;
+		}
+	}
+	pthread_mutex_unlock(&page_cache_lock);
+	return rv;
+}
+
+/*
+ * Watch the directory containing a shared file nested below the mount
+ * point.  Files directly in the mount point are always watched.
+ *
+ * The directory may not exist yet, in which case changes to the file are
+ * not noticed until it is re-added.
+ */
+static void watch_add_parent(int dir_fd, const char *const path)
+{
+	if (!writeback_enabled) {
+		return;
+	}
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL || slash == path || (size_t)(slash - path) >= PATH_MAX) {
+		return;
+	}
+	char prefix[PATH_MAX];
+	memcpy(prefix, path, slash - path);
+	prefix[slash - path] = '\0';
+	(void)watch_add(dir_fd, prefix);
+}
+
+static void watch_event(int wd, const char *const name)
+{
+	char path[PATH_MAX];
+	int found = 0;
+	pthread_mutex_lock(&page_cache_lock);
+	for (size_t i = 0; i < watch_cnt; i++) {
+		if (watches[i].wd == wd) {
+			int s = snprintf(path, sizeof(path), "%s/%s", watches[i].prefix, name);
+			found = s >= 0 && s < (int)sizeof(path);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&page_cache_lock);
+	if (!found) {
+		return;
+	}
+
+	if (strchr(path + 1, '/') == NULL) {
+		page_cache_invalidate(name);
+	}
+
+	if (writeback_enabled) {
+		pthread_rwlock_rdlock(&cfg_lock);
+		int shared = is_shared_path(path);
+		pthread_rwlock_unlock(&cfg_lock);
+		if (shared) {
+			writeback_invalidate(path);
+		}
+	}
+}
+
+static void *page_cache_watch(void *arg)
+{
+	(void)arg;
+
+	union {
+		struct inotify_event event;
+		char buf[PATH_MAX];
+	} u;
+
+	for (;;) {
+		ssize_t len = read(inotify_fd, u.buf, sizeof(u.buf));
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			break;
+		}
+		for (char *p = u.buf; p < u.buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->mask & IN_Q_OVERFLOW) {
+				page_cache_invalidate_all();
+				if (writeback_enabled) {
+					writeback_invalidate_all();
+				}
+			} else if (event->len > 0) {
+				watch_event(event->wd, event->name);
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	/*
+	 * Without notifications the kernel's pages could go stale.  Stop
+	 * retaining them.
+	 */
+	page_cache_enabled = 0;
+	page_cache_invalidate_all();
+	return NULL;
+}
+
+/*
+ * Watch the underlying directories for changes and, if successful, enable
+ * page cache retention.
+ */
+static void page_cache_start(void)
+{
+	if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		return;
+	}
+
+	if (watch_add(global_ref_fd, "") < 0 || watch_add(local_ref_fd, "") < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return;
+	}
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	if (pthread_attr_init(&attr) != 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return;
+	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	page_cache_enabled = 1;
+	if (pthread_create(&thread, &attr, page_cache_watch, NULL) != 0) {
+		page_cache_enabled = 0;
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * With writeback caching the kernel may read from a file opened write-only to
+ * fill partial pages, and it handles O_APPEND itself.  Shared files bypass
+ * the page cache entirely.  This includes read-only opens, and thus page cache
+ * retention (see page_cache_keep()) does not apply to shared files such as
+ * passwd and hosts in writeback mode.
+ *
+ * Returns the flags with which to open the underlying file.
+ */
+static inline int writeback_open_flags(const char *const path, struct fuse_file_info *fi)
+{
+	if (!writeback_enabled) {
+		return fi->flags;
+	}
+	if (is_shared_path(path)) {
+		fi->direct_io = 1;
+		return fi->flags;
+	}
+	int flags = fi->flags & ~O_APPEND;
+	if ((flags & O_ACCMODE) == O_WRONLY) {
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	}
+	return flags;
+}
+
+/*
+ * If the caller may write but not read a file, fall back to bypassing the
+ * page cache for it.
+ */
+static inline int writeback_openat(int ref_fd, const char *const rpath, const char *const path,
+	struct fuse_file_info *fi, mode_t mode)
+{
+	int flags = writeback_open_flags(path, fi);
+	int fd = openat(ref_fd, rpath, O_NONBLOCK | flags, mode);
+	if (fd < 0 && errno == EACCES && flags != fi->flags) {
+		fi->direct_io = 1;
+		fd = openat(ref_fd, rpath, O_NONBLOCK | fi->flags, mode);
+	}
+	return fd;
+}
+
+/*
+ * Whether reads and writes should go through the file descriptor from open()
+ * rather than re-opening the file.  With writeback caching, writes may be
+ * flushed by the kernel well after the caller's write() and without the
+ * caller's credentials.
+ */
+static inline int writeback_use_fh(const char *const path, struct fuse_file_info *fi)
+{
+	return writeback_enabled && fi != NULL && (int)fi->fh >= 0 && !is_shared_path(path);
+}
+
 /*
  * Ensure a given file path contains a specific string.
  */
@@ -838,9 +1499,17 @@ static int cfg_add_global(const char *const buf, size_t size)
 	}
 	strcpy(global, buf_global);
 
+	int rv = glob_insert(global);
+	if (rv < 0) {
+		free(global);
+		return rv;
+	}
+
 	globals[global_cnt] = global;
 	global_cnt++;
 
+	watch_add_parent(global_ref_fd, global);
+
 	cfg_stat.st_size += strlen("global ") + strlen(global) + strlen("\n");
 
 	return size;
@@ -896,6 +1565,8 @@ static int cfg_rm_global(const char *const buf, size_t size)
 		globals[i] = globals[global_cnt];
 	}
 
+	glob_rebuild();
+
 	return size;
 }
 
@@ -1037,6 +1708,8 @@ static int cfg_add_override(const char *const buf, size_t size)
 	overrides[override_cnt].last_override = 0;
 	override_cnt++;
 
+	watch_add_parent(local_ref_fd, path);
+
 	cfg_stat.st_size += strlen("override ") + strlen(o_type_str[type]) +
 		strlen(" ") + strlen(path) + strlen(" ") + strlen(content) + strlen("\n");
 
@@ -1152,8 +1825,6 @@ static int cfg_read(char *buf, size_t size, off_t offset)
 
 static void *m_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-	(void)conn;
-
 	/*
 	 * Do not allow requests to be interrupted.
 	 */
@@ -1176,6 +1847,23 @@ static void *m_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 	cfg->attr_timeout = 0;
 	cfg->negative_timeout = 0;
 
+	/*
+	 * Retain the page cache for unchanged files across opens.  This is
+	 * started here rather than in main() as fuse_main() may fork to
+	 * daemonize and threads do not survive a fork.
+	 */
+	fuse_handle = fuse_get_context()->fuse;
+	page_cache_start();
+
+	/*
+	 * Let the kernel batch writes, if requested.  Keeping shared files
+	 * coherent relies on inotify.
+	 */
+	if (writeback_requested && inotify_fd >= 0 && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		writeback_enabled = 1;
+	}
+
 	return NULL;
 }
 
@@ -1284,11 +1972,8 @@ static int m_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
 			if (s < 0 || s >= (int)sizeof(full_path)) {
 				continue;
 			}
-			for (size_t i = 0; i < global_cnt; i++) {
-				if (strcmp(full_path, globals[i]) == 0) {
-					filler(buf, dir->d_name, NULL, 0, 0);
-					break;
-				}
+			if (glob_match(full_path)) {
+				filler(buf, dir->d_name, NULL, 0, 0);
 			}
 		}
 		closedir(d);
@@ -1331,13 +2016,7 @@ static int m_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
 			if (s < 0 || s >= (int)sizeof(full_path)) {
 				continue;
 			}
-			int is_global = 0;
-			for (size_t i = 0; i < global_cnt; i++) {
-				if (strcmp(full_path, globals[i]) == 0) {
-					is_global = 1;
-					break;
-				}
-			}
+			int is_global = glob_match(full_path);
 			int is_override = 0;
 			for (size_t i = 0; i < override_cnt; i++) {
 				if (overrides[i].type == TYPE_INJECT) {
@@ -1697,7 +2376,7 @@ static int m_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	FS_IMP_SETUP(path);
 	DISALLOW_ON_CFG(rpath);
 
-	int fd = openat(ref_fd, rpath, O_NONBLOCK | fi->flags, mode);
+	int fd = writeback_openat(ref_fd, rpath, path, fi, mode);
 	if (fd < 0) {
 		rv = -1;
 	} else {
@@ -1723,13 +2402,14 @@ static int m_open(const char *path, struct fuse_file_info *fi)
 			rv = 0;
 		}
 	} else {
-		int fd = openat(ref_fd, rpath, O_NONBLOCK | fi->flags);
+		int fd = writeback_openat(ref_fd, rpath, path, fi, 0);
 		if (fd < 0) {
 			rv = -1;
 			fi->fh = -1;
 		} else {
 			rv = 0;
 			fi->fh = fd;
+			fi->keep_cache = page_cache_keep(path, fd, fi->flags);
 		}
 	}
 
@@ -1738,8 +2418,6 @@ static int m_open(const char *path, struct fuse_file_info *fi)
 
 static int m_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;
-
 	DEBUG("m_read", path);
 	FS_IMP_SETUP(path);
 
@@ -1751,6 +2429,8 @@ static int m_read(const char *path, char *buf, size_t size, off_t offset, struct
 			rv = -1;
 			errno = EACCES;
 		}
+	} else if (writeback_use_fh(path, fi)) {
+		rv = pread(fi->fh, buf, size, offset);
 	} else {
 		int fd = openat(ref_fd, rpath, O_NONBLOCK | O_RDONLY | O_NOFOLLOW);
 		if (fd >= 0) {
@@ -1766,9 +2446,6 @@ static int m_read(const char *path, char *buf, size_t size, off_t offset, struct
 
 static int m_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;
-	(void)fi;
-
 	DEBUG("m_write", path);
 	FS_IMP_SETUP(path);
 
@@ -1793,6 +2470,8 @@ static int m_write(const char *path, const char *buf, size_t size, off_t offset,
 		}
 		pthread_rwlock_unlock(&cfg_lock);
 		pthread_rwlock_rdlock(&cfg_lock);
+	} else if (writeback_use_fh(path, fi)) {
+		rv = pwrite(fi->fh, buf, size, offset);
 	} else {
 		int fd = openat(ref_fd, rpath, O_NONBLOCK | O_WRONLY | O_NOFOLLOW);
 		if (fd >= 0) {
@@ -1940,6 +2619,16 @@ static int m_getxattr(const char *path, const char *name, char *value, size_t si
 			rv = strlen(ROOTDIR);
 			strcpy(value, ROOTDIR);
 		}
+	} else if (strcmp(rpath, CFG_NAME) == 0 && strcmp(FEATURES_XATTR, name) == 0) {
+		if (size <= 0) {
+			rv = strlen(FEATURES);
+		} else if (size < strlen(FEATURES)) {
+			rv = -1;
+			errno = ERANGE;
+		} else {
+			rv = strlen(FEATURES);
+			strcpy(value, FEATURES);
+		}
 	} else if (strcmp(rpath, CFG_NAME) == 0) {
 		rv = -1;
 		errno = ENODATA;
@@ -2126,6 +2815,15 @@ static struct fuse_operations m_oper = {
 	.flock = m_flock,
 };
 
+/*
+ * etcfs-specific mount options.  `-o writeback_cache` sets
+ * writeback_requested.
+ */
+static const struct fuse_opt option_spec[] = {
+	{ "writeback_cache", 0, 1 },
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[])
 {
 	/*
@@ -2138,15 +2836,21 @@ int main(int argc, char *argv[])
 	}
 
 	/*
-	 * Extract mount point from arguments
+	 * Extract etcfs-specific options.  The remaining arguments are passed
+	 * to libfuse.
 	 */
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	if (fuse_opt_parse(&args, NULL, NULL, NULL) < 0) {
+	if (fuse_opt_parse(&args, &writeback_requested, option_spec, NULL) < 0) {
 		fprintf(stderr, "error: unable to parse arguments.\n");
 		return 1;
 	}
+
+	/*
+	 * Extract mount point from arguments
+	 */
+	struct fuse_args cmdline_args = FUSE_ARGS_INIT(args.argc, args.argv);
 	struct fuse_cmdline_opts opts;
-	if (fuse_parse_cmdline(&args, &opts) < 0) {
+	if (fuse_parse_cmdline(&cmdline_args, &opts) < 0) {
 		fprintf(stderr, "error: unable to parse arguments.\n");
 		return 1;
 	}
@@ -2184,9 +2888,9 @@ int main(int argc, char *argv[])
 	}
 
 	/*
-	 * Initialize mutex
+	 * Initialize mutexes
 	 */
-	if (pthread_rwlock_init(&cfg_lock, NULL) < 0) {
+	if (pthread_rwlock_init(&cfg_lock, NULL) < 0 || pthread_mutex_init(&page_cache_lock, NULL) < 0) {
 		fprintf(stderr, "error: initializing mutexes\n");
 		return 1;
 	}
@@ -2212,5 +2916,5 @@ int main(int argc, char *argv[])
 	 * Incoming filesystem calls will be fulfilled by the functions listed
 	 * in m_oper above.
 	 */
-	return fuse_main(argc, argv, &m_oper, NULL);
+	return fuse_main(args.argc, args.argv, &m_oper, NULL);
 }
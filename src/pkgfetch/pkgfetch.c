@@ -0,0 +1,978 @@
+/*
+ * pkgfetch.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program downloads a list of files, such as the packages `brl fetch`
+ * needs to bootstrap a stratum, and verifies their checksums.
+ *
+ * Spawning a curl process per package costs a TCP and TLS handshake and at
+ * least one round trip per package, which dominates when fetching hundreds of
+ * small packages from a distant mirror.  Instead, this program uses a single
+ * libcurl multi handle to run a bounded number of transfers concurrently.
+ * libcurl keeps connections alive between transfers and multiplexes transfers
+ * over a single connection where the server supports HTTP/2.
+ *
+ * Checksums are computed as data arrives, such that no second pass over the
+ * downloaded file is needed.  Files are downloaded to a temporary name and
+ * only moved into place once their checksum is verified, such that a file at
+ * the final name is always complete.
+ *
+ * Input is read from stdin, one file per line, as tab-separated fields:
+ *
+ *     <url>	<checksum command>	<checksum>[	<name>]
+ *
+ * where the checksum command is the name of the coreutils-style tool which
+ * would produce the checksum, e.g. `sha256sum`.  This is the format
+ * `brl fetch` distro back-ends already provide to checksum_downloads().  The
+ * file is saved as <name> if provided, otherwise as the last component of the
+ * URL.
+ *
+ * Re-verifying cached files would otherwise mean re-reading hundreds of
+ * megabytes each time a distro is fetched.  Instead, an index in the download
+ * directory records the size, modification time, and inode number of each
+ * file at the time its checksum was last verified.  Files which still match
+ * their index entry are trusted without being read.  Files which do not are
+ * re-hashed, in parallel across all CPUs.  The index is a cache: if it is
+ * missing or stale the only cost is re-hashing.
+ *
+ * With -P, this program instead probes mirrors: it fetches the given URLs
+ * concurrently, each under a deadline, and ranks those which succeed by
+ * time-to-first-byte and throughput.  This lets `brl fetch` pick a mirror
+ * without waiting on dead ones one at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Default and maximum number of concurrent transfers.
+ */
+#define DEFAULT_JOBS 8
+#define MAX_JOBS 64
+
+/*
+ * Number of times to attempt a transfer before giving up.  Checksum
+ * mismatches are not retried.
+ */
+#define MAX_TRIES 3
+
+/*
+ * Upper bound on threads used to hash cached files.
+ */
+#define MAX_HASH_THREADS 64
+
+#define HASH_BUF_SIZE (128 * 1024)
+
+/*
+ * Default per-probe deadline in seconds.
+ */
+#define DEFAULT_PROBE_TIMEOUT 5
+
+/*
+ * Probes are ranked by the estimated time to fetch a file of this size: the
+ * time to first byte plus this size over the measured throughput.
+ */
+#define PROBE_REF_SIZE (1024.0 * 1024.0)
+
+/*
+ * Verified checksum index, stored in the download directory.  One line per
+ * file:
+ *
+ *     <size> <mtime seconds>.<mtime nanoseconds> <inode> <checksum command> <checksum> <name>
+ */
+#define INDEX_NAME ".pkgfetch-index"
+
+struct index_entry {
+	char *name;
+	char *cmd;
+	char *digest;
+	long long size;
+	long long mtime_sec;
+	long mtime_nsec;
+	unsigned long long ino;
+};
+
+struct job {
+	char *url;
+	char *name;
+	char *path;
+	char *tmp_path;
+	char *cmd;
+	const EVP_MD *md;
+	char *checksum;
+	int fd;
+	int tries;
+	/*
+	 * Set if the file is present with the expected checksum, either from
+	 * a previous run or once downloaded.  stbuf then holds the file's
+	 * metadata for the index.
+	 */
+	int verified;
+	struct stat stbuf;
+	EVP_MD_CTX *ctx;
+	CURL *curl;
+	char errbuf[CURL_ERROR_SIZE];
+};
+
+static struct job *jobs = NULL;
+static size_t job_cnt = 0;
+static size_t job_alloc = 0;
+
+static struct index_entry *index_entries = NULL;
+static size_t index_cnt = 0;
+static size_t index_alloc = 0;
+
+/*
+ * Cached files which need to be re-hashed.  Worker threads take from this
+ * list by atomically incrementing hash_next.
+ */
+static struct job **hash_list = NULL;
+static size_t hash_cnt = 0;
+static size_t hash_next = 0;
+
+struct probe {
+	char *url;
+	CURL *curl;
+	int ok;
+	double ttfb;
+	double speed;
+	double score;
+};
+
+static const char *cacert = NULL;
+static int progress = 0;
+
+static void *xmalloc(size_t size)
+{
+	void *ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "pkgfetch: unable to allocate memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static char *xstrdup(const char *str)
+{
+	char *ptr = strdup(str);
+	if (ptr == NULL) {
+		fprintf(stderr, "pkgfetch: unable to allocate memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+/*
+ * Map a checksum command such as `sha256sum` to an OpenSSL digest.
+ */
+static const EVP_MD *lookup_md(const char *cmd)
+{
+	if (strcmp(cmd, "md5sum") == 0) {
+		return EVP_md5();
+	} else if (strcmp(cmd, "sha1sum") == 0) {
+		return EVP_sha1();
+	} else if (strcmp(cmd, "sha224sum") == 0) {
+		return EVP_sha224();
+	} else if (strcmp(cmd, "sha256sum") == 0) {
+		return EVP_sha256();
+	} else if (strcmp(cmd, "sha384sum") == 0) {
+		return EVP_sha384();
+	} else if (strcmp(cmd, "sha512sum") == 0) {
+		return EVP_sha512();
+	} else if (strcmp(cmd, "b2sum") == 0) {
+		return EVP_blake2b512();
+	}
+	return NULL;
+}
+
+static void finish_digest(EVP_MD_CTX *ctx, char *hex)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_DigestFinal_ex(ctx, digest, &len);
+	for (unsigned int i = 0; i < len; i++) {
+		sprintf(hex + i * 2, "%02x", digest[i]);
+	}
+	hex[len * 2] = '\0';
+}
+
+static int hash_file(const char *path, const EVP_MD *md, char *buf, char *hex)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, md, NULL);
+	ssize_t n;
+	while ((n = read(fd, buf, HASH_BUF_SIZE)) > 0) {
+		EVP_DigestUpdate(ctx, buf, n);
+	}
+	close(fd);
+
+	finish_digest(ctx, hex);
+	EVP_MD_CTX_free(ctx);
+	return n < 0 ? -1 : 0;
+}
+
+static int stat_matches(const struct stat *stbuf, const struct index_entry *entry)
+{
+	return S_ISREG(stbuf->st_mode)
+	    && (long long)stbuf->st_size == entry->size
+	    && (long long)stbuf->st_mtim.tv_sec == entry->mtime_sec
+	    && stbuf->st_mtim.tv_nsec == entry->mtime_nsec && (unsigned long long)stbuf->st_ino == entry->ino;
+}
+
+static struct index_entry *index_lookup(const char *name)
+{
+	for (size_t i = 0; i < index_cnt; i++) {
+		if (strcmp(index_entries[i].name, name) == 0) {
+			return &index_entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void load_index(const char *dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, INDEX_NAME);
+	FILE *fp = fopen(path, "re");
+	if (fp == NULL) {
+		return;
+	}
+
+	char *line = NULL;
+	size_t line_alloc = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_alloc, fp)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		struct index_entry entry;
+		char cmd[32];
+		char digest[EVP_MAX_MD_SIZE * 2 + 1];
+		int name_off = 0;
+		if (sscanf(line, "%lld %lld.%ld %llu %31s %128s %n", &entry.size, &entry.mtime_sec,
+				&entry.mtime_nsec, &entry.ino, cmd, digest, &name_off) != 6 || name_off == 0
+				|| line[name_off] == '\0') {
+			/*
+			 * Corrupt or from an incompatible version; ignore.
+			 */
+			continue;
+		}
+		if (index_cnt == index_alloc) {
+			index_alloc = index_alloc ? index_alloc * 2 : 256;
+			struct index_entry *new_entries = realloc(index_entries, index_alloc * sizeof(struct index_entry));
+			if (new_entries == NULL) {
+				fprintf(stderr, "pkgfetch: unable to allocate memory\n");
+				exit(1);
+			}
+			index_entries = new_entries;
+		}
+		entry.name = xstrdup(line + name_off);
+		entry.cmd = xstrdup(cmd);
+		entry.digest = xstrdup(digest);
+		index_entries[index_cnt++] = entry;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Write out the index: entries for files verified this run, plus previous
+ * entries for other files which are still unchanged.
+ */
+static void save_index(const char *dir)
+{
+	char path[PATH_MAX];
+	char new_path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, INDEX_NAME);
+	snprintf(new_path, sizeof(new_path), "%s/%s.new", dir, INDEX_NAME);
+
+	FILE *fp = fopen(new_path, "we");
+	if (fp == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < job_cnt; i++) {
+		struct job *job = &jobs[i];
+		if (job->verified) {
+			fprintf(fp, "%lld %lld.%09ld %llu %s %s %s\n", (long long)job->stbuf.st_size,
+				(long long)job->stbuf.st_mtim.tv_sec, job->stbuf.st_mtim.tv_nsec,
+				(unsigned long long)job->stbuf.st_ino, job->cmd, job->checksum, job->name);
+		}
+	}
+
+	for (size_t i = 0; i < index_cnt; i++) {
+		struct index_entry *entry = &index_entries[i];
+		int superseded = 0;
+		for (size_t j = 0; j < job_cnt && !superseded; j++) {
+			superseded = strcmp(jobs[j].name, entry->name) == 0;
+		}
+		char file_path[PATH_MAX];
+		struct stat stbuf;
+		snprintf(file_path, sizeof(file_path), "%s/%s", dir, entry->name);
+		if (!superseded && stat(file_path, &stbuf) == 0 && stat_matches(&stbuf, entry)) {
+			fprintf(fp, "%lld %lld.%09ld %llu %s %s %s\n", entry->size, entry->mtime_sec,
+				entry->mtime_nsec, entry->ino, entry->cmd, entry->digest, entry->name);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(new_path, path) < 0) {
+		unlink(new_path);
+	}
+}
+
+static void *hash_worker(void *arg)
+{
+	(void)arg;
+	char *buf = xmalloc(HASH_BUF_SIZE);
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&hash_next, 1, __ATOMIC_RELAXED);
+		if (i >= hash_cnt) {
+			break;
+		}
+		struct job *job = hash_list[i];
+		if (hash_file(job->path, job->md, buf, hex) == 0 && strcasecmp(hex, job->checksum) == 0) {
+			job->verified = 1;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Determine which files are already present with the expected checksum,
+ * consulting the index and hashing those not found in it in parallel.
+ */
+static void verify_cached(void)
+{
+	hash_list = xmalloc((job_cnt ? job_cnt : 1) * sizeof(struct job *));
+	for (size_t i = 0; i < job_cnt; i++) {
+		struct job *job = &jobs[i];
+		struct stat stbuf;
+		if (stat(job->path, &stbuf) < 0 || !S_ISREG(stbuf.st_mode)) {
+			continue;
+		}
+		struct index_entry *entry = index_lookup(job->name);
+		if (entry != NULL && stat_matches(&stbuf, entry) && strcmp(entry->cmd, job->cmd) == 0
+			&& strcasecmp(entry->digest, job->checksum) == 0) {
+			job->verified = 1;
+		} else {
+			hash_list[hash_cnt++] = job;
+		}
+	}
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > (long)hash_cnt) {
+		threads = hash_cnt;
+	}
+	if (threads > MAX_HASH_THREADS) {
+		threads = MAX_HASH_THREADS;
+	}
+	pthread_t workers[MAX_HASH_THREADS];
+	long started = 0;
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, hash_worker, NULL) != 0) {
+			break;
+		}
+	}
+	/*
+	 * Help out, which also covers the case where no threads could be
+	 * created.
+	 */
+	hash_worker(NULL);
+	for (long i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	for (size_t i = 0; i < job_cnt; i++) {
+		struct job *job = &jobs[i];
+		if (!job->verified) {
+			continue;
+		}
+		/*
+		 * Update timestamp such that cache cleanup sees it as recently
+		 * used, then record the new timestamp in the index.
+		 */
+		utimensat(AT_FDCWD, job->path, NULL, 0);
+		if (stat(job->path, &job->stbuf) < 0) {
+			job->verified = 0;
+		}
+	}
+}
+
+static void add_job(const char *dir, char *line)
+{
+	char *url = line;
+	char *cmd = strchr(url, '\t');
+	char *checksum = cmd ? strchr(cmd + 1, '\t') : NULL;
+	if (checksum == NULL) {
+		fprintf(stderr, "pkgfetch: malformed input line \"%s\"\n", line);
+		exit(1);
+	}
+	*cmd++ = '\0';
+	*checksum++ = '\0';
+	char *name = strchr(checksum, '\t');
+	if (name != NULL) {
+		*name++ = '\0';
+	}
+
+	const EVP_MD *md = lookup_md(cmd);
+	if (md == NULL) {
+		fprintf(stderr, "pkgfetch: unsupported checksum command \"%s\"\n", cmd);
+		exit(1);
+	}
+
+	if (name == NULL) {
+		name = strrchr(url, '/');
+		name = name ? name + 1 : url;
+	}
+	if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL) {
+		fprintf(stderr, "pkgfetch: unable to determine file name for \"%s\"\n", url);
+		exit(1);
+	}
+
+	if (job_cnt == job_alloc) {
+		job_alloc = job_alloc ? job_alloc * 2 : 256;
+		struct job *new_jobs = realloc(jobs, job_alloc * sizeof(struct job));
+		if (new_jobs == NULL) {
+			fprintf(stderr, "pkgfetch: unable to allocate memory\n");
+			exit(1);
+		}
+		jobs = new_jobs;
+	}
+
+	struct job *job = &jobs[job_cnt++];
+	memset(job, 0, sizeof(*job));
+	job->url = xstrdup(url);
+	job->name = xstrdup(name);
+	job->cmd = xstrdup(cmd);
+	job->md = md;
+	job->checksum = xstrdup(checksum);
+	job->fd = -1;
+	job->path = xmalloc(strlen(dir) + strlen(name) + 2);
+	sprintf(job->path, "%s/%s", dir, name);
+	job->tmp_path = xmalloc(strlen(dir) + strlen(name) + 8);
+	sprintf(job->tmp_path, "%s/.%s.part", dir, name);
+}
+
+static size_t write_cb(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	struct job *job = userdata;
+	size_t len = size * nmemb;
+
+	EVP_DigestUpdate(job->ctx, data, len);
+	for (size_t w = 0; w < len;) {
+		ssize_t n = write(job->fd, data + w, len - w);
+		if (n < 0) {
+			/*
+			 * Returning a short count aborts the transfer with
+			 * CURLE_WRITE_ERROR.
+			 */
+			return 0;
+		}
+		w += n;
+	}
+	return len;
+}
+
+static int start_job(CURLM *multi, struct job *job)
+{
+	job->tries++;
+	job->fd = open(job->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (job->fd < 0) {
+		fprintf(stderr, "pkgfetch: unable to create \"%s\": %s\n", job->tmp_path, strerror(errno));
+		return -1;
+	}
+	if (job->ctx == NULL) {
+		job->ctx = EVP_MD_CTX_new();
+	}
+	EVP_DigestInit_ex(job->ctx, job->md, NULL);
+
+	if (job->curl == NULL) {
+		job->curl = curl_easy_init();
+		if (job->curl == NULL) {
+			fprintf(stderr, "pkgfetch: unable to initialize transfer\n");
+			return -1;
+		}
+	}
+	CURL *curl = job->curl;
+	curl_easy_setopt(curl, CURLOPT_URL, job->url);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, job);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, job);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, job->errbuf);
+	/*
+	 * Prefer waiting for an existing HTTP/2 connection to multiplex over
+	 * rather than opening a new one.
+	 */
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	/*
+	 * Abort transfers which stall rather than hang indefinitely.
+	 */
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+	if (cacert != NULL) {
+		curl_easy_setopt(curl, CURLOPT_CAINFO, cacert);
+	}
+	job->errbuf[0] = '\0';
+
+	if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+		fprintf(stderr, "pkgfetch: unable to start transfer of %s\n", job->url);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Handle a completed transfer.  Returns 1 if it should be retried, 0 if it is
+ * done, and -1 on a fatal error.
+ */
+static int finish_job(struct job *job, CURLcode result)
+{
+	int fsync_err = fsync(job->fd);
+	close(job->fd);
+	job->fd = -1;
+
+	if (result != CURLE_OK) {
+		unlink(job->tmp_path);
+		long code = 0;
+		curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &code);
+		/*
+		 * Retry network errors and server errors, but not client
+		 * errors such as a 404 or local write failures.
+		 */
+		if (job->tries < MAX_TRIES && result != CURLE_WRITE_ERROR && (code < 400 || code >= 500)) {
+			return 1;
+		}
+		fprintf(stderr, "pkgfetch: unable to download %s: %s\n", job->url,
+			job->errbuf[0] ? job->errbuf : curl_easy_strerror(result));
+		return -1;
+	}
+
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+	finish_digest(job->ctx, hex);
+	if (strcasecmp(hex, job->checksum) != 0) {
+		unlink(job->tmp_path);
+		fprintf(stderr, "pkgfetch: %s does not have expected checksum %s\n", job->url, job->checksum);
+		return -1;
+	}
+
+	if (fsync_err < 0 || rename(job->tmp_path, job->path) < 0) {
+		fprintf(stderr, "pkgfetch: unable to store \"%s\": %s\n", job->path, strerror(errno));
+		unlink(job->tmp_path);
+		return -1;
+	}
+	job->verified = stat(job->path, &job->stbuf) == 0;
+	return 0;
+}
+
+static void report_progress(void)
+{
+	if (progress) {
+		fputs("x\n", stdout);
+		fflush(stdout);
+	}
+}
+
+static size_t discard_cb(char *data, size_t size, size_t nmemb, void *userdata)
+{
+	(void)data;
+	(void)userdata;
+	return size * nmemb;
+}
+
+static int compare_probes(const void *a, const void *b)
+{
+	const struct probe *pa = a;
+	const struct probe *pb = b;
+	if (pa->ok != pb->ok) {
+		return pb->ok - pa->ok;
+	}
+	return (pa->score > pb->score) - (pa->score < pb->score);
+}
+
+/*
+ * Probe URLs read from stdin, one per line.  Print those which succeed, best
+ * first, as
+ *
+ *     <score> <time to first byte> <bytes per second> <url>
+ */
+static int probe_urls(long max_jobs, long timeout)
+{
+	struct probe *probes = NULL;
+	size_t probe_cnt = 0;
+	size_t probe_alloc = 0;
+
+	char *line = NULL;
+	size_t line_alloc = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_alloc, stdin)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (probe_cnt == probe_alloc) {
+			probe_alloc = probe_alloc ? probe_alloc * 2 : 64;
+			struct probe *new_probes = realloc(probes, probe_alloc * sizeof(struct probe));
+			if (new_probes == NULL) {
+				fprintf(stderr, "pkgfetch: unable to allocate memory\n");
+				exit(1);
+			}
+			probes = new_probes;
+		}
+		memset(&probes[probe_cnt], 0, sizeof(struct probe));
+		probes[probe_cnt++].url = xstrdup(line);
+	}
+	free(line);
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+		fprintf(stderr, "pkgfetch: unable to initialize libcurl\n");
+		return 1;
+	}
+	CURLM *multi = curl_multi_init();
+	if (multi == NULL) {
+		fprintf(stderr, "pkgfetch: unable to initialize libcurl\n");
+		return 1;
+	}
+
+	size_t next = 0;
+	long running = 0;
+	for (;;) {
+		while (next < probe_cnt && running < max_jobs) {
+			struct probe *probe = &probes[next++];
+			probe->curl = curl_easy_init();
+			if (probe->curl == NULL) {
+				continue;
+			}
+			curl_easy_setopt(probe->curl, CURLOPT_URL, probe->url);
+			curl_easy_setopt(probe->curl, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(probe->curl, CURLOPT_FAILONERROR, 1L);
+			curl_easy_setopt(probe->curl, CURLOPT_WRITEFUNCTION, discard_cb);
+			curl_easy_setopt(probe->curl, CURLOPT_PRIVATE, probe);
+			curl_easy_setopt(probe->curl, CURLOPT_TIMEOUT, timeout);
+			if (cacert != NULL) {
+				curl_easy_setopt(probe->curl, CURLOPT_CAINFO, cacert);
+			}
+			if (curl_multi_add_handle(multi, probe->curl) != CURLM_OK) {
+				curl_easy_cleanup(probe->curl);
+				probe->curl = NULL;
+				continue;
+			}
+			running++;
+		}
+		if (running == 0) {
+			break;
+		}
+
+		int still_running;
+		if (curl_multi_perform(multi, &still_running) != CURLM_OK) {
+			fprintf(stderr, "pkgfetch: transfer error\n");
+			break;
+		}
+
+		CURLMsg *msg;
+		int msgs_left;
+		while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			char *priv;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+			struct probe *probe = (struct probe *)priv;
+			if (msg->data.result == CURLE_OK) {
+				curl_off_t ttfb = 0;
+				curl_off_t speed = 0;
+				curl_easy_getinfo(probe->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+				curl_easy_getinfo(probe->curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+				probe->ok = 1;
+				probe->ttfb = ttfb / 1000000.0;
+				probe->speed = speed;
+				probe->score = probe->ttfb + (speed > 0 ? PROBE_REF_SIZE / speed : 0);
+			}
+			curl_multi_remove_handle(multi, probe->curl);
+			curl_easy_cleanup(probe->curl);
+			probe->curl = NULL;
+			running--;
+		}
+
+		if (still_running > 0 && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+			fprintf(stderr, "pkgfetch: transfer error\n");
+			break;
+		}
+	}
+
+	qsort(probes, probe_cnt, sizeof(struct probe), compare_probes);
+	int found = 0;
+	for (size_t i = 0; i < probe_cnt && probes[i].ok; i++) {
+		printf("%.3f %.3f %.0f %s\n", probes[i].score, probes[i].ttfb, probes[i].speed, probes[i].url);
+		found = 1;
+	}
+	for (size_t i = 0; i < probe_cnt; i++) {
+		free(probes[i].url);
+	}
+	free(probes);
+
+	curl_multi_cleanup(multi);
+	curl_global_cleanup();
+	return found ? 0 : 1;
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: pkgfetch [options] <directory>\n"
+		"       pkgfetch -P [-j <N>] [-t <SECONDS>] [-c <FILE>]\n"
+		"\n"
+		"Download files listed on stdin into <directory>, verifying checksums.  Each\n"
+		"input line is of the form:\n"
+		"\n"
+		"    <url><tab><checksum command><tab><checksum>\n"
+		"\n"
+		"Files already present in <directory> with the expected checksum are not\n"
+		"downloaded again.  A fourth field may specify the file name to save as.\n"
+		"\n"
+		"Options:\n"
+		"  -j <N>     run up to N transfers concurrently (default: 8)\n"
+		"  -c <FILE>  use FILE as CA certificate bundle\n"
+		"  -n         do not download; exit non-zero if any file is not present with\n"
+		"             the expected checksum\n"
+		"  -p         print a line to stdout per file completed, for use with\n"
+		"             progress_bar\n"
+		"  -P         probe URLs listed on stdin, one per line, and print those which\n"
+		"             respond as \"<score> <time to first byte> <bytes/sec> <url>\",\n"
+		"             best first\n"
+		"  -t <N>     with -P, give up on a URL after N seconds (default: 5)\n"
+		"  -h         print this message\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long max_jobs = DEFAULT_JOBS;
+	int check_only = 0;
+	int probe = 0;
+	long timeout = DEFAULT_PROBE_TIMEOUT;
+
+	int c;
+	while ((c = getopt(argc, argv, "j:c:npPt:h")) != -1) {
+		switch (c) {
+		case 'j':
+			max_jobs = atol(optarg);
+			break;
+		case 'c':
+			cacert = optarg;
+			break;
+		case 'n':
+			check_only = 1;
+			break;
+		case 'p':
+			progress = 1;
+			break;
+		case 'P':
+			probe = 1;
+			break;
+		case 't':
+			timeout = atol(optarg);
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+	if (argc - optind != (probe ? 0 : 1)) {
+		print_help();
+		return 1;
+	}
+	if (max_jobs < 1) {
+		max_jobs = 1;
+	} else if (max_jobs > MAX_JOBS) {
+		max_jobs = MAX_JOBS;
+	}
+	if (timeout < 1) {
+		timeout = 1;
+	}
+	if (probe) {
+		return probe_urls(max_jobs, timeout);
+	}
+	const char *dir = argv[optind];
+
+	char *line = NULL;
+	size_t line_alloc = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_alloc, stdin)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len > 0) {
+			add_job(dir, line);
+		}
+	}
+	free(line);
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "pkgfetch: unable to create \"%s\": %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	load_index(dir);
+	verify_cached();
+	for (size_t i = 0; i < job_cnt; i++) {
+		if (jobs[i].verified) {
+			report_progress();
+		}
+	}
+	if (check_only) {
+		save_index(dir);
+		for (size_t i = 0; i < job_cnt; i++) {
+			if (!jobs[i].verified) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+		fprintf(stderr, "pkgfetch: unable to initialize libcurl\n");
+		return 1;
+	}
+	CURLM *multi = curl_multi_init();
+	if (multi == NULL) {
+		fprintf(stderr, "pkgfetch: unable to initialize libcurl\n");
+		return 1;
+	}
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_jobs);
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_jobs);
+
+	int failed = 0;
+	size_t next = 0;
+	long running = 0;
+	for (;;) {
+		/*
+		 * Keep up to max_jobs transfers in flight.
+		 */
+		while (!failed && next < job_cnt && running < max_jobs) {
+			struct job *job = &jobs[next++];
+			if (job->verified) {
+				continue;
+			}
+			if (start_job(multi, job) < 0) {
+				failed = 1;
+				break;
+			}
+			running++;
+		}
+		if (running == 0) {
+			break;
+		}
+
+		int still_running;
+		if (curl_multi_perform(multi, &still_running) != CURLM_OK) {
+			fprintf(stderr, "pkgfetch: transfer error\n");
+			failed = 1;
+			break;
+		}
+
+		CURLMsg *msg;
+		int msgs_left;
+		while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			char *priv;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+			struct job *job = (struct job *)priv;
+			CURLcode result = msg->data.result;
+			curl_multi_remove_handle(multi, job->curl);
+			running--;
+
+			switch (finish_job(job, result)) {
+			case 1:
+				if (start_job(multi, job) < 0) {
+					failed = 1;
+				} else {
+					running++;
+				}
+				break;
+			case 0:
+				report_progress();
+				break;
+			default:
+				failed = 1;
+				break;
+			}
+			/*
+			 * Connections are cached by the multi handle, not the
+			 * easy handle, such that the easy handle may be freed
+			 * without losing the connection for reuse.
+			 */
+			if (job->fd < 0) {
+				curl_easy_cleanup(job->curl);
+				job->curl = NULL;
+				EVP_MD_CTX_free(job->ctx);
+				job->ctx = NULL;
+			}
+		}
+
+		if (failed) {
+			break;
+		}
+		if (still_running > 0 && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+			fprintf(stderr, "pkgfetch: transfer error\n");
+			failed = 1;
+			break;
+		}
+	}
+
+	/*
+	 * On failure, abort outstanding transfers and remove partial files.
+	 */
+	for (size_t i = 0; i < job_cnt; i++) {
+		if (jobs[i].curl != NULL) {
+			curl_multi_remove_handle(multi, jobs[i].curl);
+			curl_easy_cleanup(jobs[i].curl);
+		}
+		if (jobs[i].fd >= 0) {
+			close(jobs[i].fd);
+			unlink(jobs[i].tmp_path);
+		}
+		EVP_MD_CTX_free(jobs[i].ctx);
+	}
+	curl_multi_cleanup(multi);
+	curl_global_cleanup();
+
+	save_index(dir);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,435 @@
+/*
+ * rmtree.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program removes the contents of a directory without crossing mount
+ * points or following symlinks.  It is intended to remove strata, where a
+ * mistake could remove files from another stratum or the host system.
+ *
+ * All filesystem calls are made relative to directory file descriptors
+ * (openat(), unlinkat()), such that nothing is resolved relative to the root
+ * or current working directory and no path component may be swapped out
+ * underneath us.  Every directory is opened with O_NOFOLLOW and checked with
+ * statx() to be on the same device and not be the root of a mount before it
+ * is entered.  Unlike `find -xdev`, the latter catches bind mounts from the
+ * same filesystem.
+ *
+ * Directories are processed in parallel.  Each worker thread has a deque of
+ * directories to scan.  A worker pushes subdirectories it finds onto its own
+ * deque and pops from the same end, such that it works depth-first and keeps
+ * few directories open.  Idle workers steal from the other end of other
+ * workers' deques, which tends to hold the largest remaining subtrees.
+ *
+ * A directory is removed once it has been scanned and all of its
+ * subdirectories have been removed.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef STATX_ATTR_MOUNT_ROOT
+#define STATX_ATTR_MOUNT_ROOT 0x00002000
+#endif
+
+/*
+ * Upper bound on worker threads.  Removal is bound by filesystem metadata
+ * updates; beyond a handful of threads there is little to gain.
+ */
+#define MAX_WORKERS 64
+
+/*
+ * Stop reporting individual errors after this many.
+ */
+#define MAX_REPORTED_ERRORS 16
+
+struct dir_task {
+	/*
+	 * Directory containing this one, or NULL for the top directory.
+	 */
+	struct dir_task *parent;
+	/*
+	 * File descriptor for this directory once it has been opened, -1
+	 * beforehand.
+	 */
+	int fd;
+	/*
+	 * Number of outstanding pieces of work which must complete before
+	 * this directory may be removed: one for its own scan plus one per
+	 * subdirectory.
+	 */
+	unsigned long pending;
+	/*
+	 * Name relative to parent.
+	 */
+	char name[];
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct dir_task **tasks;
+	size_t head;
+	size_t tail;
+	size_t alloc;
+};
+
+static struct deque deques[MAX_WORKERS];
+static int worker_cnt;
+
+/*
+ * Device containing the top directory.  Nothing on any other device is
+ * touched.
+ */
+static uint32_t dev_major;
+static uint32_t dev_minor;
+
+/*
+ * Idle workers wait here for more work or completion.
+ */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long queued = 0;
+static int done = 0;
+
+static unsigned long error_cnt = 0;
+static unsigned long skip_cnt = 0;
+
+static void report(const struct dir_task *task, const char *name, const char *msg, int err)
+{
+	unsigned long cnt = __atomic_fetch_add(&error_cnt, 1, __ATOMIC_RELAXED);
+	if (cnt < MAX_REPORTED_ERRORS) {
+		fprintf(stderr, "rmtree: %s \"%s\" in \"%s\": %s\n", msg, name, task->name, strerror(err));
+	} else if (cnt == MAX_REPORTED_ERRORS) {
+		fprintf(stderr, "rmtree: further errors suppressed\n");
+	}
+}
+
+static void push(int worker, struct dir_task *task)
+{
+	struct deque *d = &deques[worker];
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail - d->head == d->alloc) {
+		size_t new_alloc = d->alloc ? d->alloc * 2 : 64;
+		struct dir_task **new_tasks = malloc(new_alloc * sizeof(struct dir_task *));
+		if (new_tasks == NULL) {
+			pthread_mutex_unlock(&d->lock);
+			fprintf(stderr, "rmtree: unable to allocate memory\n");
+			exit(1);
+		}
+		for (size_t i = d->head; i < d->tail; i++) {
+			new_tasks[i - d->head] = d->tasks[i % d->alloc];
+		}
+		free(d->tasks);
+		d->tasks = new_tasks;
+		d->tail -= d->head;
+		d->head = 0;
+		d->alloc = new_alloc;
+	}
+	d->tasks[d->tail % d->alloc] = task;
+	d->tail++;
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_mutex_lock(&idle_lock);
+	queued++;
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Take a task from a deque.  The owner takes the most recently pushed task;
+ * thieves take the oldest.
+ */
+static struct dir_task *take(int worker, int steal)
+{
+	struct deque *d = &deques[worker];
+	struct dir_task *task = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head) {
+		if (steal) {
+			task = d->tasks[d->head % d->alloc];
+			d->head++;
+		} else {
+			d->tail--;
+			task = d->tasks[d->tail % d->alloc];
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (task != NULL) {
+		pthread_mutex_lock(&idle_lock);
+		queued--;
+		pthread_mutex_unlock(&idle_lock);
+	}
+	return task;
+}
+
+/*
+ * Mark one piece of work for the given directory complete.  If it was the
+ * last, remove the directory and propagate to its parent.
+ */
+static void finish(struct dir_task *task)
+{
+	while (task != NULL && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct dir_task *parent = task->parent;
+		if (task->fd >= 0) {
+			close(task->fd);
+		}
+		if (parent == NULL) {
+			pthread_mutex_lock(&idle_lock);
+			done = 1;
+			pthread_cond_broadcast(&idle_cond);
+			pthread_mutex_unlock(&idle_lock);
+		} else if (unlinkat(parent->fd, task->name, AT_REMOVEDIR) < 0) {
+			report(parent, task->name, "unable to remove directory", errno);
+		}
+		if (parent != NULL) {
+			free(task);
+		}
+		task = parent;
+	}
+}
+
+static struct dir_task *new_task(struct dir_task *parent, const char *name)
+{
+	size_t len = strlen(name);
+	struct dir_task *task = malloc(sizeof(struct dir_task) + len + 1);
+	if (task == NULL) {
+		fprintf(stderr, "rmtree: unable to allocate memory\n");
+		exit(1);
+	}
+	task->parent = parent;
+	task->fd = -1;
+	task->pending = 1;
+	memcpy(task->name, name, len + 1);
+	return task;
+}
+
+/*
+ * Ensure fd refers to a directory we may enter: on the same device as the top
+ * directory and not the root of a mount.
+ */
+static int check_same_mount(int fd)
+{
+	struct statx stx;
+	if (statx(fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) < 0) {
+		return -errno;
+	}
+	if (!S_ISDIR(stx.stx_mode)) {
+		return -ENOTDIR;
+	}
+	if (stx.stx_dev_major != dev_major || stx.stx_dev_minor != dev_minor) {
+		return -EXDEV;
+	}
+	if ((stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) && (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT)) {
+		return -EXDEV;
+	}
+	return 0;
+}
+
+/*
+ * Open a directory, unlink all of its non-directory contents, and queue its
+ * subdirectories.
+ */
+static void scan(int worker, struct dir_task *task)
+{
+	if (task->parent != NULL) {
+		task->fd = openat(task->parent->fd, task->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (task->fd < 0) {
+			report(task->parent, task->name, "unable to open directory", errno);
+			goto skip;
+		}
+		int err = check_same_mount(task->fd);
+		if (err == -EXDEV) {
+			__atomic_add_fetch(&skip_cnt, 1, __ATOMIC_RELAXED);
+			goto skip;
+		} else if (err < 0) {
+			report(task->parent, task->name, "unable to check directory", -err);
+			goto skip;
+		}
+	}
+
+	/*
+	 * fdopendir() takes ownership of its file descriptor.  Give it a
+	 * duplicate such that we can continue to use task->fd to remove
+	 * subdirectories after we're done reading.
+	 */
+	int dup_fd = dup(task->fd);
+	DIR *d;
+	if (dup_fd < 0 || (d = fdopendir(dup_fd)) == NULL) {
+		report(task, ".", "unable to read directory", errno);
+		if (dup_fd >= 0) {
+			close(dup_fd);
+		}
+		finish(task);
+		return;
+	}
+
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (dir->d_name[0] == '.' && (dir->d_name[1] == '\0'
+				|| (dir->d_name[1] == '.' && dir->d_name[2] == '\0'))) {
+			continue;
+		}
+
+		int is_dir = dir->d_type == DT_DIR;
+		if (dir->d_type == DT_UNKNOWN) {
+			struct stat stbuf;
+			if (fstatat(task->fd, dir->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+				report(task, dir->d_name, "unable to stat", errno);
+				continue;
+			}
+			is_dir = S_ISDIR(stbuf.st_mode);
+		}
+
+		if (is_dir) {
+			__atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+			push(worker, new_task(task, dir->d_name));
+		} else if (unlinkat(task->fd, dir->d_name, 0) < 0 && errno != ENOENT) {
+			report(task, dir->d_name, "unable to remove", errno);
+		}
+	}
+	closedir(d);
+
+	finish(task);
+	return;
+
+skip:
+	/*
+	 * Leave the directory in place.  The parent's removal will fail and
+	 * be reported.
+	 */
+	if (task->fd >= 0) {
+		close(task->fd);
+		task->fd = -1;
+	}
+	struct dir_task *parent = task->parent;
+	free(task);
+	finish(parent);
+}
+
+static void *worker_loop(void *arg)
+{
+	int worker = (int)(intptr_t)arg;
+
+	for (;;) {
+		struct dir_task *task = take(worker, 0);
+		for (int i = 1; task == NULL && i < worker_cnt; i++) {
+			task = take((worker + i) % worker_cnt, 1);
+		}
+		if (task != NULL) {
+			scan(worker, task);
+			continue;
+		}
+
+		pthread_mutex_lock(&idle_lock);
+		while (!done && queued == 0) {
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		}
+		int finished = done;
+		pthread_mutex_unlock(&idle_lock);
+		if (finished) {
+			return NULL;
+		}
+	}
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: rmtree [-j <threads>] <directory>\n"
+		"\n"
+		"Remove the contents of <directory> without crossing mount points or\n"
+		"following symlinks.  <directory> itself is left in place.  Anything on a\n"
+		"different mount is left in place and its parent directories are reported\n"
+		"as errors.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int c;
+	while ((c = getopt(argc, argv, "j:h")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atol(optarg);
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+	if (argc - optind != 1) {
+		print_help();
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > MAX_WORKERS) {
+		threads = MAX_WORKERS;
+	}
+	worker_cnt = threads;
+
+	struct dir_task *top = new_task(NULL, argv[optind]);
+	top->fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (top->fd < 0) {
+		fprintf(stderr, "rmtree: unable to open \"%s\": %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	struct statx stx;
+	struct statx root_stx;
+	if (statx(top->fd, "", AT_EMPTY_PATH, STATX_INO, &stx) < 0 || statx(AT_FDCWD, "/", 0, STATX_INO, &root_stx) < 0) {
+		fprintf(stderr, "rmtree: unable to stat \"%s\": %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (stx.stx_ino == root_stx.stx_ino && stx.stx_dev_major == root_stx.stx_dev_major
+		&& stx.stx_dev_minor == root_stx.stx_dev_minor) {
+		fprintf(stderr, "rmtree: refusing to remove contents of root directory\n");
+		return 1;
+	}
+	dev_major = stx.stx_dev_major;
+	dev_minor = stx.stx_dev_minor;
+
+	for (int i = 0; i < worker_cnt; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+	}
+	push(0, top);
+
+	pthread_t workers[MAX_WORKERS];
+	for (int i = 1; i < worker_cnt; i++) {
+		if (pthread_create(&workers[i], NULL, worker_loop, (void *)(intptr_t)i) != 0) {
+			fprintf(stderr, "rmtree: unable to create thread\n");
+			return 1;
+		}
+	}
+	worker_loop((void *)(intptr_t)0);
+	for (int i = 1; i < worker_cnt; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	if (skip_cnt > 0) {
+		fprintf(stderr, "rmtree: skipped %lu mount points\n", skip_cnt);
+	}
+	free(top);
+	return (error_cnt > 0 || skip_cnt > 0) ? 1 : 0;
+}
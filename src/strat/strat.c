@@ -17,10 +17,12 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
@@ -36,6 +38,34 @@
 #define CROSS_DIR_LEN strlen(CROSS_DIR)
 #define LOCAL_ALIAS "local"
 #define LOCAL_ALIAS_LEN strlen(LOCAL_ALIAS_LEN)
+#define REGISTRY_PATH "/bedrock/run/registry"
+
+/*
+ * brl publishes a summary of strata state to REGISTRY_PATH whenever it
+ * changes it.  This lets us answer the common questions here with a single
+ * mmap() rather than walking /bedrock/strata and /bedrock/run.  The format is
+ * one entry per line, fields separated by a single space:
+ *
+ *     generation <number>
+ *     stratum <name> <enabled, 0 or 1> <root st_dev> <root st_ino>
+ *     alias <alias> <stratum>
+ *     section restrict
+ *     restrict <command>
+ *
+ * "section restrict" indicates the restrict entries are complete, such that
+ * a command without one is not restricted.
+ * The file is replaced atomically via rename() and generation increases on
+ * every publication such that long-lived readers can detect changes.
+ *
+ * The registry is only a cache.  Anything not found in it, or which does not
+ * verify against the filesystem, falls back to the original lookups.
+ */
+struct registry {
+	const char *buf;
+	size_t len;
+};
+
+struct registry registry = { NULL, 0 };
 
 #ifdef MIN
 #undef MIN
@@ -231,6 +261,119 @@ int check_config_secure(char *config_path)
 	return 0;
 }
 
+/*
+ * Map the registry, if it exists and is secure.  On failure the registry is
+ * left empty, which causes all lookups against it to fail.
+ */
+void registry_open(void)
+{
+	if (check_config_secure(REGISTRY_PATH) < 0) {
+		return;
+	}
+
+	int fd = open(REGISTRY_PATH, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0 || !S_ISREG(stbuf.st_mode) || stbuf.st_uid != 0
+		|| (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0 || stbuf.st_size <= 0) {
+		close(fd);
+		return;
+	}
+
+	void *buf = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		return;
+	}
+
+	registry.buf = buf;
+	registry.len = stbuf.st_size;
+}
+
+/*
+ * Find the registry line of the given type whose first field is key.  Returns
+ * a pointer to the rest of the line and sets *len to its length, or returns
+ * NULL if there is no such line.  The returned string is not NUL terminated.
+ */
+const char *registry_find(const char *type, const char *key, size_t *len)
+{
+	size_t type_len = strlen(type);
+	size_t key_len = strlen(key);
+	const char *end = registry.buf + registry.len;
+
+	for (const char *line = registry.buf; line < end;) {
+		const char *nl = memchr(line, '\n', end - line);
+		if (nl == NULL) {
+			nl = end;
+		}
+		const char *rest = line + type_len + 1 + key_len;
+		if (rest <= nl && memcmp(line, type, type_len) == 0 && line[type_len] == ' '
+			&& memcmp(line + type_len + 1, key, key_len) == 0 && (rest == nl || *rest == ' ')) {
+			if (rest < nl) {
+				rest++;
+			}
+			*len = nl - rest;
+			return rest;
+		}
+		line = nl + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Dereference an alias via the registry.  On success, populates stratum,
+ * whether it is enabled, and the device and inode of its root directory.
+ *
+ * The result is verified against the filesystem such that an alias changed
+ * since the registry was published is not trusted.  This costs one stat()
+ * rather than the many system calls realpath() makes.
+ */
+int registry_deref(const char *const alias, char *stratum, size_t len, int *enabled, struct stat *root)
+{
+	size_t field_len;
+	const char *field;
+	if (registry_find("stratum", alias, &field_len) != NULL) {
+		field = alias;
+		field_len = strlen(alias);
+	} else if ((field = registry_find("alias", alias, &field_len)) == NULL) {
+		return -1;
+	}
+	if (field_len > len - 1) {
+		return -1;
+	}
+	memcpy(stratum, field, field_len);
+	stratum[field_len] = '\0';
+
+	if ((field = registry_find("stratum", stratum, &field_len)) == NULL) {
+		return -1;
+	}
+	char fields[64];
+	if (field_len > sizeof(fields) - 1) {
+		return -1;
+	}
+	memcpy(fields, field, field_len);
+	fields[field_len] = '\0';
+	unsigned long long dev;
+	unsigned long long ino;
+	if (sscanf(fields, "%d %llu %llu", enabled, &dev, &ino) != 3) {
+		return -1;
+	}
+
+	size_t alias_len = strlen(alias);
+	char alias_path[STRATA_ROOT_LEN + alias_len + 1];
+	strcpy(alias_path, STRATA_ROOT);
+	strcat(alias_path, alias);
+	if (stat(alias_path, root) < 0 || root->st_dev != dev || root->st_ino != ino) {
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Remove all CROSS_DIR references in specified environment variable.
  */
@@ -301,6 +444,14 @@ int check_cmd_restricted(char *file)
 		cmd = file;
 	}
 
+	size_t len;
+	if (registry_find("restrict", cmd, &len) != NULL) {
+		return 1;
+	}
+	if (registry_find("section", "restrict", &len) != NULL) {
+		return 0;
+	}
+
 	int cmd_len = strlen(cmd);
 	char path[RESTRICTED_CMD_DIR_LEN + cmd_len + 1];
 	strcpy(path, RESTRICTED_CMD_DIR);
@@ -448,7 +599,18 @@ int switch_stratum(const char *alias)
 	}
 
 	char stratum[PATH_MAX];
-	if (deref_alias(alias, stratum, sizeof(stratum)) < 0) {
+	int enabled = 0;
+	struct stat stratum_stbuf;
+	struct stat root_stbuf;
+	if (registry_deref(alias, stratum, sizeof(stratum), &enabled, &stratum_stbuf) >= 0) {
+		/*
+		 * Already at specified stratum.
+		 */
+		if (stat("/", &root_stbuf) >= 0 && root_stbuf.st_dev == stratum_stbuf.st_dev
+			&& root_stbuf.st_ino == stratum_stbuf.st_ino) {
+			return 0;
+		}
+	} else if (deref_alias(alias, stratum, sizeof(stratum)) < 0) {
 		fprintf(stderr, "strat: unable to find stratum \"%s\"\n", alias);
 		return -1;
 	}
@@ -493,6 +655,9 @@ int switch_stratum(const char *alias)
 	strcpy(state_file_path, STATE_DIR);
 	strcat(state_file_path, stratum);
 
+	/*
+	 * The registry's enabled field is not trusted here, as it may be stale.
+	 */
 	if (check_config_secure(state_file_path) >= 0) {
 		/*
 		 * Config is found and secure, we're good to go
@@ -575,6 +740,8 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	registry_open();
+
 	if (flag_unrestrict) {
 		/* flag_unrestrict overrides else-branched restriction code */
 	} else if (flag_restrict && restrict_env() < 0) {
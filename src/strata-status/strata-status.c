@@ -0,0 +1,509 @@
+/*
+ * strata-status.c
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      version 2 as published by the Free Software Foundation.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program checks the health of strata for `brl status`.  For each
+ * enabled stratum it checks:
+ *
+ * - Every [symlinks] entry in bedrock.conf is a symlink to the configured
+ *   target.
+ * - Every expected mount point exists, is of the expected filesystem type,
+ *   is global (the same file as the bedrock stratum's copy), and has the
+ *   expected mount propagation.
+ *
+ * /proc/1/mountinfo and bedrock.conf are each parsed once.  Mount points are
+ * resolved from init's point of view through a file descriptor to init's
+ * root with openat2()'s RESOLVE_IN_ROOT, then matched to mountinfo entries by
+ * mount ID rather than by path.  Strata are checked in parallel.
+ *
+ * Output is one tab-separated record per line, in the order strata were
+ * given:
+ *
+ *     <stratum> status <enabled|disabled|hidden|broken>
+ *     <stratum> missing <mount point>
+ *     <stratum> type <mount point> <found type> <expected type>
+ *     <stratum> local <mount point>
+ *     <stratum> bound <mount point>
+ *     <stratum> shared <mount point>
+ *     <stratum> symlink <path> <expected target>
+ *
+ * A stratum's problems immediately follow its broken status line.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#ifndef STATX_ATTR_MOUNT_ROOT
+#define STATX_ATTR_MOUNT_ROOT 0x00002000
+#endif
+
+#define ENABLED_PATH "/bedrock/run/enabled_strata/"
+#define INIT_MOUNTINFO "/proc/1/mountinfo"
+#define BEDROCK_ROOT "/bedrock/strata/bedrock"
+#define SHOW_LIST_ATTR "user.bedrock.show_list"
+
+struct mount_entry {
+	unsigned long id;
+	char *fstype;
+	/*
+	 * The "shared:N" peer group tag, or NULL if the mount is private.
+	 */
+	char *shared;
+};
+
+struct symlink_cfg {
+	char *link;
+	char *tgt;
+};
+
+/*
+ * A mount point to check and its expectations.  An empty type accepts any
+ * filesystem type.
+ */
+struct mount_cfg {
+	const char *path;
+	const char *type;
+	int share;
+};
+
+struct output {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+struct stratum {
+	const char *name;
+	struct output out;
+};
+
+static struct mount_entry *mounts = NULL;
+static size_t mount_cnt = 0;
+
+static struct symlink_cfg *symlinks = NULL;
+static size_t symlink_cnt = 0;
+
+static struct mount_cfg *stratum_mounts = NULL;
+static size_t stratum_mount_cnt = 0;
+
+/*
+ * The bedrock stratum's expected mounts are fixed rather than configurable.
+ */
+static struct mount_cfg bedrock_mounts[] = {
+	{ "/proc", "proc", 1 },
+	{ "/etc", "fuse.etcfs", 0 },
+	{ "/bedrock/run", "tmpfs", 0 },
+	{ "/bedrock/strata/bedrock", "", 0 },
+	{ "/bedrock/cross", "fuse.crossfs", 0 },
+};
+
+static struct stratum *strata = NULL;
+static size_t stratum_cnt = 0;
+
+static int init_fd = -1;
+static int error_cnt = 0;
+
+static void out_printf(struct output *out, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (out->len + len + 1 > out->alloc) {
+		out->alloc = (out->len + len + 1) * 2;
+		out->buf = xrealloc(out->buf, out->alloc);
+	}
+	va_start(ap, fmt);
+	vsnprintf(out->buf + out->len, len + 1, fmt, ap);
+	va_end(ap);
+	out->len += len;
+}
+
+static void add_stratum_mount(const char *path, int share)
+{
+	stratum_mounts = xrealloc(stratum_mounts, (stratum_mount_cnt + 1) * sizeof(stratum_mounts[0]));
+	stratum_mounts[stratum_mount_cnt].path = xstrdup(path);
+	stratum_mounts[stratum_mount_cnt].type = "";
+	stratum_mounts[stratum_mount_cnt].share = share;
+	stratum_mount_cnt++;
+}
+
+/*
+ * Load [symlinks] and [global] share/bind from bedrock.conf.
+ */
+static void load_entry(const char *section, const char *key, char *value)
+{
+	if (strcmp(section, "symlinks") == 0) {
+		value[strcspn(value, ",")] = '\0';
+		symlinks = xrealloc(symlinks, (symlink_cnt + 1) * sizeof(symlinks[0]));
+		symlinks[symlink_cnt].link = xstrdup(key);
+		symlinks[symlink_cnt].tgt = xstrdup(trim(value));
+		symlink_cnt++;
+	} else if (strcmp(section, "global") == 0 && (strcmp(key, "share") == 0 || strcmp(key, "bind") == 0)) {
+		int share = strcmp(key, "share") == 0;
+		char *vsave = NULL;
+		for (char *v = strtok_r(value, ",", &vsave); v != NULL; v = strtok_r(NULL, ",", &vsave)) {
+			v = trim(v);
+			if (*v != '\0') {
+				add_stratum_mount(v, share);
+			}
+		}
+	}
+}
+
+static int load_config(void)
+{
+	if (cfg_load(load_entry) < 0) {
+		return -1;
+	}
+
+	/*
+	 * Shared mounts are checked before bound ones, followed by /etc.
+	 */
+	struct mount_cfg *sorted = xmalloc((stratum_mount_cnt + 1) * sizeof(sorted[0]));
+	size_t n = 0;
+	for (int share = 1; share >= 0; share--) {
+		for (size_t i = 0; i < stratum_mount_cnt; i++) {
+			if (stratum_mounts[i].share == share) {
+				sorted[n++] = stratum_mounts[i];
+			}
+		}
+	}
+	sorted[n].path = "/etc";
+	sorted[n].type = "fuse.etcfs";
+	sorted[n].share = 0;
+	free(stratum_mounts);
+	stratum_mounts = sorted;
+	stratum_mount_cnt = n + 1;
+	return 0;
+}
+
+static int cmp_mount(const void *a, const void *b)
+{
+	unsigned long x = ((const struct mount_entry *)a)->id;
+	unsigned long y = ((const struct mount_entry *)b)->id;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Index init's mount table by mount ID.
+ */
+static int load_mounts(void)
+{
+	int fd = open(INIT_MOUNTINFO, O_RDONLY | O_CLOEXEC);
+	char *buf = fd >= 0 ? read_file(fd, NULL) : NULL;
+	int err = errno;
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (buf == NULL) {
+		fprintf(stderr, "strata-status: unable to read \"%s\": %s\n", INIT_MOUNTINFO, strerror(err));
+		return -1;
+	}
+
+	size_t alloc = 0;
+	char *save = NULL;
+	for (char *line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		struct mount_entry m = { 0 };
+		char *fsave = NULL;
+		int field = 0;
+		int after_sep = 0;
+		for (char *f = strtok_r(line, " ", &fsave); f != NULL; f = strtok_r(NULL, " ", &fsave)) {
+			field++;
+			if (field == 1) {
+				m.id = strtoul(f, NULL, 10);
+			} else if (after_sep) {
+				m.fstype = xstrdup(f);
+				break;
+			} else if (strcmp(f, "-") == 0 && field >= 7) {
+				after_sep = 1;
+			} else if (field >= 7 && m.shared == NULL && strncmp(f, "shared:", 7) == 0) {
+				m.shared = xstrdup(f);
+			}
+		}
+		if (m.fstype == NULL) {
+			free(m.shared);
+			continue;
+		}
+		if (mount_cnt >= alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			mounts = xrealloc(mounts, alloc * sizeof(mounts[0]));
+		}
+		mounts[mount_cnt++] = m;
+	}
+	free(buf);
+
+	qsort(mounts, mount_cnt, sizeof(mounts[0]), cmp_mount);
+	return 0;
+}
+
+/*
+ * Find the mount whose root is the given file descriptor.  Returns NULL if
+ * the file descriptor is not the root of a mount.
+ */
+static struct mount_entry *mount_at(int fd)
+{
+	struct statx stx;
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_TYPE, &stx) < 0) {
+		return NULL;
+	}
+	/*
+	 * Kernels prior to 5.8 do not report STATX_ATTR_MOUNT_ROOT, in which
+	 * case a path within a mount is mistaken for its root.
+	 */
+	if ((stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) && !(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT)) {
+		return NULL;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	FILE *fp = fopen(path, "re");
+	if (fp == NULL) {
+		return NULL;
+	}
+	struct mount_entry key = { 0 };
+	int found = 0;
+	char line[256];
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		found = sscanf(line, "mnt_id: %lu", &key.id) == 1;
+	}
+	fclose(fp);
+	if (!found) {
+		return NULL;
+	}
+	return bsearch(&key, mounts, mount_cnt, sizeof(mounts[0]), cmp_mount);
+}
+
+/*
+ * Mirrors common-code's mount_details.
+ */
+static void check_mount(struct stratum *s, const char *root, int is_bedrock, const struct mount_cfg *cfg)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", root, cfg->path);
+	int fd = open_in_root(init_fd, path, O_PATH);
+	struct mount_entry *m = fd >= 0 ? mount_at(fd) : NULL;
+	if (m == NULL) {
+		out_printf(&s->out, "%s\tmissing\t%s\n", s->name, cfg->path);
+		goto out;
+	}
+	if (cfg->type[0] != '\0' && strcmp(m->fstype, cfg->type) != 0) {
+		out_printf(&s->out, "%s\ttype\t%s\t%s\t%s\n", s->name, cfg->path, m->fstype, cfg->type);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), BEDROCK_ROOT "%s", cfg->path);
+	int br_fd = open_in_root(init_fd, path, O_PATH);
+	if (br_fd < 0) {
+		out_printf(&s->out, "%s\tlocal\t%s\n", s->name, cfg->path);
+		goto out;
+	}
+
+	/*
+	 * /etc is a virtual filesystem that needs to exist per-stratum, and
+	 * thus comparing it to the bedrock stratum's would indicate it is
+	 * local.  However, the filesystem implementation effectively
+	 * implements global redirects, and thus it is considered global.
+	 */
+	int global = is_bedrock || (strcmp(cfg->path, "/etc") == 0 && strcmp(m->fstype, "fuse.etcfs") == 0);
+	if (!global) {
+		struct stat st;
+		struct stat br_st;
+		global = fstat(fd, &st) == 0 && fstat(br_fd, &br_st) == 0
+			&& st.st_dev == br_st.st_dev && st.st_ino == br_st.st_ino
+			&& st.st_mode == br_st.st_mode && st.st_uid == br_st.st_uid
+			&& st.st_gid == br_st.st_gid && st.st_size == br_st.st_size;
+	}
+
+	struct mount_entry *br_m = mount_at(br_fd);
+	int shared = m->shared != NULL && br_m != NULL && br_m->shared != NULL && strcmp(m->shared, br_m->shared) == 0;
+	close(br_fd);
+
+	if (!global) {
+		out_printf(&s->out, "%s\tlocal\t%s\n", s->name, cfg->path);
+	} else if (!shared && cfg->share) {
+		out_printf(&s->out, "%s\tbound\t%s\n", s->name, cfg->path);
+	} else if (shared && !cfg->share) {
+		out_printf(&s->out, "%s\tshared\t%s\n", s->name, cfg->path);
+	}
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static int mtab_equivalent(const char *actual)
+{
+	return strcmp(actual, "/proc/mounts") == 0 || strcmp(actual, "../proc/mounts") == 0
+		|| strcmp(actual, "/proc/self/mounts") == 0 || strcmp(actual, "../proc/self/mounts") == 0;
+}
+
+static void check_symlinks(struct stratum *s, const char *root)
+{
+	int root_fd = open_in_root(init_fd, root, O_PATH | O_DIRECTORY);
+
+	for (size_t i = 0; i < symlink_cnt; i++) {
+		const char *link = symlinks[i].link;
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%s", link);
+		char *slash = strrchr(dir, '/');
+		const char *base = link;
+		if (slash != NULL) {
+			*slash = '\0';
+			base = slash + 1;
+		} else {
+			dir[0] = '\0';
+		}
+
+		char actual[PATH_MAX] = "";
+		int dir_fd = root_fd >= 0 ? open_in_root(root_fd, dir, O_PATH | O_DIRECTORY) : -1;
+		if (dir_fd >= 0) {
+			ssize_t len = readlinkat(dir_fd, base, actual, sizeof(actual) - 1);
+			actual[len > 0 ? len : 0] = '\0';
+			close(dir_fd);
+		}
+
+		/*
+		 * Hard code /etc/mtab to support effectively equivalent
+		 * variations of /proc/mounts.
+		 */
+		if (strcmp(link, "/etc/mtab") == 0 && mtab_equivalent(actual)) {
+			continue;
+		}
+		if (strcmp(actual, symlinks[i].tgt) != 0) {
+			out_printf(&s->out, "%s\tsymlink\t%s\t%s\n", s->name, link, symlinks[i].tgt);
+		}
+	}
+
+	if (root_fd >= 0) {
+		close(root_fd);
+	}
+}
+
+static void check_stratum(struct stratum *s)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	char init_real[PATH_MAX];
+
+	/*
+	 * Report the problem and carry on with the other strata.
+	 */
+	snprintf(path, sizeof(path), STRATA_PATH "%s", s->name);
+	if (realpath(path, real) == NULL) {
+		fprintf(stderr, "strata-status: unable to resolve \"%s\": %s\n", path, strerror(errno));
+		__atomic_add_fetch(&error_cnt, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	const char *deref = strrchr(real, '/') + 1;
+
+	if (getxattr(path, SHOW_LIST_ATTR, NULL, 0) < 0) {
+		out_printf(&s->out, "%s\tstatus\thidden\n", s->name);
+		return;
+	}
+	snprintf(path, sizeof(path), ENABLED_PATH "%s", deref);
+	if (access(path, F_OK) < 0) {
+		out_printf(&s->out, "%s\tstatus\tdisabled\n", s->name);
+		return;
+	}
+
+	/*
+	 * The stratum's root from init's point of view, mirroring
+	 * common-code's stratum_root --empty.
+	 */
+	char root[PATH_MAX] = "";
+	if (realpath(STRATA_PATH "init", init_real) == NULL || strcmp(real, init_real) != 0) {
+		snprintf(root, sizeof(root), STRATA_PATH "%s", deref);
+	}
+
+	struct output problems = s->out;
+	s->out = (struct output) { 0 };
+
+	check_symlinks(s, root);
+	int is_bedrock = strcmp(deref, "bedrock") == 0;
+	const struct mount_cfg *cfgs = is_bedrock ? bedrock_mounts : stratum_mounts;
+	size_t cnt = is_bedrock ? sizeof(bedrock_mounts) / sizeof(bedrock_mounts[0]) : stratum_mount_cnt;
+	for (size_t i = 0; i < cnt; i++) {
+		check_mount(s, root, is_bedrock, &cfgs[i]);
+	}
+
+	struct output found = s->out;
+	s->out = problems;
+	out_printf(&s->out, "%s\tstatus\t%s\n", s->name, found.len > 0 ? "broken" : "enabled");
+	if (found.len > 0) {
+		out_printf(&s->out, "%s", found.buf);
+	}
+	free(found.buf);
+}
+
+static void check_index(size_t i)
+{
+	check_stratum(&strata[i]);
+}
+
+static void print_help(void)
+{
+	printf(""
+		"Usage: strata-status <strata>\n"
+		"\n"
+		"Check the health of the specified strata, printing tab-separated records.\n"
+		"\n"
+		"Options:\n"
+		"  -h  print this message\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "h")) != -1) {
+		switch (c) {
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+
+	if ((init_fd = open(INIT_ROOT, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "strata-status: unable to open \"%s\": %s\n", INIT_ROOT, strerror(errno));
+		return 1;
+	}
+	if (load_config() < 0 || load_mounts() < 0) {
+		return 1;
+	}
+
+	stratum_cnt = argc - optind;
+	strata = xmalloc((stratum_cnt + 1) * sizeof(strata[0]));
+	memset(strata, 0, (stratum_cnt + 1) * sizeof(strata[0]));
+	for (size_t i = 0; i < stratum_cnt; i++) {
+		strata[i].name = argv[optind + i];
+	}
+
+	for_each_index(stratum_cnt, check_index);
+
+	for (size_t i = 0; i < stratum_cnt; i++) {
+		if (strata[i].out.len > 0) {
+			fwrite(strata[i].out.buf, 1, strata[i].out.len, stdout);
+		}
+	}
+	return error_cnt > 0;
+}